@@ -0,0 +1,161 @@
+#ifndef KONTROLLER_SOCK_BROADCAST_RING_H
+#define KONTROLLER_SOCK_BROADCAST_RING_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+namespace KontrollerSock {
+
+// Storage and algorithm shared by BroadcastRing and FixedBroadcastRing
+template<typename T>
+class BroadcastRingSlots {
+public:
+   static_assert(std::is_trivially_copyable<T>::value, "BroadcastRing values must be trivially copyable");
+
+   struct Slot {
+      std::atomic<uint64_t> sequence; // Sequence number of the stored value plus one, or zero while being written
+      T value;
+   };
+
+   static void initialize(Slot* slots, size_t capacity) {
+      for (size_t i = 0; i < capacity; ++i) {
+         slots[i].sequence.store(0, std::memory_order_relaxed);
+      }
+   }
+
+   static uint64_t publish(Slot* slots, size_t mask, std::atomic<uint64_t>& headSequence, const T& value) {
+      uint64_t sequence = headSequence.load(std::memory_order_relaxed);
+      Slot& slot = slots[sequence & mask];
+
+      // Zero marks the slot as being written
+      slot.sequence.store(0, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      memcpy(&slot.value, &value, sizeof(T));
+
+      slot.sequence.store(sequence + 1, std::memory_order_release);
+      headSequence.store(sequence + 1, std::memory_order_release);
+
+      return sequence;
+   }
+
+   static size_t read(const Slot* slots, size_t mask, uint64_t head, uint64_t& cursor, T* values, size_t maxValues, bool& overrun) {
+      overrun = false;
+
+      uint64_t available = head - cursor;
+      if (available > mask + 1) {
+         overrun = true;
+         return 0;
+      }
+
+      size_t count = available < maxValues ? static_cast<size_t>(available) : maxValues;
+      for (size_t i = 0; i < count; ++i) {
+         uint64_t sequence = cursor + i;
+         const Slot& slot = slots[sequence & mask];
+
+         uint64_t before = slot.sequence.load(std::memory_order_acquire);
+         memcpy(&values[i], &slot.value, sizeof(T));
+         std::atomic_thread_fence(std::memory_order_acquire);
+
+         // The slot was overwritten (or is being overwritten) by a newer value
+         if (before != sequence + 1 || slot.sequence.load(std::memory_order_relaxed) != before) {
+            overrun = true;
+            return 0;
+         }
+      }
+
+      cursor += count;
+      return count;
+   }
+};
+
+// Single-producer / multi-consumer broadcast ring buffer
+// Every published value gets a sequence number, and each consumer tracks its own read cursor (the sequence number of
+// the next value it wants). The producer never waits for consumers - a consumer that falls more than a full ring
+// behind has values overwritten out from under it, which read() detects and reports as an overrun.
+template<typename T>
+class BroadcastRing {
+public:
+   // The capacity is rounded up to a power of two
+   explicit BroadcastRing(size_t minCapacity) : mask(0), headSequence(0) {
+      size_t capacity = 1;
+      while (capacity < minCapacity) {
+         capacity <<= 1;
+      }
+
+      mask = capacity - 1;
+      slots.reset(new Slot[capacity]);
+      Slots::initialize(slots.get(), capacity);
+   }
+
+   size_t capacity() const {
+      return mask + 1;
+   }
+
+   // Sequence number that the next published value will get
+   uint64_t head() const {
+      return headSequence.load(std::memory_order_acquire);
+   }
+
+   // Producer only, returns the sequence number of the published value
+   uint64_t publish(const T& value) {
+      return Slots::publish(slots.get(), mask, headSequence, value);
+   }
+
+   // Copies up to maxValues values starting at the cursor, and advances the cursor past them
+   // If the consumer has fallen too far behind, nothing is read, the cursor is left alone, and overrun is set.
+   size_t read(uint64_t& cursor, T* values, size_t maxValues, bool& overrun) const {
+      return Slots::read(slots.get(), mask, head(), cursor, values, maxValues, overrun);
+   }
+
+private:
+   using Slots = BroadcastRingSlots<T>;
+   using Slot = typename Slots::Slot;
+
+   std::unique_ptr<Slot[]> slots;
+   size_t mask;
+   std::atomic<uint64_t> headSequence;
+};
+
+// BroadcastRing with its slots stored inline, so that it can live in memory shared between processes
+// Must be initialized with initialize() by the producer before use.
+template<typename T, size_t Capacity>
+class FixedBroadcastRing {
+public:
+   static_assert(Capacity > 0 && (Capacity & (Capacity - 1)) == 0, "FixedBroadcastRing capacity must be a power of two");
+
+   void initialize(uint64_t firstSequence) {
+      Slots::initialize(slots, Capacity);
+      headSequence.store(firstSequence, std::memory_order_release);
+   }
+
+   size_t capacity() const {
+      return Capacity;
+   }
+
+   uint64_t head() const {
+      return headSequence.load(std::memory_order_acquire);
+   }
+
+   uint64_t publish(const T& value) {
+      return Slots::publish(slots, Capacity - 1, headSequence, value);
+   }
+
+   size_t read(uint64_t& cursor, T* values, size_t maxValues, bool& overrun) const {
+      return Slots::read(slots, Capacity - 1, head(), cursor, values, maxValues, overrun);
+   }
+
+private:
+   using Slots = BroadcastRingSlots<T>;
+   using Slot = typename Slots::Slot;
+
+   std::atomic<uint64_t> headSequence;
+   Slot slots[Capacity];
+};
+
+} // namespace KontrollerSock
+
+#endif
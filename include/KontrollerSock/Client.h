@@ -1,38 +1,296 @@
 #ifndef KONTROLLER_SOCK_CLIENT_H
 #define KONTROLLER_SOCK_CLIENT_H
 
+#include "KontrollerSock/CompactFrame.h"
+#include "KontrollerSock/Controls.h"
 #include "KontrollerSock/Handles.h"
+#include "KontrollerSock/Metrics.h"
 #include "KontrollerSock/Packet.h"
+#include "KontrollerSock/SeqLock.h"
+#include "KontrollerSock/SpscQueue.h"
 
 #include <Kontroller/Kontroller.h>
 
 #include <atomic>
+#include <chrono>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <string>
 #include <thread>
+#include <utility>
+#include <vector>
 
 namespace KontrollerSock {
 
+class Poller;
+
 class Client {
 public:
+   // Controls to receive events for, as masks with a bit per control id (see getControlMask()), e.g.
+   // { getControlMask(Kontroller::Button::kPlay), 0, getControlMask(Kontroller::Slider::kGroup1) }
+   struct Subscription {
+      uint64_t buttons = kAllControls;
+      uint64_t dials = kAllControls;
+      uint64_t sliders = kAllControls;
+   };
+
+   struct Config {
+      // Ask the server to collapse pending dial / slider events for the same control into the latest value, trading
+      // intermediate positions for bounded bandwidth when this client lags behind
+      bool conflate = false;
+
+      // Capacity of the event queue drained with pollEvents(), or zero to disable it
+      size_t eventQueueCapacity = 0;
+
+      // Receive events over UDP rather than TCP, joining multicastGroup if it isn't nullptr (otherwise the server has to
+      // be sending them to this host). Falls back to TCP if the server isn't sending datagrams.
+      bool datagrams = false;
+      const char* multicastGroup = nullptr;
+
+      // Fraction of datagrams to throw away as they arrive, as if they had been lost on the way (e.g. to exercise
+      // recovering from lost datagrams in a benchmark)
+      double datagramLossRate = 0.0;
+
+      // Ask the server for the compact encoding, which takes a fraction of the bandwidth (e.g. for slow wireless links)
+      // at the cost of dial / slider values being quantized to the controller's native 7 bit resolution
+      bool compact = false;
+
+      // Bit mask of the devices to receive (device i is bit i), for servers serving more than one. Servers that predate
+      // multiple devices only ever send device 0.
+      uint32_t devices = 1;
+
+      // Controls to receive events for (of every device), all of them by default. The server leaves out the rest before
+      // they are queued for this client, so neither side spends any time on them. The state still covers every control,
+      // but unsubscribed ones are only brought up to date when the whole state is sent (e.g. after reconnecting).
+      // Servers that predate subscriptions send everything, as do servers sending datagrams (for device 0).
+      Subscription subscription;
+
+      // How long to wait for each connection attempt to complete before moving on to the next address
+      std::chrono::milliseconds connectTimeout = std::chrono::milliseconds(1000);
+
+      // Delay before trying every endpoint again, once they have all failed (or the connection was lost). The first retry
+      // comes quickly, so that a server restart is picked up right away, and each one after that doubles the delay up to
+      // the maximum. Delays are randomly shortened by up to half, so that clients don't all reconnect in lockstep.
+      std::chrono::milliseconds minReconnectDelay = std::chrono::milliseconds(10);
+      std::chrono::milliseconds maxReconnectDelay = std::chrono::milliseconds(2000);
+
+      // How long resolved addresses are reused before being looked up again (they are kept if the lookup fails)
+      std::chrono::seconds addressLifetime = std::chrono::seconds(60);
+   };
+
+   // A single control change, as delivered to callbacks and the event queue
+   struct Event {
+      EventPacket::Type type; // kButton, kDial, or kSlider (or kEventsDropped from the event queue, see pollEvents())
+      uint16_t id; // Kontroller::Button, Kontroller::Dial, or Kontroller::Slider, depending on the type
+      bool pressed; // Buttons only
+      float value; // Dials and sliders only
+      int64_t latency; // Microseconds from capture on the server until receipt, zero if the server didn't send a capture time
+      uint64_t captureTime; // See getTimestamp(), zero if the server didn't send one (e.g. for changes found in a state)
+      uint16_t device; // Index of the device the control belongs to
+      uint64_t numDropped; // kEventsDropped only: number of events dropped
+   };
+
+   struct Stats {
+      uint64_t eventsReceived = 0;
+      uint64_t eventsMissed = 0; // Events skipped over in the sequence (including any the server conflated, if requested)
+      uint64_t eventsDropped = 0; // Events that never made it into the event queue, see pollEvents()
+      uint64_t latencySamples = 0; // Events received with a capture time
+      int64_t lastLatency = 0; // Microseconds
+      int64_t maxLatency = 0;
+      int64_t totalLatency = 0;
+
+      double averageLatency() const {
+         return latencySamples > 0 ? static_cast<double>(totalLatency) / latencySamples : 0.0;
+      }
+   };
+
+   using ButtonCallback = std::function<void(Kontroller::Button button, bool pressed)>;
+   using DialCallback = std::function<void(Kontroller::Dial dial, float value)>;
+   using SliderCallback = std::function<void(Kontroller::Slider slider, float value)>;
+   using BatchCallback = std::function<void(const Event* events, const EventPacket* packets, size_t numEvents)>;
+
    Client();
 
+   explicit Client(const Config& clientConfig);
+
+   // Connects to the endpoint ("host" or "host:port"), and keeps reconnecting whenever the connection is lost until
+   // shutDown() is called
    void run(const char* endpoint);
 
+   // Like run(endpoint), trying the endpoints in order (e.g. a primary server followed by fallbacks) every time
+   void run(const std::vector<const char*>& endpoints);
+
    void shutDown() {
       shuttingDown = true;
+      wake();
    }
 
-   Kontroller::State getState() {
-      std::lock_guard<std::mutex> lock(mutex);
-      return state;
+   // Asks the server to resend a device's whole state in one message, e.g. after detecting missed events
+   void requestSnapshot(uint16_t device = 0) {
+      if (device < kMaxDevices) {
+         snapshotRequests.fetch_or(1u << device);
+         wake();
+      }
+   }
+
+   // Asks the server to turn one of the controller's LEDs on or off (only servers with Server::Config::ledControl do)
+   // Safe to call from any thread, including callbacks. Commands wake the network thread up and are sent in batches,
+   // with repeated commands for the same LED collapsed into the latest one, and sent again after reconnecting.
+   void setLED(Kontroller::LED led, bool on, uint16_t device = 0);
+
+   // Replaces the subscription (see Config::subscription), safe to call from any thread, and sent to the server right away
+   // Controls that are newly subscribed to are brought up to date, since the server follows up with the state.
+   void subscribe(const Subscription& newSubscription);
+
+   // State accessors never block (and never block the network thread), so they are safe to call every frame
+   // Devices that aren't being received read as a default state.
+   Kontroller::State getState(uint16_t device = 0) const;
+   bool getButton(Kontroller::Button button, uint16_t device = 0) const;
+   float getDial(Kontroller::Dial dial, uint16_t device = 0) const;
+   float getSlider(Kontroller::Slider slider, uint16_t device = 0) const;
+
+   // Callbacks are called on the network thread (after getState() reflects the change), and must not set callbacks
+   // They are called for every device received, use the event queue (or the batch callback) to tell devices apart.
+   void setButtonCallback(ButtonCallback callback);
+   void setDialCallback(DialCallback callback);
+   void setSliderCallback(SliderCallback callback);
+
+   // Called with every batch of events received (from every device) before the per-control callbacks, along with the
+   // packets they came from (in host byte order, with changes found in a state turned into packets), e.g. to relay them
+   void setBatchCallback(BatchCallback callback);
+
+   // Copies up to maxEvents queued events (oldest first) and returns how many were copied, from a single thread only
+   // Events that don't fit wait in order in an overflow list as large as the queue, with a dial / slider change replacing
+   // the one still waiting for the same control (if any) where it is. Once the overflow list is full, button edges are
+   // still kept, pushing out the oldest dial / slider change, while new dial / slider changes are dropped. Every device
+   // that lost changes gets a kEventsDropped event (where it first lost one), after which only getState() reflects
+   // those controls. Only if the list is full of button edges is all of it dropped the same way.
+   size_t pollEvents(Event* events, size_t maxEvents);
+
+   Stats getStats() const;
+
+   const Metrics& getMetrics() const {
+      return metrics;
    }
 
 private:
-   SocketHandle connect(const char* endpoint);
-   void updateState(const EventPacket& packet);
+   struct Endpoint {
+      std::string host;
+      std::string port;
+
+      // Cached, so that reconnecting doesn't have to wait on a lookup
+      std::vector<sockaddr_in> addresses;
+      std::chrono::steady_clock::time_point resolveTime;
+   };
+
+   SocketHandle connect(Endpoint& endpoint);
+   SocketHandle connect(const sockaddr_in& address);
+   void resolve(Endpoint& endpoint);
+   void waitToReconnect(int numFailures, std::minstd_rand& random);
+   bool sendLEDs(Sock::Socket socket);
+   size_t makeSubscriptionPackets(EventPacket* networkPackets);
+   bool sendSubscription(Sock::Socket socket);
+   void applyEvent(uint16_t device, const EventPacket& packet, uint64_t captureTime);
+   void applyTimedEvent(const TimedEventPacket& packet);
+   void applyCompactFrame(const CompactFrameHeader& header, const uint8_t* payload, size_t size);
+   void advanceStreamSequence(uint32_t sequence, uint32_t numEvents);
+   void selectDevice(uint16_t device);
+   int64_t recordLatency(uint64_t captureTime);
+   void applySnapshot(const SnapshotPacket& packet);
+   void applyDatagram(const uint8_t* data, size_t size);
+   void applyDatagramEvent(uint32_t sequence, const EventPacket& packet, uint64_t captureTime);
+   void syncDatagrams(uint32_t sequence);
+   void addOverflowEvent(const Event& event);
+   void indexOverflowEvents();
+   void dropOverflowEvents();
+   void deliverEvents();
+   void wake();
 
+   const Config config;
    std::atomic_bool shuttingDown;
-   std::mutex mutex;
-   Kontroller::State state;
+
+   // What the network thread waits on while run() is connected, woken up when there is something to send to the server
+   std::mutex pollerMutex;
+   Poller* poller; // Guarded by the poller mutex
+   std::atomic<uint32_t> snapshotRequests; // Bit mask of the devices to request the state of
+
+   struct DeviceState {
+      Kontroller::State state {}; // Only touched by the network thread, published after every batch that changes it
+      SeqLock<Kontroller::State> publishedState;
+      bool changed = false;
+
+      // Sequence number expected for the device's next event sent over TCP, unknown until the first one after the state
+      bool streamSequenceKnown = false;
+      uint32_t nextStreamSequence = 0;
+
+      CompactDecoder compactDecoder; // Only touched by the network thread
+   };
+   DeviceState devices[kMaxDevices];
+   uint16_t currentDevice; // Device that what the server sends belongs to (see EventPacket::kDevice)
+
+   // LEDs set through setLED() (as LED masks), guarded by the LED mutex
+   struct LEDState {
+      uint32_t lit = 0;
+      uint32_t set = 0; // Every LED ever set, which are all sent again after reconnecting
+      uint32_t pending = 0; // LEDs changed since they were last sent
+   };
+   std::mutex ledMutex;
+   LEDState leds[kMaxDevices];
+   std::atomic_bool ledsPending;
+
+   std::mutex subscriptionMutex;
+   Subscription subscription; // Guarded by the subscription mutex
+   std::atomic_bool subscriptionPending;
+   bool filtering; // Set while the server is filtering events for us, only touched by the network thread
+
+   // Recorded without locking, through references into the registry
+   Metrics metrics;
+   Counter& eventsReceived;
+   Counter& eventsMissed;
+   Counter& eventsDropped;
+   Counter& bytesReceived;
+   Counter& datagramsReceived;
+   Counter& connectionsLost;
+   Gauge& lastLatency;
+   Histogram& eventLatency; // Microseconds from capture on the server until receipt (negative values from clock skew are recorded as zero)
+   Histogram& applyTime; // Nanoseconds spent applying and publishing each received batch
+   Histogram& resyncTime; // Microseconds from losing the connection until the server starts sending again (with the state)
+   Histogram& connectTime; // Microseconds from calling run() until the first state has been applied
+
+   std::mutex callbackMutex;
+   ButtonCallback buttonCallback;
+   DialCallback dialCallback;
+   SliderCallback sliderCallback;
+   BatchCallback batchCallback;
+
+   std::vector<Event> batchEvents; // Events from the batch being applied
+   std::vector<EventPacket> batchPackets; // The packets each of them came from
+   std::deque<Event> overflowEvents; // Events waiting for room in the queue, no more than its capacity (plus markers)
+   uint64_t overflowStart; // Number of events ever taken from the front of the overflow list
+
+   // Where each dial / slider's change and each device's kEventsDropped event is in the overflow list (counting from the
+   // first event ever added to it, plus one), or zero if it isn't
+   static const size_t kNumOverflowSlots = kNumGroups * 2 + 1;
+   uint64_t overflowSlots[kMaxDevices][kNumOverflowSlots];
+   std::unique_ptr<SpscQueue<Event>> eventQueue;
+
+   // Lines up device 0's events received over UDP with its state received over TCP, only touched by the network thread
+   struct StashedEvent {
+      uint32_t sequence;
+      EventPacket packet;
+      uint64_t captureTime;
+   };
+
+   struct DatagramStream {
+      bool synced = false; // Whether nextSequence is known, i.e. the state has been received
+      bool awaitingState = false; // Whether the state has already been requested
+      uint32_t nextSequence = 0;
+      std::vector<StashedEvent> stashedEvents; // Events received while not synced
+   };
+   DatagramStream datagramStream;
 };
 
 } // namespace KontrollerSock
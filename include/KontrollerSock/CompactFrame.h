@@ -0,0 +1,209 @@
+#ifndef KONTROLLER_SOCK_COMPACT_FRAME_H
+#define KONTROLLER_SOCK_COMPACT_FRAME_H
+
+#include "KontrollerSock/Controls.h"
+#include "KontrollerSock/Packet.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace KontrollerSock {
+
+// Compact event encoding, one or two bytes per event instead of a 24 byte TimedEventPacket
+//
+// The first byte of each event holds its kind in the top two bits:
+//  0 / 1: Button released / pressed, bits 5-0: button id
+//  2 / 3: Dial / slider, bits 5-2: dial / slider id, bits 1-0: value code
+//
+// Dial and slider values are quantized to the controller's native 7 bit (MIDI) resolution, and sent as a change from
+// the previous value sent for the same control where possible. Value codes:
+//  0: The absolute value follows in the next byte
+//  1 / 2: One step up / down from the previous value
+//  3: Same value as before
+//
+// The encoder and decoder both forget all previous values whenever the state is sent, so the first change to each
+// control after that is always absolute.
+
+static_assert(getMaxControlId(kButtonControls) < 64, "Button ids must fit in 6 bits");
+static_assert(getMaxControlId(kDialControls) < 16, "Dial ids must fit in 4 bits");
+static_assert(getMaxControlId(kSliderControls) < 16, "Slider ids must fit in 4 bits");
+
+// Largest encoded size of a single event
+static const size_t kMaxCompactEventSize = 2;
+
+class CompactValues {
+public:
+   static const uint8_t kMaxValue = 127;
+
+   static uint8_t quantize(float value) {
+      float clamped = value < 0.0f ? 0.0f : (value > 1.0f ? 1.0f : value);
+      return static_cast<uint8_t>(std::lround(clamped * kMaxValue));
+   }
+
+   static float dequantize(uint8_t value) {
+      return static_cast<float>(value) / kMaxValue;
+   }
+
+   void reset() {
+      known[0] = known[1] = 0;
+   }
+
+protected:
+   enum Kind : uint8_t {
+      kReleased = 0,
+      kPressed = 1,
+      kDial = 2,
+      kSlider = 3
+   };
+
+   enum ValueCode : uint8_t {
+      kAbsolute = 0,
+      kStepUp = 1,
+      kStepDown = 2,
+      kUnchanged = 3
+   };
+
+   // Previous values of the dials (0) and sliders (1), only valid where the matching bit is set in known
+   uint8_t values[2][16] = {};
+   uint16_t known[2] = {};
+};
+
+class CompactEncoder : public CompactValues {
+public:
+   // Appends the encoded event, returns false (appending nothing) if it isn't a button / dial / slider event
+   bool encode(const EventPacket& event, std::vector<uint8_t>& buffer) {
+      if (event.type == EventPacket::kButton) {
+         if (event.id >= 64) {
+            return false;
+         }
+
+         uint8_t kind = event.value != 0 ? kPressed : kReleased;
+         buffer.push_back(static_cast<uint8_t>((kind << 6) | event.id));
+         return true;
+      }
+
+      if ((event.type != EventPacket::kDial && event.type != EventPacket::kSlider) || event.id >= 16) {
+         return false;
+      }
+
+      float floatValue = 0.0f;
+      memcpy(&floatValue, &event.value, sizeof(floatValue));
+      uint8_t value = quantize(floatValue);
+
+      int table = event.type == EventPacket::kDial ? 0 : 1;
+      uint16_t bit = static_cast<uint16_t>(1 << event.id);
+      uint8_t code = kAbsolute;
+      if (known[table] & bit) {
+         uint8_t previous = values[table][event.id];
+         if (value == previous) {
+            code = kUnchanged;
+         } else if (value == previous + 1) {
+            code = kStepUp;
+         } else if (value + 1 == previous) {
+            code = kStepDown;
+         }
+      }
+
+      uint8_t kind = table == 0 ? kDial : kSlider;
+      buffer.push_back(static_cast<uint8_t>((kind << 6) | (event.id << 2) | code));
+      if (code == kAbsolute) {
+         buffer.push_back(value);
+      }
+
+      values[table][event.id] = value;
+      known[table] |= bit;
+      return true;
+   }
+};
+
+class CompactDecoder : public CompactValues {
+public:
+   // Decodes a single event, returns the number of bytes used (or 0 if the data is incomplete or malformed)
+   size_t decode(const uint8_t* data, size_t size, EventPacket& event) {
+      if (size < 1) {
+         return 0;
+      }
+
+      uint8_t kind = data[0] >> 6;
+      if (kind == kReleased || kind == kPressed) {
+         event.type = EventPacket::kButton;
+         event.id = data[0] & 0x3F;
+         event.value = kind == kPressed ? 1 : 0;
+         return 1;
+      }
+
+      int table = kind == kDial ? 0 : 1;
+      uint16_t id = (data[0] >> 2) & 0x0F;
+      uint16_t bit = static_cast<uint16_t>(1 << id);
+      uint8_t code = data[0] & 0x03;
+
+      size_t used = 1;
+      uint8_t value = 0;
+      if (code == kAbsolute) {
+         if (size < 2 || data[1] > kMaxValue) {
+            return 0;
+         }
+
+         value = data[1];
+         used = 2;
+      } else {
+         // Relative values only make sense if the previous one is known
+         if (!(known[table] & bit)) {
+            return 0;
+         }
+
+         uint8_t previous = values[table][id];
+         value = code == kStepUp ? previous + 1 : (code == kStepDown ? previous - 1 : previous);
+         if (value > kMaxValue) {
+            return 0;
+         }
+      }
+
+      values[table][id] = value;
+      known[table] |= bit;
+
+      float floatValue = dequantize(value);
+      event.type = kind == kDial ? EventPacket::kDial : EventPacket::kSlider;
+      event.id = id;
+      memcpy(&event.value, &floatValue, sizeof(event.value));
+      return used;
+   }
+};
+
+// Appends the events as compact frames (with headers in network byte order), starting a new frame whenever one would
+// exceed kMaxCompactFramePayload. Returns the number of frames appended.
+inline size_t appendCompactFrames(std::vector<uint8_t>& buffer, const TimedEventPacket* packets, size_t numPackets, CompactEncoder& encoder) {
+   size_t numFrames = 0;
+   size_t index = 0;
+
+   while (index < numPackets) {
+      size_t headerOffset = buffer.size();
+      buffer.resize(headerOffset + sizeof(CompactFrameHeader));
+
+      CompactFrameHeader header;
+      header.header.type = EventPacket::kCompactFrame;
+      header.header.value = packets[index].header.value;
+      header.setCaptureTime(packets[index].getCaptureTime());
+
+      size_t payloadOffset = buffer.size();
+      while (index < numPackets && buffer.size() - payloadOffset + kMaxCompactEventSize <= kMaxCompactFramePayload) {
+         encoder.encode(packets[index].event, buffer);
+         ++index;
+      }
+
+      header.header.id = static_cast<uint16_t>(buffer.size() - payloadOffset);
+      CompactFrameHeader networkHeader = hostToNetwork(header);
+      memcpy(buffer.data() + headerOffset, &networkHeader, sizeof(networkHeader));
+      ++numFrames;
+   }
+
+   return numFrames;
+}
+
+} // namespace KontrollerSock
+
+#endif
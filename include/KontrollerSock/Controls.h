@@ -0,0 +1,283 @@
+#ifndef KONTROLLER_SOCK_CONTROLS_H
+#define KONTROLLER_SOCK_CONTROLS_H
+
+#include "KontrollerSock/Packet.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+namespace KontrollerSock {
+
+// Where a control's value lives in a Kontroller::State
+struct ControlDescriptor {
+   uint16_t id; // Kontroller::Button, Kontroller::Dial, or Kontroller::Slider value
+   uint16_t offset; // Byte offset of the value within Kontroller::State
+};
+
+using StateGroup = std::remove_reference<decltype(std::declval<Kontroller::State&>().groups[0])>::type;
+
+constexpr ControlDescriptor makeControl(Kontroller::Button button, size_t offset) {
+   return { static_cast<uint16_t>(button), static_cast<uint16_t>(offset) };
+}
+
+constexpr ControlDescriptor makeControl(Kontroller::Dial dial, size_t offset) {
+   return { static_cast<uint16_t>(dial), static_cast<uint16_t>(offset) };
+}
+
+constexpr ControlDescriptor makeControl(Kontroller::Slider slider, size_t offset) {
+   return { static_cast<uint16_t>(slider), static_cast<uint16_t>(offset) };
+}
+
+constexpr size_t groupOffset(int group, size_t fieldOffset) {
+   return offsetof(Kontroller::State, groups) + group * sizeof(StateGroup) + fieldOffset;
+}
+
+// Every button, in snapshot bit order
+constexpr ControlDescriptor kButtonControls[] = {
+   makeControl(Kontroller::Button::kTrackPrevious, offsetof(Kontroller::State, trackPrevious)),
+   makeControl(Kontroller::Button::kTrackNext, offsetof(Kontroller::State, trackNext)),
+   makeControl(Kontroller::Button::kCycle, offsetof(Kontroller::State, cycle)),
+   makeControl(Kontroller::Button::kMarkerSet, offsetof(Kontroller::State, markerSet)),
+   makeControl(Kontroller::Button::kMarkerPrevious, offsetof(Kontroller::State, markerPrevious)),
+   makeControl(Kontroller::Button::kMarkerNext, offsetof(Kontroller::State, markerNext)),
+   makeControl(Kontroller::Button::kRewind, offsetof(Kontroller::State, rewind)),
+   makeControl(Kontroller::Button::kFastForward, offsetof(Kontroller::State, fastForward)),
+   makeControl(Kontroller::Button::kStop, offsetof(Kontroller::State, stop)),
+   makeControl(Kontroller::Button::kPlay, offsetof(Kontroller::State, play)),
+   makeControl(Kontroller::Button::kRecord, offsetof(Kontroller::State, record)),
+   makeControl(Kontroller::Button::kGroup1Solo, groupOffset(0, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup1Mute, groupOffset(0, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup1Record, groupOffset(0, offsetof(StateGroup, record))),
+   makeControl(Kontroller::Button::kGroup2Solo, groupOffset(1, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup2Mute, groupOffset(1, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup2Record, groupOffset(1, offsetof(StateGroup, record))),
+   makeControl(Kontroller::Button::kGroup3Solo, groupOffset(2, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup3Mute, groupOffset(2, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup3Record, groupOffset(2, offsetof(StateGroup, record))),
+   makeControl(Kontroller::Button::kGroup4Solo, groupOffset(3, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup4Mute, groupOffset(3, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup4Record, groupOffset(3, offsetof(StateGroup, record))),
+   makeControl(Kontroller::Button::kGroup5Solo, groupOffset(4, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup5Mute, groupOffset(4, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup5Record, groupOffset(4, offsetof(StateGroup, record))),
+   makeControl(Kontroller::Button::kGroup6Solo, groupOffset(5, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup6Mute, groupOffset(5, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup6Record, groupOffset(5, offsetof(StateGroup, record))),
+   makeControl(Kontroller::Button::kGroup7Solo, groupOffset(6, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup7Mute, groupOffset(6, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup7Record, groupOffset(6, offsetof(StateGroup, record))),
+   makeControl(Kontroller::Button::kGroup8Solo, groupOffset(7, offsetof(StateGroup, solo))),
+   makeControl(Kontroller::Button::kGroup8Mute, groupOffset(7, offsetof(StateGroup, mute))),
+   makeControl(Kontroller::Button::kGroup8Record, groupOffset(7, offsetof(StateGroup, record)))
+};
+
+// Every dial / slider, in group order
+constexpr ControlDescriptor kDialControls[] = {
+   makeControl(Kontroller::Dial::kGroup1, groupOffset(0, offsetof(StateGroup, dial))),
+   makeControl(Kontroller::Dial::kGroup2, groupOffset(1, offsetof(StateGroup, dial))),
+   makeControl(Kontroller::Dial::kGroup3, groupOffset(2, offsetof(StateGroup, dial))),
+   makeControl(Kontroller::Dial::kGroup4, groupOffset(3, offsetof(StateGroup, dial))),
+   makeControl(Kontroller::Dial::kGroup5, groupOffset(4, offsetof(StateGroup, dial))),
+   makeControl(Kontroller::Dial::kGroup6, groupOffset(5, offsetof(StateGroup, dial))),
+   makeControl(Kontroller::Dial::kGroup7, groupOffset(6, offsetof(StateGroup, dial))),
+   makeControl(Kontroller::Dial::kGroup8, groupOffset(7, offsetof(StateGroup, dial)))
+};
+
+constexpr ControlDescriptor kSliderControls[] = {
+   makeControl(Kontroller::Slider::kGroup1, groupOffset(0, offsetof(StateGroup, slider))),
+   makeControl(Kontroller::Slider::kGroup2, groupOffset(1, offsetof(StateGroup, slider))),
+   makeControl(Kontroller::Slider::kGroup3, groupOffset(2, offsetof(StateGroup, slider))),
+   makeControl(Kontroller::Slider::kGroup4, groupOffset(3, offsetof(StateGroup, slider))),
+   makeControl(Kontroller::Slider::kGroup5, groupOffset(4, offsetof(StateGroup, slider))),
+   makeControl(Kontroller::Slider::kGroup6, groupOffset(5, offsetof(StateGroup, slider))),
+   makeControl(Kontroller::Slider::kGroup7, groupOffset(6, offsetof(StateGroup, slider))),
+   makeControl(Kontroller::Slider::kGroup8, groupOffset(7, offsetof(StateGroup, slider)))
+};
+
+constexpr size_t kNumButtons = sizeof(kButtonControls) / sizeof(kButtonControls[0]);
+constexpr size_t kNumGroups = sizeof(kDialControls) / sizeof(kDialControls[0]);
+static_assert(kNumButtons <= 64, "Snapshots only have room for 64 buttons");
+static_assert(sizeof(kSliderControls) / sizeof(kSliderControls[0]) == kNumGroups, "Every group needs a dial and a slider");
+
+template<size_t N>
+constexpr uint16_t getMaxControlId(const ControlDescriptor (&controls)[N]) {
+   uint16_t maxId = 0;
+   for (size_t i = 0; i < N; ++i) {
+      maxId = controls[i].id > maxId ? controls[i].id : maxId;
+   }
+
+   return maxId;
+}
+
+// Maps control ids to their index in a descriptor table, -1 for ids that aren't in it
+template<size_t MaxId>
+struct ControlIndex {
+   int8_t indices[MaxId + 1];
+
+   int find(uint16_t id) const {
+      return id <= MaxId ? indices[id] : -1;
+   }
+};
+
+template<size_t MaxId, size_t N>
+constexpr ControlIndex<MaxId> makeControlIndex(const ControlDescriptor (&controls)[N]) {
+   ControlIndex<MaxId> index = {};
+   for (size_t id = 0; id <= MaxId; ++id) {
+      index.indices[id] = -1;
+   }
+   for (size_t i = 0; i < N; ++i) {
+      index.indices[controls[i].id] = static_cast<int8_t>(i);
+   }
+
+   return index;
+}
+
+constexpr ControlIndex<getMaxControlId(kButtonControls)> kButtonIndex = makeControlIndex<getMaxControlId(kButtonControls)>(kButtonControls);
+constexpr ControlIndex<getMaxControlId(kDialControls)> kDialIndex = makeControlIndex<getMaxControlId(kDialControls)>(kDialControls);
+constexpr ControlIndex<getMaxControlId(kSliderControls)> kSliderIndex = makeControlIndex<getMaxControlId(kSliderControls)>(kSliderControls);
+
+// Bit for an LED in kSetLEDs / kClearLEDs masks
+constexpr uint32_t getLEDMask(Kontroller::LED led) {
+   return 1u << static_cast<uint32_t>(led);
+}
+
+static_assert(static_cast<uint32_t>(Kontroller::LED::kGroup8Record) < 32, "Every LED needs a bit in LED masks");
+constexpr uint32_t kAllLEDs = ((getLEDMask(Kontroller::LED::kGroup8Record) << 1) - 1) & ~getLEDMask(Kontroller::LED::kNone);
+
+// Subscriptions (see kSubscribe) are a mask per control type, from kButton to kSlider, with a bit per control id
+static const size_t kNumControlTypes = 3;
+constexpr uint64_t kAllControls = ~0ull;
+
+static_assert(getMaxControlId(kButtonControls) < 64 && getMaxControlId(kDialControls) < 64 && getMaxControlId(kSliderControls) < 64, "Every control needs a bit in subscription masks");
+
+constexpr uint64_t getControlMask(Kontroller::Button button) {
+   return 1ull << static_cast<uint64_t>(button);
+}
+
+constexpr uint64_t getControlMask(Kontroller::Dial dial) {
+   return 1ull << static_cast<uint64_t>(dial);
+}
+
+constexpr uint64_t getControlMask(Kontroller::Slider slider) {
+   return 1ull << static_cast<uint64_t>(slider);
+}
+
+// Whether an event is for a subscribed control (anything other than a control event always is)
+inline bool isSubscribed(const uint64_t (&subscriptions)[kNumControlTypes], const EventPacket& event) {
+   if (event.type < EventPacket::kButton || event.type > EventPacket::kSlider || event.id >= 64) {
+      return true;
+   }
+
+   return ((subscriptions[event.type - EventPacket::kButton] >> event.id) & 1) != 0;
+}
+
+// Reference to the control's value in the state (const if the state is)
+template<typename ValueType, typename StateType>
+auto getControlValue(StateType& state, const ControlDescriptor& control) -> typename std::conditional<std::is_const<StateType>::value, const ValueType&, ValueType&>::type {
+   using Byte = typename std::conditional<std::is_const<StateType>::value, const uint8_t, uint8_t>::type;
+   using Value = typename std::conditional<std::is_const<StateType>::value, const ValueType, ValueType>::type;
+
+   return *reinterpret_cast<Value*>(reinterpret_cast<Byte*>(&state) + control.offset);
+}
+
+// Pointers to the value of the control with the given id, or nullptr if there is no such control
+template<typename StateType>
+auto getButtonValue(StateType& state, uint16_t id) -> decltype(&state.play) {
+   int index = kButtonIndex.find(id);
+   return index >= 0 ? &getControlValue<bool>(state, kButtonControls[index]) : nullptr;
+}
+
+template<typename StateType>
+auto getDialValue(StateType& state, uint16_t id) -> decltype(&state.groups[0].dial) {
+   int index = kDialIndex.find(id);
+   return index >= 0 ? &getControlValue<float>(state, kDialControls[index]) : nullptr;
+}
+
+template<typename StateType>
+auto getSliderValue(StateType& state, uint16_t id) -> decltype(&state.groups[0].slider) {
+   int index = kSliderIndex.find(id);
+   return index >= 0 ? &getControlValue<float>(state, kSliderControls[index]) : nullptr;
+}
+
+// Applies a button / dial / slider event (in host byte order) to the state, returning false for anything else
+inline bool applyControlEvent(Kontroller::State& state, const EventPacket& event) {
+   float floatValue = 0.0f;
+   memcpy(&floatValue, &event.value, sizeof(floatValue));
+
+   switch (event.type) {
+   case EventPacket::kButton:
+      if (bool* value = getButtonValue(state, event.id)) {
+         *value = event.value != 0;
+         return true;
+      }
+      break;
+   case EventPacket::kDial:
+      if (float* value = getDialValue(state, event.id)) {
+         *value = floatValue;
+         return true;
+      }
+      break;
+   case EventPacket::kSlider:
+      if (float* value = getSliderValue(state, event.id)) {
+         *value = floatValue;
+         return true;
+      }
+      break;
+   }
+
+   return false;
+}
+
+// Event packet for a control's value, as passed to forEachChangedControl()'s function
+inline EventPacket makeControlPacket(EventPacket::Type type, uint16_t id, bool pressed, float value) {
+   EventPacket packet;
+   packet.type = type;
+   packet.id = id;
+   if (type == EventPacket::kButton) {
+      packet.value = static_cast<uint32_t>(pressed);
+   } else {
+      static_assert(sizeof(packet.value) == sizeof(value), "Packet data size does not match event data size");
+      memcpy(&packet.value, &value, sizeof(packet.value));
+   }
+
+   return packet;
+}
+
+// Calls function(type, id, pressed, value) for every control whose value differs between the two states, buttons first
+template<typename Function>
+void forEachChangedControl(const Kontroller::State& previous, const Kontroller::State& current, Function function) {
+   // Most comparisons find nothing changed, which a single memcmp() settles (padding can only cause false positives)
+   if (memcmp(&previous, &current, sizeof(current)) == 0) {
+      return;
+   }
+
+   for (const ControlDescriptor& control : kButtonControls) {
+      bool value = getControlValue<bool>(current, control);
+      if (value != getControlValue<bool>(previous, control)) {
+         function(EventPacket::kButton, control.id, value, 0.0f);
+      }
+   }
+
+   for (const ControlDescriptor& control : kDialControls) {
+      float value = getControlValue<float>(current, control);
+      if (value != getControlValue<float>(previous, control)) {
+         function(EventPacket::kDial, control.id, false, value);
+      }
+   }
+
+   for (const ControlDescriptor& control : kSliderControls) {
+      float value = getControlValue<float>(current, control);
+      if (value != getControlValue<float>(previous, control)) {
+         function(EventPacket::kSlider, control.id, false, value);
+      }
+   }
+}
+
+} // namespace KontrollerSock
+
+#endif
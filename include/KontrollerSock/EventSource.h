@@ -0,0 +1,90 @@
+#ifndef KONTROLLER_SOCK_EVENT_SOURCE_H
+#define KONTROLLER_SOCK_EVENT_SOURCE_H
+
+#include "KontrollerSock/Packet.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <utility>
+
+namespace KontrollerSock {
+
+// Where a Server gets controller events from
+// Callbacks must all be called from the same thread, with getState() already reflecting the change. getState() may also
+// be called from another thread, when the server samples the state (see Server::Config::publishInterval).
+class EventSource {
+public:
+   using ButtonCallback = std::function<void(Kontroller::Button button, bool pressed)>;
+   using DialCallback = std::function<void(Kontroller::Dial dial, float value)>;
+   using SliderCallback = std::function<void(Kontroller::Slider slider, float value)>;
+   using EventsCallback = std::function<void(const EventPacket* events, size_t numEvents, uint64_t captureTime)>;
+
+   virtual ~EventSource() = default;
+
+   virtual Kontroller::State getState() = 0;
+
+   virtual void setButtonCallback(ButtonCallback callback) = 0;
+   virtual void setDialCallback(DialCallback callback) = 0;
+   virtual void setSliderCallback(SliderCallback callback) = 0;
+
+   // Batches of events that were captured elsewhere (see getTimestamp()), for sources relaying another server's events
+   // Sources that accept the callback report events through it instead of the per-control callbacks, so that the
+   // events keep their capture time.
+   virtual bool setEventsCallback(EventsCallback /*callback*/) {
+      return false;
+   }
+
+   // Takes control of the device's LEDs away from the device itself (or hands it back), for sources that have any
+   // LEDs are only ever set from a single thread, which needn't be the callback thread.
+   virtual bool enableLEDControl(bool /*enable*/) {
+      return false;
+   }
+
+   virtual void setLED(Kontroller::LED /*led*/, bool /*on*/) {
+   }
+
+   // Whether only this source's server ever sets its LEDs, so that they can start off all turned off
+   // Sources passing LED commands on to a device that others set too (e.g. a relay's upstream device) keep them as
+   // they are, and only pass on what their own clients request.
+   virtual bool ownsLEDs() const {
+      return true;
+   }
+};
+
+// Events from the physical device
+class KontrollerEventSource : public EventSource {
+public:
+   Kontroller::State getState() override {
+      return kontroller.getState();
+   }
+
+   void setButtonCallback(ButtonCallback callback) override {
+      kontroller.setButtonCallback(std::move(callback));
+   }
+
+   void setDialCallback(DialCallback callback) override {
+      kontroller.setDialCallback(std::move(callback));
+   }
+
+   void setSliderCallback(SliderCallback callback) override {
+      kontroller.setSliderCallback(std::move(callback));
+   }
+
+   bool enableLEDControl(bool enable) override {
+      return kontroller.enableLEDControl(enable);
+   }
+
+   void setLED(Kontroller::LED led, bool on) override {
+      kontroller.setLEDOn(led, on);
+   }
+
+private:
+   Kontroller kontroller;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -57,6 +57,13 @@ using SocketHandle = ResourceHandle<Sock::Socket, Sock::kInvalidSocket, decltype
 
 using AddrInfoHandle = ResourceHandle<addrinfo*, nullptr, decltype(Sock::freeaddrinfo), Sock::freeaddrinfo>;
 
+#if SOCK_POSIX
+inline void fileDescriptorDeleter(int fileDescriptor) {
+   ::close(fileDescriptor);
+}
+using FileDescriptorHandle = ResourceHandle<int, -1, decltype(fileDescriptorDeleter), fileDescriptorDeleter>;
+#endif
+
 } // namespace KontrollerSock
 
 #endif
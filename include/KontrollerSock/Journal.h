@@ -0,0 +1,168 @@
+#ifndef KONTROLLER_SOCK_JOURNAL_H
+#define KONTROLLER_SOCK_JOURNAL_H
+
+#include "KontrollerSock/Packet.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <type_traits>
+
+namespace KontrollerSock {
+
+// Path of the journal a device is recorded into, the base path for device 0 and "<path>.<device>" for the others
+inline std::string getJournalPath(const char* path, uint16_t device) {
+   return device == 0 ? std::string(path) : std::string(path) + "." + std::to_string(device);
+}
+
+// A journal is an append-only file of fixed size blocks, following a header that takes up the first block
+// Every block starts with a checkpoint of the full state, so any point in the journal can be reached by binary searching
+// the checkpoints and applying the events of a single block. Everything is in host byte order, like shared memory.
+static const size_t kJournalBlockSize = 4096;
+
+struct JournalHeader {
+   static const uint32_t kMagic = 0x4B534A4C; // "KSJL"
+   static const uint32_t kVersion = 1;
+
+   uint32_t magic;
+   uint32_t version;
+   uint32_t blockSize; // kJournalBlockSize, as seen by the writer
+   uint32_t stateSize; // sizeof(Kontroller::State), as seen by the writer
+   uint64_t startTime; // When recording started, see getTimestamp()
+};
+
+struct JournalEvent {
+   uint64_t captureTime; // See getTimestamp()
+   EventPacket event;
+};
+
+// The state as of the start of a block
+struct JournalCheckpoint {
+   static const uint32_t kMagic = 0x4B534350; // "KSCP"
+
+   uint32_t magic; // Zero for blocks the writer hasn't reached yet
+   std::atomic<uint32_t> numEvents; // Stored after each event is written, so readers never see a partial event
+   uint64_t time; // Capture time of the block's first event (or the start time, for the first block)
+   uint64_t sequence; // Sequence number of the block's first event
+   Kontroller::State state;
+};
+
+static const size_t kJournalEventsPerBlock = (kJournalBlockSize - sizeof(JournalCheckpoint)) / sizeof(JournalEvent);
+
+struct JournalBlock {
+   JournalCheckpoint checkpoint;
+   JournalEvent events[kJournalEventsPerBlock];
+};
+static_assert(sizeof(JournalHeader) <= kJournalBlockSize && sizeof(JournalBlock) <= kJournalBlockSize, "Journal structures must fit in a block");
+static_assert(std::is_trivially_copyable<Kontroller::State>::value, "The state is stored in the journal as is");
+
+// Records a device's events into a journal, mapping the file a chunk at a time as it grows
+// Only ever used from one thread at a time. Whatever has been appended survives the process crashing. A thread of its own
+// extends and maps the next chunk ahead of time (and unmaps full ones), so appending only ever touches memory unless it
+// catches up with that thread.
+class JournalWriter {
+public:
+   JournalWriter();
+   JournalWriter(const JournalWriter& other) = delete;
+   JournalWriter& operator=(const JournalWriter& other) = delete;
+
+   ~JournalWriter();
+
+   // Replaces any existing file, starting from the given state and the sequence number of the first event to come
+   bool create(const char* path, const Kontroller::State& initialState, uint64_t sequence);
+
+   // Appends an event, starting a new block whenever the current one is full
+   // Stops recording (after reporting why) if the file can't be extended.
+   void append(const TimedEventPacket& packet);
+
+   void close();
+
+   uint64_t getEventsWritten() const {
+      return eventsWritten;
+   }
+
+   explicit operator bool() const {
+      return block != nullptr;
+   }
+
+private:
+   bool startBlock(uint64_t time);
+   bool advanceChunk();
+   void runMapThread();
+
+   int fileDescriptor;
+   uint8_t* chunk; // Blocks [chunkFirstBlock, chunkFirstBlock + kBlocksPerChunk)
+   uint64_t chunkFirstBlock;
+   JournalBlock* block; // Block being written
+   uint64_t numBlocks;
+
+   Kontroller::State state; // As of the last event appended, for the next checkpoint
+   uint64_t sequence;
+   uint64_t eventsWritten;
+
+   std::thread mapThread;
+   std::mutex mapMutex;
+   std::condition_variable mapCv;
+
+   // Guarded by the map mutex
+   bool stopMapping;
+   bool prepareRequested; // Set when the chunk after the current one is wanted
+   uint8_t* preparedChunk; // Blocks [chunkFirstBlock + kBlocksPerChunk, chunkFirstBlock + 2 * kBlocksPerChunk) once mapped
+   bool prepareFailed;
+   uint8_t* retiredChunk; // Full chunk waiting to be unmapped
+};
+
+// Maps a whole journal read-only, for replaying it
+class JournalReader {
+public:
+   JournalReader();
+   JournalReader(const JournalReader& other) = delete;
+   JournalReader& operator=(const JournalReader& other) = delete;
+
+   ~JournalReader();
+
+   bool open(const char* path);
+
+   void close();
+
+   explicit operator bool() const {
+      return header != nullptr;
+   }
+
+   const JournalHeader& getHeader() const {
+      return *header;
+   }
+
+   // Blocks the writer had started by the time the journal was opened
+   uint64_t getNumBlocks() const {
+      return numBlocks;
+   }
+
+   const JournalBlock& getBlock(uint64_t index) const;
+
+   uint32_t getNumEvents(uint64_t index) const {
+      return getBlock(index).checkpoint.numEvents.load(std::memory_order_acquire);
+   }
+
+   // Index of the last block starting no later than the given time (or the first block, if they all start later)
+   uint64_t findBlock(uint64_t time) const;
+
+   // Capture times of the first and last events
+   uint64_t getStartTime() const;
+   uint64_t getEndTime() const;
+
+private:
+   const JournalHeader* header;
+   size_t size;
+   uint64_t numBlocks;
+};
+
+} // namespace KontrollerSock
+
+#endif
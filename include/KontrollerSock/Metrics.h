@@ -0,0 +1,251 @@
+#ifndef KONTROLLER_SOCK_METRICS_H
+#define KONTROLLER_SOCK_METRICS_H
+
+#include <atomic>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace KontrollerSock {
+
+// Monotonically increasing count
+class Counter {
+public:
+   void add(uint64_t amount = 1) {
+      value.fetch_add(amount, std::memory_order_relaxed);
+   }
+
+   uint64_t get() const {
+      return value.load(std::memory_order_relaxed);
+   }
+
+private:
+   std::atomic<uint64_t> value { 0 };
+};
+
+// Value that can go up and down
+class Gauge {
+public:
+   void set(int64_t newValue) {
+      value.store(newValue, std::memory_order_relaxed);
+   }
+
+   void add(int64_t amount) {
+      value.fetch_add(amount, std::memory_order_relaxed);
+   }
+
+   int64_t get() const {
+      return value.load(std::memory_order_relaxed);
+   }
+
+private:
+   std::atomic<int64_t> value { 0 };
+};
+
+// Distribution of values in fixed log-linear buckets (in the style of an HDR histogram)
+// Every power of two range is split into kSubBuckets equal buckets, so recorded values are kept to within 12.5% across
+// the whole 64 bit range with a fixed amount of memory. Recording is a handful of relaxed atomic operations.
+class Histogram {
+public:
+   static const int kSubBucketBits = 3;
+   static const uint64_t kSubBuckets = 1 << kSubBucketBits;
+   static const size_t kNumBuckets = (64 - kSubBucketBits + 1) * kSubBuckets;
+
+   Histogram() {
+      for (std::atomic<uint64_t>& bucket : buckets) {
+         bucket.store(0, std::memory_order_relaxed);
+      }
+   }
+
+   void record(uint64_t value) {
+      buckets[getBucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+      total.fetch_add(1, std::memory_order_relaxed);
+      sum.fetch_add(value, std::memory_order_relaxed);
+
+      uint64_t currentMax = max.load(std::memory_order_relaxed);
+      while (value > currentMax && !max.compare_exchange_weak(currentMax, value, std::memory_order_relaxed)) {
+      }
+   }
+
+   // Adds all of the other histogram's values to this one
+   void merge(const Histogram& other) {
+      for (size_t i = 0; i < kNumBuckets; ++i) {
+         buckets[i].fetch_add(other.buckets[i].load(std::memory_order_relaxed), std::memory_order_relaxed);
+      }
+      total.fetch_add(other.getCount(), std::memory_order_relaxed);
+      sum.fetch_add(other.getSum(), std::memory_order_relaxed);
+
+      uint64_t otherMax = other.getMax();
+      uint64_t currentMax = max.load(std::memory_order_relaxed);
+      while (otherMax > currentMax && !max.compare_exchange_weak(currentMax, otherMax, std::memory_order_relaxed)) {
+      }
+   }
+
+   uint64_t getCount() const {
+      return total.load(std::memory_order_relaxed);
+   }
+
+   uint64_t getSum() const {
+      return sum.load(std::memory_order_relaxed);
+   }
+
+   uint64_t getMax() const {
+      return max.load(std::memory_order_relaxed);
+   }
+
+   double getMean() const {
+      uint64_t count = getCount();
+      return count > 0 ? static_cast<double>(getSum()) / count : 0.0;
+   }
+
+   // Upper bound of the bucket containing the given percentile (0 - 100)
+   uint64_t getPercentile(double percentile) const {
+      uint64_t count = getCount();
+      if (count == 0) {
+         return 0;
+      }
+
+      uint64_t target = static_cast<uint64_t>(percentile / 100.0 * count + 0.5);
+      target = target < 1 ? 1 : (target > count ? count : target);
+
+      uint64_t seen = 0;
+      for (size_t i = 0; i < kNumBuckets; ++i) {
+         seen += buckets[i].load(std::memory_order_relaxed);
+         if (seen >= target) {
+            uint64_t upperBound = i + 1 < kNumBuckets ? getBucketLowerBound(i + 1) - 1 : UINT64_MAX;
+            return upperBound < getMax() ? upperBound : getMax();
+         }
+      }
+
+      return getMax();
+   }
+
+private:
+   static size_t getBucketIndex(uint64_t value) {
+      if (value < kSubBuckets) {
+         return static_cast<size_t>(value);
+      }
+
+      int magnitude = 63;
+      while ((value >> magnitude) == 0) {
+         --magnitude;
+      }
+
+      uint64_t subBucket = (value >> (magnitude - kSubBucketBits)) & (kSubBuckets - 1);
+      return static_cast<size_t>((magnitude - kSubBucketBits + 1) * kSubBuckets + subBucket);
+   }
+
+   static uint64_t getBucketLowerBound(size_t index) {
+      if (index < kSubBuckets) {
+         return index;
+      }
+
+      int magnitude = static_cast<int>(index / kSubBuckets) + kSubBucketBits - 1;
+      uint64_t subBucket = index % kSubBuckets;
+      return (kSubBuckets + subBucket) << (magnitude - kSubBucketBits);
+   }
+
+   std::atomic<uint64_t> buckets[kNumBuckets];
+   std::atomic<uint64_t> total { 0 };
+   std::atomic<uint64_t> sum { 0 };
+   std::atomic<uint64_t> max { 0 };
+};
+
+// Named counters, gauges, and histograms
+// Metrics are looked up (or created) once, after which the returned reference can be updated from any thread without
+// locking. References stay valid for the lifetime of the registry.
+class Metrics {
+public:
+   Counter& counter(const char* name) {
+      return find(counters, name);
+   }
+
+   Gauge& gauge(const char* name) {
+      return find(gauges, name);
+   }
+
+   Histogram& histogram(const char* name) {
+      return find(histograms, name);
+   }
+
+   // Calls function(name, metric) for every metric of the given kind
+   template<typename Function>
+   void forEachCounter(Function function) const {
+      forEach(counters, function);
+   }
+
+   template<typename Function>
+   void forEachGauge(Function function) const {
+      forEach(gauges, function);
+   }
+
+   template<typename Function>
+   void forEachHistogram(Function function) const {
+      forEach(histograms, function);
+   }
+
+   // One line per metric, e.g. "counter events.sent 1234"
+   std::string dump() const {
+      std::string text;
+      char line[256];
+
+      forEachCounter([&text, &line](const std::string& name, const Counter& counter) {
+         snprintf(line, sizeof(line), "counter %s %" PRIu64 "\n", name.c_str(), counter.get());
+         text += line;
+      });
+
+      forEachGauge([&text, &line](const std::string& name, const Gauge& gauge) {
+         snprintf(line, sizeof(line), "gauge %s %" PRId64 "\n", name.c_str(), gauge.get());
+         text += line;
+      });
+
+      forEachHistogram([&text, &line](const std::string& name, const Histogram& histogram) {
+         snprintf(line, sizeof(line), "histogram %s count=%" PRIu64 " mean=%.1f p50=%" PRIu64 " p90=%" PRIu64 " p99=%" PRIu64 " max=%" PRIu64 "\n",
+                  name.c_str(), histogram.getCount(), histogram.getMean(), histogram.getPercentile(50.0), histogram.getPercentile(90.0), histogram.getPercentile(99.0), histogram.getMax());
+         text += line;
+      });
+
+      return text;
+   }
+
+private:
+   template<typename T>
+   using MetricList = std::vector<std::pair<std::string, std::unique_ptr<T>>>;
+
+   template<typename T>
+   T& find(MetricList<T>& list, const char* name) {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      for (auto& pair : list) {
+         if (pair.first == name) {
+            return *pair.second;
+         }
+      }
+
+      list.emplace_back(name, std::unique_ptr<T>(new T));
+      return *list.back().second;
+   }
+
+   template<typename T, typename Function>
+   void forEach(const MetricList<T>& list, Function function) const {
+      std::lock_guard<std::mutex> lock(mutex);
+
+      for (const auto& pair : list) {
+         function(pair.first, *pair.second);
+      }
+   }
+
+   mutable std::mutex mutex;
+   MetricList<Counter> counters;
+   MetricList<Gauge> gauges;
+   MetricList<Histogram> histograms;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -1,17 +1,73 @@
 #ifndef KONTROLLER_SOCK_PACKET_H
 #define KONTROLLER_SOCK_PACKET_H
 
+#include "KontrollerSock/Sock.h"
+
+#include <chrono>
+#include <cstddef>
 #include <cstdint>
 
 namespace KontrollerSock {
 
-static const char* kPort = "40807";
+constexpr const char kPort[] = "40807";
+constexpr const char kDatagramPort[] = "40808";
+
+// Datagrams are kept under typical MTUs, so they never have to be fragmented
+static const size_t kMaxDatagramSize = 1200;
+
+// Protocol versions, sent by the client in its hello
+// 0: Original clients, which never send a hello and only understand button / dial / slider events
+// 1: Hello with HelloFlags
+// 2: Snapshot packets and snapshot requests
+// 3: Events over UDP (kDatagram / kSyncSequence)
+// 4: Events sent as TimedEventPackets
+// 5: Events sent in compact frames (kHelloCompact)
+// 6: Multiple devices (kDevice / kSelectDevices)
+// 7: LED commands (kSetLEDs / kClearLEDs)
+// 8: Subscriptions (kSubscribe)
+// 9: Capture times in datagrams (kTimedDatagram), clients before this get events over TCP instead
+static const uint16_t kProtocolVersion = 9;
+static const uint16_t kMinSnapshotVersion = 2;
+static const uint16_t kMinDatagramVersion = 3;
+static const uint16_t kMinTimedEventVersion = 4;
+static const uint16_t kMinCompactVersion = 5;
+static const uint16_t kMinDeviceVersion = 6;
+static const uint16_t kMinLEDVersion = 7;
+static const uint16_t kMinSubscribeVersion = 8;
+static const uint16_t kMinTimedDatagramVersion = 9;
+
+// Most devices a server can serve (one bit each in kSelectDevices masks)
+static const size_t kMaxDevices = 8;
+
+// Largest compact frame payload the server sends, so that a whole frame always fits in the client's receive buffer
+static const size_t kMaxCompactFramePayload = 4096;
 
 struct EventPacket {
    enum Type : uint16_t {
       kButton = 0x0001,
       kDial = 0x0002,
-      kSlider = 0x0003
+      kSlider = 0x0003,
+      kSnapshot = 0x0010, // Header of a SnapshotPacket, value: number of bytes following the header
+      kDatagram = 0x0011, // Header of a UDP datagram from servers before kTimedDatagram (device 0 only), id: number of events following the header, value: sequence number of the first one
+      kSyncSequence = 0x0012, // Sent over TCP after the state to clients receiving datagrams, value: sequence number of the first event not reflected in it
+      kTimedEvent = 0x0013, // Header of a TimedEventPacket, value: sequence number of the event
+      kCompactFrame = 0x0014, // Header of a CompactFrameHeader, id: number of payload bytes following it, value: sequence number of the first event
+      kDevice = 0x0015, // id: index of the device that everything after it (until the next kDevice) belongs to, device 0 until sent
+                        // Every device has its own sequence numbers.
+      kTimedDatagram = 0x0016, // Header of a TimedDatagramHeader, id: number of events following it, value: sequence number of the first one
+
+      // Client -> server requests (framed the same way as events)
+      kHello = 0x0100, // id: protocol version, value: HelloFlags
+      kSnapshotRequest = 0x0101, // Ask for a SnapshotPacket, e.g. after detecting a gap in the event stream, id: device index
+      kSelectDevices = 0x0102, // value: bit mask of the devices to receive (device 0 only until sent), may be sent at any time
+      kSetLEDs = 0x0103, // Turn LEDs on, id: device index, value: LED mask (see getLEDMask())
+      kClearLEDs = 0x0104, // Turn LEDs off, id: device index, value: LED mask
+      kSubscribe = 0x0105, // Only send events for some controls (every control until sent), may be sent at any time
+                           // id: control type (low byte) and which ids the mask covers (high byte n: ids 32n to 32n + 31)
+                           // value: mask with a bit per control id
+
+      // Never sent, only used locally
+      kEventsDropped = 0x0200 // Stands in for events a client dropped from its event queue, see Client::pollEvents()
    };
 
    uint16_t type;
@@ -19,6 +75,158 @@ struct EventPacket {
    uint32_t value;
 };
 
+// Options requested by a client in its hello
+// Clients that never send a hello (i.e. those predating it) get none of them.
+enum HelloFlags : uint32_t {
+   kHelloConflate = 0x00000001, // Collapse pending dial / slider events for the same control into the latest value
+   kHelloDatagrams = 0x00000002, // Receive events over UDP instead of TCP (ignored if the server isn't sending any)
+   kHelloCompact = 0x00000004 // Receive events over TCP in compact frames (see CompactFrame.h) instead of TimedEventPackets
+};
+
+// The whole controller state in one fixed-size message (with all fields in network byte order)
+// Sent instead of individual events for the initial state and when resynchronizing, to clients that support it.
+struct SnapshotPacket {
+   EventPacket header;
+   uint32_t buttons[2]; // One bit per button
+   uint32_t dials[8]; // Float bits
+   uint32_t sliders[8]; // Float bits
+};
+static_assert(sizeof(SnapshotPacket) % sizeof(EventPacket) == 0, "Snapshot packet size must be a multiple of the event packet size");
+
+// An event along with its sequence number and when the server captured it
+// Sent instead of a bare EventPacket to clients that support it, so they can measure latency and detect missed events.
+struct TimedEventPacket {
+   EventPacket header;
+   uint32_t captureTimeHigh; // See getTimestamp()
+   uint32_t captureTimeLow;
+   EventPacket event;
+
+   uint64_t getCaptureTime() const {
+      return (static_cast<uint64_t>(captureTimeHigh) << 32) | captureTimeLow;
+   }
+
+   void setCaptureTime(uint64_t captureTime) {
+      captureTimeHigh = static_cast<uint32_t>(captureTime >> 32);
+      captureTimeLow = static_cast<uint32_t>(captureTime);
+   }
+};
+static_assert(sizeof(TimedEventPacket) % sizeof(EventPacket) == 0, "Timed event packet size must be a multiple of the event packet size");
+
+// Header of a batch of events in the compact encoding, followed by header.id bytes of encoded events
+// Events in a frame follow on from each other in the sequence, unless some were conflated away.
+struct CompactFrameHeader {
+   EventPacket header;
+   uint32_t captureTimeHigh; // Capture time of the first event in the frame, see getTimestamp()
+   uint32_t captureTimeLow;
+
+   uint64_t getCaptureTime() const {
+      return (static_cast<uint64_t>(captureTimeHigh) << 32) | captureTimeLow;
+   }
+
+   void setCaptureTime(uint64_t captureTime) {
+      captureTimeHigh = static_cast<uint32_t>(captureTime >> 32);
+      captureTimeLow = static_cast<uint32_t>(captureTime);
+   }
+};
+static_assert(sizeof(CompactFrameHeader) % sizeof(EventPacket) == 0, "Compact frame header size must be a multiple of the event packet size");
+
+// Header of a UDP datagram (device 0 only), followed by header.id events
+// A datagram without any events is a heartbeat, which only tells receivers what the next sequence number is.
+struct TimedDatagramHeader {
+   EventPacket header;
+   uint32_t captureTimeHigh; // Capture time of the first event in the datagram, see getTimestamp()
+   uint32_t captureTimeLow;
+
+   uint64_t getCaptureTime() const {
+      return (static_cast<uint64_t>(captureTimeHigh) << 32) | captureTimeLow;
+   }
+
+   void setCaptureTime(uint64_t captureTime) {
+      captureTimeHigh = static_cast<uint32_t>(captureTime >> 32);
+      captureTimeLow = static_cast<uint32_t>(captureTime);
+   }
+};
+static_assert(sizeof(TimedDatagramHeader) % sizeof(EventPacket) == 0, "Timed datagram header size must be a multiple of the event packet size");
+
+// Microseconds since the epoch, for capture times (only comparable between hosts with synchronized clocks)
+inline uint64_t getTimestamp() {
+   return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::system_clock::now().time_since_epoch()).count());
+}
+
+inline EventPacket hostToNetwork(EventPacket packet) {
+   EventPacket networkPacket;
+   networkPacket.type = Sock::Endian::hostToNetworkShort(packet.type);
+   networkPacket.id = Sock::Endian::hostToNetworkShort(packet.id);
+   networkPacket.value = Sock::Endian::hostToNetworkLong(packet.value);
+
+   return networkPacket;
+}
+
+inline EventPacket networkToHost(EventPacket networkPacket) {
+   EventPacket packet;
+   packet.type = Sock::Endian::networkToHostShort(networkPacket.type);
+   packet.id = Sock::Endian::networkToHostShort(networkPacket.id);
+   packet.value = Sock::Endian::networkToHostLong(networkPacket.value);
+
+   return packet;
+}
+
+inline TimedEventPacket hostToNetwork(const TimedEventPacket& packet) {
+   TimedEventPacket networkPacket;
+   networkPacket.header = hostToNetwork(packet.header);
+   networkPacket.captureTimeHigh = Sock::Endian::hostToNetworkLong(packet.captureTimeHigh);
+   networkPacket.captureTimeLow = Sock::Endian::hostToNetworkLong(packet.captureTimeLow);
+   networkPacket.event = hostToNetwork(packet.event);
+
+   return networkPacket;
+}
+
+inline TimedEventPacket networkToHost(const TimedEventPacket& networkPacket) {
+   TimedEventPacket packet;
+   packet.header = networkToHost(networkPacket.header);
+   packet.captureTimeHigh = Sock::Endian::networkToHostLong(networkPacket.captureTimeHigh);
+   packet.captureTimeLow = Sock::Endian::networkToHostLong(networkPacket.captureTimeLow);
+   packet.event = networkToHost(networkPacket.event);
+
+   return packet;
+}
+
+inline CompactFrameHeader hostToNetwork(const CompactFrameHeader& header) {
+   CompactFrameHeader networkHeader;
+   networkHeader.header = hostToNetwork(header.header);
+   networkHeader.captureTimeHigh = Sock::Endian::hostToNetworkLong(header.captureTimeHigh);
+   networkHeader.captureTimeLow = Sock::Endian::hostToNetworkLong(header.captureTimeLow);
+
+   return networkHeader;
+}
+
+inline CompactFrameHeader networkToHost(const CompactFrameHeader& networkHeader) {
+   CompactFrameHeader header;
+   header.header = networkToHost(networkHeader.header);
+   header.captureTimeHigh = Sock::Endian::networkToHostLong(networkHeader.captureTimeHigh);
+   header.captureTimeLow = Sock::Endian::networkToHostLong(networkHeader.captureTimeLow);
+
+   return header;
+}
+
+inline TimedDatagramHeader hostToNetwork(const TimedDatagramHeader& header) {
+   TimedDatagramHeader networkHeader;
+   networkHeader.header = hostToNetwork(header.header);
+   networkHeader.captureTimeHigh = Sock::Endian::hostToNetworkLong(header.captureTimeHigh);
+   networkHeader.captureTimeLow = Sock::Endian::hostToNetworkLong(header.captureTimeLow);
+
+   return networkHeader;
+}
+
+inline TimedDatagramHeader networkToHost(const TimedDatagramHeader& networkHeader) {
+   TimedDatagramHeader header;
+   header.header = networkToHost(networkHeader.header);
+   header.captureTimeHigh = Sock::Endian::networkToHostLong(networkHeader.captureTimeHigh);
+   header.captureTimeLow = Sock::Endian::networkToHostLong(networkHeader.captureTimeLow);
+
+   return header;
+}
+
 } // namespace KontrollerSock
 
 #endif
@@ -0,0 +1,251 @@
+#ifndef KONTROLLER_SOCK_POLLER_H
+#define KONTROLLER_SOCK_POLLER_H
+
+#include "KontrollerSock/Handles.h"
+#include "KontrollerSock/Sock.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#if defined(__linux__)
+#  define SOCK_EPOLL 1
+#  include <sys/epoll.h>
+#else
+#  define SOCK_EPOLL 0
+#endif
+
+namespace KontrollerSock {
+
+// Readiness notification for a set of sockets
+// Backed by epoll on Linux and by poll / WSAPoll everywhere else. A poller is owned by a single thread, but can be woken
+// up from any thread with wake().
+class Poller {
+public:
+   enum Interest : uint32_t {
+      kReadable = 0x01,
+      kWritable = 0x02
+   };
+
+   struct Event {
+      uint64_t token;
+      uint32_t events; // Errors and hang-ups are reported as kReadable, so that the following recv() / send() sees them
+   };
+
+   Poller() {
+#if SOCK_EPOLL
+      epollHandle.data = ::epoll_create1(EPOLL_CLOEXEC);
+      if (!epollHandle) {
+         printf("epoll_create1 failed with error: %d\n", Sock::System::getLastError());
+         return;
+      }
+#endif
+
+      wakeSocket = createWakeSocket();
+      if (wakeSocket && !add(wakeSocket.data, kReadable, kWakeToken)) {
+         wakeSocket = {};
+      }
+   }
+
+   explicit operator bool() const {
+#if SOCK_EPOLL
+      return epollHandle && wakeSocket;
+#else
+      return static_cast<bool>(wakeSocket);
+#endif
+   }
+
+   bool add(Sock::Socket socket, uint32_t interest, uint64_t token) {
+#if SOCK_EPOLL
+      epoll_event event = toEpollEvent(interest, token);
+      return ::epoll_ctl(epollHandle.data, EPOLL_CTL_ADD, socket, &event) == 0;
+#else
+      Sock::PollDescriptor descriptor = {};
+      descriptor.fd = socket;
+      descriptor.events = toPollEvents(interest);
+      descriptors.push_back(descriptor);
+      tokens.push_back(token);
+      return true;
+#endif
+   }
+
+   bool modify(Sock::Socket socket, uint32_t interest, uint64_t token) {
+#if SOCK_EPOLL
+      epoll_event event = toEpollEvent(interest, token);
+      return ::epoll_ctl(epollHandle.data, EPOLL_CTL_MOD, socket, &event) == 0;
+#else
+      for (Sock::PollDescriptor& descriptor : descriptors) {
+         if (descriptor.fd == socket) {
+            descriptor.events = toPollEvents(interest);
+            return true;
+         }
+      }
+      return false;
+#endif
+   }
+
+   bool remove(Sock::Socket socket) {
+#if SOCK_EPOLL
+      epoll_event event = {};
+      return ::epoll_ctl(epollHandle.data, EPOLL_CTL_DEL, socket, &event) == 0;
+#else
+      for (size_t i = 0; i < descriptors.size(); ++i) {
+         if (descriptors[i].fd == socket) {
+            descriptors.erase(descriptors.begin() + i);
+            tokens.erase(tokens.begin() + i);
+            return true;
+         }
+      }
+      return false;
+#endif
+   }
+
+   // Waits until at least one socket is ready, wake() is called, or the timeout (in milliseconds, -1 for none) expires
+   // Returns false on error. Wake-ups are not reported as events.
+   bool wait(std::vector<Event>& events, int timeout) {
+      events.clear();
+
+#if SOCK_EPOLL
+      epoll_event epollEvents[kMaxEvents];
+      int numEvents = ::epoll_wait(epollHandle.data, epollEvents, kMaxEvents, timeout);
+      if (numEvents < 0) {
+         return Sock::System::getLastError() == Sock::kInterrupted;
+      }
+
+      for (int i = 0; i < numEvents; ++i) {
+         if (epollEvents[i].data.u64 == kWakeToken) {
+            drainWakeSocket();
+            continue;
+         }
+
+         Event event;
+         event.token = epollEvents[i].data.u64;
+         event.events = 0;
+         if (epollEvents[i].events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+            event.events |= kReadable;
+         }
+         if (epollEvents[i].events & EPOLLOUT) {
+            event.events |= kWritable;
+         }
+         events.push_back(event);
+      }
+#else
+      int numEvents = Sock::poll(descriptors.data(), static_cast<Sock::PollCount>(descriptors.size()), timeout);
+      if (numEvents < 0) {
+         return Sock::System::getLastError() == Sock::kInterrupted;
+      }
+
+      for (size_t i = 0; i < descriptors.size() && numEvents > 0; ++i) {
+         short revents = descriptors[i].revents;
+         if (revents == 0) {
+            continue;
+         }
+         --numEvents;
+
+         if (tokens[i] == kWakeToken) {
+            drainWakeSocket();
+            continue;
+         }
+
+         Event event;
+         event.token = tokens[i];
+         event.events = 0;
+         if (revents & (POLLIN | POLLERR | POLLHUP)) {
+            event.events |= kReadable;
+         }
+         if (revents & POLLOUT) {
+            event.events |= kWritable;
+         }
+         events.push_back(event);
+      }
+#endif
+
+      return true;
+   }
+
+   // Interrupts a wait() in progress (or the next one), safe to call from any thread
+   void wake() {
+      uint8_t byte = 0;
+      Sock::send(wakeSocket.data, &byte, sizeof(byte), Sock::kNoSignal);
+   }
+
+private:
+   static const uint64_t kWakeToken = UINT64_MAX - 1;
+   static const int kMaxEvents = 64;
+
+   // A non-blocking UDP socket connected to itself over loopback, which works as a wake-up channel on every platform
+   static SocketHandle createWakeSocket() {
+      SocketHandle socket(Sock::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP));
+      if (!socket) {
+         printf("socket failed with error: %d\n", Sock::System::getLastError());
+         return {};
+      }
+
+      sockaddr_in address = {};
+      address.sin_family = AF_INET;
+      address.sin_addr.s_addr = Sock::Endian::hostToNetworkLong(INADDR_LOOPBACK);
+      address.sin_port = 0;
+      if (Sock::bind(socket.data, reinterpret_cast<const sockaddr*>(&address), sizeof(address)) == Sock::kSocketError) {
+         printf("bind failed with error: %d\n", Sock::System::getLastError());
+         return {};
+      }
+
+      socklen_t addressLen = sizeof(address);
+      if (Sock::getsockname(socket.data, reinterpret_cast<sockaddr*>(&address), &addressLen) == Sock::kSocketError
+         || Sock::connect(socket.data, reinterpret_cast<const sockaddr*>(&address), addressLen) == Sock::kSocketError) {
+         printf("Unable to connect wake socket, error: %d\n", Sock::System::getLastError());
+         return {};
+      }
+
+      unsigned long nonBlocking = 1;
+      if (Sock::ioctl(socket.data, FIONBIO, &nonBlocking) == Sock::kSocketError) {
+         printf("ioctl failed with error: %d\n", Sock::System::getLastError());
+         return {};
+      }
+
+      return socket;
+   }
+
+   void drainWakeSocket() {
+      uint8_t buffer[64];
+      while (Sock::recv(wakeSocket.data, buffer, sizeof(buffer), 0) > 0) {
+      }
+   }
+
+#if SOCK_EPOLL
+   static epoll_event toEpollEvent(uint32_t interest, uint64_t token) {
+      epoll_event event = {};
+      event.events = 0;
+      if (interest & kReadable) {
+         event.events |= EPOLLIN;
+      }
+      if (interest & kWritable) {
+         event.events |= EPOLLOUT;
+      }
+      event.data.u64 = token;
+      return event;
+   }
+
+   FileDescriptorHandle epollHandle;
+#else
+   static short toPollEvents(uint32_t interest) {
+      short events = 0;
+      if (interest & kReadable) {
+         events |= POLLIN;
+      }
+      if (interest & kWritable) {
+         events |= POLLOUT;
+      }
+      return events;
+   }
+
+   std::vector<Sock::PollDescriptor> descriptors;
+   std::vector<uint64_t> tokens;
+#endif
+
+   SocketHandle wakeSocket;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -0,0 +1,73 @@
+#ifndef KONTROLLER_SOCK_RECEIVE_BUFFER_H
+#define KONTROLLER_SOCK_RECEIVE_BUFFER_H
+
+#include "KontrollerSock/Packet.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+namespace KontrollerSock {
+
+// Accumulates bytes received from a socket, so that everything available can be read with a single recv() call, and
+// so that a packet split across reads is kept until the rest of it arrives
+template<size_t Size>
+class ReceiveBuffer {
+public:
+   static_assert(Size >= 2 * sizeof(EventPacket), "Receive buffer too small");
+
+   uint8_t* writePointer() {
+      return data + end;
+   }
+
+   size_t writeCapacity() const {
+      return Size - end;
+   }
+
+   void commitWrite(size_t size) {
+      end += size;
+   }
+
+   const uint8_t* readPointer() const {
+      return data + start;
+   }
+
+   size_t readSize() const {
+      return end - start;
+   }
+
+   void consume(size_t size) {
+      start += size;
+   }
+
+   // Moves the unread data (if any) to the front to make room for the next read
+   void compact() {
+      if (start > 0) {
+         memmove(data, data + start, end - start);
+         end -= start;
+         start = 0;
+      }
+   }
+
+   // Decodes all complete packets (translating them from network byte order), leaving any partial packet buffered
+   void decodePackets(std::vector<EventPacket>& packets) {
+      while (readSize() >= sizeof(EventPacket)) {
+         EventPacket networkPacket;
+         memcpy(&networkPacket, readPointer(), sizeof(networkPacket));
+         consume(sizeof(networkPacket));
+
+         packets.push_back(networkToHost(networkPacket));
+      }
+
+      compact();
+   }
+
+private:
+   uint8_t data[Size];
+   size_t start = 0;
+   size_t end = 0;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -0,0 +1,111 @@
+#ifndef KONTROLLER_SOCK_RELAY_H
+#define KONTROLLER_SOCK_RELAY_H
+
+#include "KontrollerSock/Client.h"
+#include "KontrollerSock/EventSource.h"
+#include "KontrollerSock/Server.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace KontrollerSock {
+
+// Mirrors the devices of another server (or relay) and serves them to clients of its own, so that clients can be spread
+// over a tree of relays rather than all connecting to the host with the controller
+// Events are forwarded as they were received, in the batches they arrive in and keeping the time they were captured, and
+// clients get the state from the relay's own mirror of each device. LED commands from clients are passed upstream
+// (without resetting the LEDs at startup, as other clients upstream may be using them).
+class Relay {
+public:
+   struct Config {
+      // How to connect upstream, including which devices to mirror (see Client::Config::devices). Every device up to the
+      // highest one selected is served, so that device indices are the same on both sides.
+      Client::Config upstream;
+
+      // How to serve clients, usually on a port of its own (see Server::Config::port)
+      Server::Config downstream;
+   };
+
+   explicit Relay(const Config& relayConfig);
+
+   // Connects to the endpoint(s) (see Client::run()) and serves the mirrored devices, until shutDown() is called
+   bool run(const char* endpoint);
+   bool run(const std::vector<const char*>& endpoints);
+
+   void shutDown();
+
+   Client& getClient() {
+      return client;
+   }
+
+   Server& getServer() {
+      return server;
+   }
+
+private:
+   // The server's view of an upstream device
+   class MirroredDevice : public EventSource {
+   public:
+      MirroredDevice(Client& upstreamClient, uint16_t deviceIndex);
+
+      // Applies events that were captured at the same time to the mirrored state, and passes on the packets they came in
+      void relay(const Client::Event* events, const EventPacket* eventPackets, size_t numEvents);
+
+      Kontroller::State getState() override;
+
+      // Events only ever come through the events callback
+      void setButtonCallback(ButtonCallback /*callback*/) override {
+      }
+
+      void setDialCallback(DialCallback /*callback*/) override {
+      }
+
+      void setSliderCallback(SliderCallback /*callback*/) override {
+      }
+
+      bool setEventsCallback(EventsCallback callback) override;
+
+      bool enableLEDControl(bool /*enable*/) override {
+         return true;
+      }
+
+      void setLED(Kontroller::LED led, bool on) override {
+         client.setLED(led, on, index);
+      }
+
+      bool ownsLEDs() const override {
+         return false;
+      }
+
+   private:
+      Client& client;
+      const uint16_t index;
+
+      // The state the server was last given, which only follows the relayed events while the server is listening for
+      // them (otherwise it is the client's latest state, e.g. when the server samples the state)
+      std::atomic_bool relaying;
+      std::mutex stateMutex;
+      Kontroller::State state;
+
+      // Held while calling the callback, so that once it has been replaced the old one is no longer running
+      std::mutex callbackMutex;
+      EventsCallback eventsCallback;
+      std::vector<EventPacket> packets; // Changes found when catching up, only touched with the callback mutex held
+   };
+
+   void forward(const Client::Event* events, const EventPacket* packets, size_t numEvents);
+
+   std::vector<std::unique_ptr<MirroredDevice>> devices;
+   Client client;
+   Server server;
+};
+
+} // namespace KontrollerSock
+
+#endif
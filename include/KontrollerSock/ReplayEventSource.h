@@ -0,0 +1,97 @@
+#ifndef KONTROLLER_SOCK_REPLAY_EVENT_SOURCE_H
+#define KONTROLLER_SOCK_REPLAY_EVENT_SOURCE_H
+
+#include "KontrollerSock/EventSource.h"
+#include "KontrollerSock/Journal.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <thread>
+
+namespace KontrollerSock {
+
+// Plays back a journal recorded by a Server (see Server::Config::journalPath) from its own thread, so that a recorded
+// session can be served again without any hardware
+class ReplayEventSource : public EventSource {
+public:
+   struct Config {
+      const char* path = nullptr;
+
+      // Playback speed relative to the recording (e.g. 2.0 for twice as fast), or zero to replay as fast as possible
+      double speed = 1.0;
+
+      // Start over from the beginning once the end of the journal is reached
+      bool loop = false;
+   };
+
+   explicit ReplayEventSource(const Config& sourceConfig);
+
+   ~ReplayEventSource();
+
+   // Opens the journal, with the state as of its start
+   bool open();
+
+   void start();
+
+   void stop();
+
+   // Moves playback to the given capture time (see getStartTime() / getEndTime()), with the state as of that time
+   // Only the events of a single block are scanned, no matter where in the journal the time is. While replaying, any
+   // controls that differ are reported through the callbacks.
+   void seek(uint64_t time);
+
+   // Set once the end of the journal has been reached (never, when looping)
+   bool isFinished() const {
+      return finished.load(std::memory_order_acquire);
+   }
+
+   uint64_t getEventsReplayed() const {
+      return eventsReplayed.load(std::memory_order_relaxed);
+   }
+
+   uint64_t getStartTime() const;
+   uint64_t getEndTime() const;
+
+   Kontroller::State getState() override;
+
+   void setButtonCallback(ButtonCallback callback) override;
+   void setDialCallback(DialCallback callback) override;
+   void setSliderCallback(SliderCallback callback) override;
+
+private:
+   void run();
+   void moveTo(uint64_t time, bool report);
+   void setPosition(uint64_t newBlock, uint32_t newEventIndex, const Kontroller::State& newState, bool report);
+   void replay(const EventPacket& event);
+   void notify(EventPacket::Type type, uint16_t id, bool pressed, float value);
+
+   const Config config;
+   JournalReader reader;
+   std::atomic_bool running;
+   std::atomic_bool finished;
+   std::thread thread;
+
+   // Only touched by the replay thread while it is running
+   uint64_t block;
+   uint32_t eventIndex;
+
+   // Seeks made while replaying are handed over to the replay thread
+   std::atomic_bool seekRequested;
+   std::atomic<uint64_t> seekTime;
+
+   std::mutex stateMutex;
+   Kontroller::State state;
+
+   // Held while calling callbacks, so that once a callback has been replaced the old one is no longer running
+   std::mutex callbackMutex;
+   ButtonCallback buttonCallback;
+   DialCallback dialCallback;
+   SliderCallback sliderCallback;
+
+   std::atomic<uint64_t> eventsReplayed;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -0,0 +1,76 @@
+#ifndef KONTROLLER_SOCK_SEQ_LOCK_H
+#define KONTROLLER_SOCK_SEQ_LOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+#include <utility>
+
+namespace KontrollerSock {
+
+// Sequence lock protecting a trivially copyable value
+// Writing never blocks, and readers never block the writer (they retry if they raced with a write instead). Only one
+// thread may write at a time.
+template<typename T>
+class SeqLock {
+public:
+   static_assert(std::is_trivially_copyable<T>::value, "SeqLock values must be trivially copyable");
+
+   SeqLock() : sequence(0), value{} {
+   }
+
+   void store(const T& newValue) {
+      uint64_t currentSequence = sequence.load(std::memory_order_relaxed);
+
+      // An odd sequence number marks a write in progress
+      sequence.store(currentSequence + 1, std::memory_order_relaxed);
+      std::atomic_thread_fence(std::memory_order_release);
+
+      memcpy(&value, &newValue, sizeof(T));
+
+      sequence.store(currentSequence + 2, std::memory_order_release);
+   }
+
+   // Calls function with the protected value and returns its result, retrying if it raced with a write
+   // Allows reading part of the value without copying all of it. The function must only read from the value, and may
+   // be called more than once.
+   template<typename Function>
+   auto read(Function function) const -> decltype(function(std::declval<const T&>())) {
+      while (true) {
+         uint64_t before = sequence.load(std::memory_order_acquire);
+         if ((before & 1) == 0) {
+            auto result = function(value);
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before) {
+               return result;
+            }
+         }
+      }
+   }
+
+   T load() const {
+      T result;
+
+      while (true) {
+         uint64_t before = sequence.load(std::memory_order_acquire);
+         if ((before & 1) == 0) {
+            memcpy(&result, &value, sizeof(T));
+
+            std::atomic_thread_fence(std::memory_order_acquire);
+            if (sequence.load(std::memory_order_relaxed) == before) {
+               return result;
+            }
+         }
+      }
+   }
+
+private:
+   std::atomic<uint64_t> sequence;
+   T value;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -1,62 +1,296 @@
 #ifndef KONTROLLER_SOCK_SERVER_H
 #define KONTROLLER_SOCK_SERVER_H
 
+#include "KontrollerSock/BroadcastRing.h"
+#include "KontrollerSock/CompactFrame.h"
+#include "KontrollerSock/Controls.h"
+#include "KontrollerSock/EventSource.h"
+#include "KontrollerSock/Metrics.h"
+#include "KontrollerSock/Packet.h"
+#include "KontrollerSock/SeqLock.h"
+
 #include <Kontroller/Kontroller.h>
 
 #include <atomic>
+#include <chrono>
 #include <cstdint>
 #include <map>
+#include <memory>
+#include <string>
 #include <thread>
 #include <vector>
 
 namespace KontrollerSock {
 
-struct ButtonEvent {
-   Kontroller::Button button;
-   bool pressed;
-};
-
-struct DialEvent {
-   Kontroller::Dial dial;
-   float value;
-};
-
-struct SliderEvent {
-   Kontroller::Slider slider;
-   float value;
-};
+class JournalWriter;
+class Poller;
+struct SharedSegment;
 
 class Server {
 public:
+   enum class Mode {
+      kThreadPerClient, // Each client is managed by its own thread, using blocking writes
+      kEventLoop // All clients are multiplexed over a fixed number of event loop threads, using non-blocking writes
+   };
+
+   // What to do with a connection that falls too far behind
+   enum class SlowConsumerPolicy {
+      kResync, // Skip the connection ahead to a fresh snapshot of the state
+      kDropOldest, // Drop the oldest events, keeping the latest maxBacklog (clients that ask for the state when they find a
+                   // gap in the sequence numbers do so, everyone else is sent the state along with the latest events)
+      kDisconnect // Close the connection
+   };
+
+   struct Config {
+      Mode mode = Mode::kThreadPerClient;
+
+      // Number of event loop threads (including the thread that calls run()), only used by Mode::kEventLoop
+      int numEventLoops = 1;
+
+      // Port to listen on, e.g. a different one for a Relay on the same host as the server it relays
+      const char* port = kPort;
+
+      // Number of events kept for connections to read (rounded up to a power of two). A connection that falls further
+      // behind than this has missed events, and is always subject to the slow consumer policy.
+      size_t eventBufferSize = 4096;
+
+      // Number of events a connection may fall behind by before the slow consumer policy is applied, zero to allow up to
+      // eventBufferSize
+      size_t maxBacklog = 0;
+      SlowConsumerPolicy slowConsumerPolicy = SlowConsumerPolicy::kResync;
+
+      // How long a write to a client may stall before the client is disconnected
+      std::chrono::milliseconds sendTimeout = std::chrono::milliseconds(5000);
+
+      // How often to sample the source's state and publish whatever changed since the previous sample, as one batch of
+      // events sharing a capture time. Bounds the rate at which events are published no matter how quickly the
+      // controls change, at the cost of intermediate values and up to one interval of latency. Zero publishes every
+      // event from the source's callbacks as it happens.
+      std::chrono::microseconds publishInterval = std::chrono::microseconds(0);
+
+      // Maximum number of events coalesced into a single write to a client
+      size_t maxBatchSize = 1024;
+
+      // How long to wait for a new client's hello before assuming it predates it, and sending it the state as
+      // individual events
+      std::chrono::milliseconds helloTimeout = std::chrono::milliseconds(50);
+
+      // Where to send every event over UDP, once for all clients that ask for it - either a multicast group (e.g.
+      // "239.255.40.80") or a single host, nullptr to disable. Those clients still get the state over TCP.
+      const char* datagramAddress = nullptr;
+
+      // Also publish the state and events into a shared memory segment with this name (e.g. kSharedMemoryName), for
+      // SharedMemoryClients on the same host (POSIX only). Devices other than the first get their own segments, see
+      // getSharedMemoryName().
+      const char* sharedMemoryName = nullptr;
+
+      // Also record every published event into a journal at this path, with periodic checkpoints of the state, for
+      // ReplayEventSource to play back later. Devices other than the first get their own journals, see getJournalPath().
+      const char* journalPath = nullptr;
+
+      // Number of hops multicast datagrams may take (1 keeps them on the local network)
+      int multicastTtl = 1;
+
+      // Let clients turn the devices' LEDs on and off (see Client::setLED()), starting with them all off. Commands from
+      // every client are merged and applied from their own thread at most once per interval, so that a flood of them
+      // can't hold up events.
+      bool ledControl = false;
+      std::chrono::milliseconds ledUpdateInterval = std::chrono::milliseconds(10);
+   };
+
+   struct Stats {
+      uint64_t eventsSent = 0; // Events written to clients, including those making up state snapshots
+      uint64_t sendCalls = 0; // Calls to send() made to write them
+      uint64_t eventsConflated = 0; // Dial / slider events dropped in favor of a newer value, for clients that asked for it
+      uint64_t datagramsSent = 0; // UDP datagrams sent (no matter how many clients receive them)
+
+      // Slow consumer policy actions
+      uint64_t resyncs = 0; // Connections skipped ahead to a snapshot
+      uint64_t eventsDropped = 0; // Events dropped by SlowConsumerPolicy::kDropOldest
+      uint64_t slowConsumerDisconnects = 0; // Connections closed by SlowConsumerPolicy::kDisconnect
+      uint64_t sendTimeouts = 0; // Connections closed because a write stalled for longer than the send timeout
+
+      double sendCallsPerEvent() const {
+         return eventsSent > 0 ? static_cast<double>(sendCalls) / eventsSent : 0.0;
+      }
+   };
+
    Server();
 
+   explicit Server(const Config& serverConfig);
+
    ~Server();
 
+   // Serves events from the Kontroller
    bool run();
 
+   // Serves events from the given source, which must outlive the call
+   bool run(EventSource& source);
+
+   // Serves events from several devices (up to kMaxDevices), with each source's index in the list as its device index
+   // Every device is published independently, so a busy device doesn't hold up the others. Clients receive device 0
+   // unless they select others (see Client::Config::devices). Datagrams are only sent for device 0.
+   bool run(const std::vector<EventSource*>& sources);
+
    void shutDown();
 
+   Stats getStats() const;
+
+   const Metrics& getMetrics() const {
+      return metrics;
+   }
+
+   // All metrics followed by per-connection ones, one per line
+   std::string dumpMetrics();
+
 private:
    struct ThreadData {
-      std::mutex eventMutex;
-      std::condition_variable cv;
+      // Where the connection is in a single device's events
+      struct DeviceStream {
+         std::atomic<uint64_t> cursor { 0 }; // Sequence number of the next event to send
+         std::atomic_bool overrun { false }; // Set once the connection has fallen behind and had to be resynchronized
+         std::atomic_bool snapshotRequested { false };
+
+         CompactEncoder compactEncoder; // Only touched by whoever is sending to the connection
+      };
+
+      // Negotiated in the client's hello
+      std::atomic<uint16_t> protocolVersion { 0 };
+      std::atomic_bool conflate { false };
+      std::atomic_bool datagrams { false }; // Device 0's events are received over UDP, only its state is sent over TCP
+      std::atomic_bool compact { false }; // Events are sent in compact frames
+
+      std::atomic<uint32_t> deviceMask { 1 }; // Devices the client has selected
+
+      // Controls the client has subscribed to, a mask per control type (kButton onwards) with a bit per control id
+      std::atomic<uint64_t> subscriptions[kNumControlTypes] { { kAllControls }, { kAllControls }, { kAllControls } };
+      std::atomic_bool filtered { false }; // Set while the client hasn't subscribed to every control
+      DeviceStream deviceStreams[kMaxDevices];
+      uint16_t currentDevice = 0; // Device the client attributes what it receives to, only touched by whoever is sending
+
+      std::atomic_bool disconnect { false }; // Set when the slow consumer policy decides to close the connection
+
+      std::atomic<uint64_t> eventsSent { 0 };
+      std::atomic<uint64_t> bytesSent { 0 };
+   };
+
+   struct Snapshot {
+      Kontroller::State state;
+      uint64_t sequence; // Sequence number of the first event not reflected in the state
+   };
+
+   struct Waiter;
 
-      std::vector<ButtonEvent> buttonEvents;
-      std::vector<DialEvent> dialEvents;
-      std::vector<SliderEvent> sliderEvents;
+   // Everything published for a single device, only ever written by that device's publishing thread
+   struct Device {
+      Device(uint16_t deviceIndex, EventSource& eventSource, size_t eventBufferSize) : index(deviceIndex), source(eventSource), eventRing(eventBufferSize), sharedSegment(nullptr), journal(nullptr) {
+      }
+
+      const uint16_t index;
+      EventSource& source;
+
+      // Events are published once into a shared ring, with every connection reading from it at its own pace
+      BroadcastRing<TimedEventPacket> eventRing;
+      SeqLock<Snapshot> snapshot;
+      SharedSegment* sharedSegment; // Only set while run() is publishing into shared memory
+      JournalWriter* journal; // Only set while run() is recording
+
+      // Woken up whenever the device publishes, so that devices nobody is waiting for cost nothing
+      std::mutex waiterMutex;
+      std::vector<Waiter*> waiters; // Guarded by the waiter mutex
+   };
+
+   // LED changes requested since they were last applied, with the latest request for each LED winning
+   struct LEDRequests {
+      uint32_t on = 0; // LED masks
+      uint32_t off = 0;
+   };
+
+   // A thread waiting for events in a poller (alongside its sockets), which publish() wakes up
+   struct Waiter {
+      explicit Waiter(Poller& waiterPoller) : poller(waiterPoller) {
+      }
+
+      Poller& poller;
+      std::atomic_bool wakePending { false }; // Cleared by the waiter before it looks for events
+      uint32_t deviceMask = 0; // Devices it is woken up for, only touched by its owner (see setWaiterDevices())
    };
 
-   void initCallbacks(Kontroller& kontroller);
+   struct EventLoop;
+
+   void initCallbacks(Device& device);
+   void runSampler(Device& device, const std::atomic_bool& stop);
+   void runLEDs(const std::atomic_bool& stop);
+   void publish(Device& device, const Kontroller::State& state, const EventPacket* packets, size_t numPackets, uint64_t captureTime);
+   bool collectEvents(const Device& device, ThreadData& data, std::vector<TimedEventPacket>& packets);
+   uint64_t getMaxBacklog(const Device& device) const;
+   bool dropOldestEvents(const Device& device, ThreadData& data);
+   size_t appendState(std::vector<uint8_t>& buffer, const Device& device, ThreadData& data);
+   size_t appendStates(std::vector<uint8_t>& buffer, ThreadData& data);
+   size_t appendPending(std::vector<uint8_t>& buffer, uint64_t id, ThreadData& data, std::vector<TimedEventPacket>& packets);
+   void handleRequest(ThreadData& data, const EventPacket& request);
+   bool sendBuffer(uint64_t socket, std::vector<uint8_t>& buffer, size_t numEvents, ThreadData& data);
+
+   bool isReceiving(const Device& device, const ThreadData& data) const;
+   bool needsEvents(const Device& device, const ThreadData& data) const;
+   bool needsEvents(const ThreadData& data) const;
 
    void manageConnection(uint64_t id, uint64_t socket);
+   void sendDatagrams(uint64_t socket, const sockaddr_in& destination);
 
+   bool runAcceptLoop(uint64_t listenSocket);
+   bool runEventLoops(uint64_t listenSocket);
+   bool runEventLoop(EventLoop& loop, uint64_t listenSocket);
+   bool acceptConnections(EventLoop& loop, uint64_t listenSocket);
+   void addConnection(EventLoop& loop, uint64_t id, uint64_t socket);
+   void removeConnection(EventLoop& loop, uint64_t id);
+   int pumpConnections(EventLoop& loop);
+   void addWaiter(Waiter& waiter);
+   void removeWaiter(Waiter& waiter);
+   void setWaiterDevices(Waiter& waiter, uint32_t deviceMask);
+   void wakeWaiters(Device& device);
+
+   const Config config;
    std::atomic_bool shuttingDown;
    uint64_t threadCounter;
 
    std::mutex threadDataMutex;
    std::condition_variable threadDataCv;
    std::map<uint64_t, std::shared_ptr<ThreadData>> threadData;
-   Kontroller::State globalKontrollerState;
+
+   // Set up by run() before any connections are accepted, and left in place afterwards
+   std::vector<std::unique_ptr<Device>> devices;
+   std::mutex eventMutex;
+   std::condition_variable samplerCv; // Only used to stop the samplers
+   std::vector<Waiter*> waiters; // Every waiter, whatever its devices, for shutDown() to wake up. Guarded by the event mutex.
+
+   std::mutex ledMutex;
+   std::condition_variable ledCv;
+   LEDRequests ledRequests[kMaxDevices];
+
+   Poller* acceptPoller;
+   std::vector<std::unique_ptr<EventLoop>> eventLoops;
+   size_t nextEventLoop;
+
+   // Recorded without locking, through references into the registry
+   Metrics metrics;
+   Counter& eventsPublished;
+   Counter& eventsSent;
+   Counter& bytesSent;
+   Counter& sendCalls;
+   Counter& eventsConflated;
+   Counter& eventsFiltered; // Events left out for connections that didn't subscribe to their controls
+   Counter& datagramsSent;
+   Counter& resyncs;
+   Counter& eventsDropped;
+   Counter& slowConsumerDisconnects;
+   Counter& sendTimeouts;
+   Counter& samplesPublished; // Samples of the source's state that changed something, with Config::publishInterval
+   Counter& ledRequestsReceived;
+   Counter& ledsSet; // LEDs actually turned on or off, after merging requests
+   Gauge& connections;
+   Histogram& sendLatency; // Microseconds from the capture of the oldest event in a batch until it is handed to send()
+   Histogram& connectionBacklog; // Events a connection was behind by each time it was sent a batch
 };
 
 } // namespace KontrollerSock
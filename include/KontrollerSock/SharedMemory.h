@@ -0,0 +1,236 @@
+#ifndef KONTROLLER_SOCK_SHARED_MEMORY_H
+#define KONTROLLER_SOCK_SHARED_MEMORY_H
+
+#include "KontrollerSock/BroadcastRing.h"
+#include "KontrollerSock/Packet.h"
+#include "KontrollerSock/SeqLock.h"
+#include "KontrollerSock/Sock.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <new>
+#include <string>
+#include <thread>
+
+#if SOCK_POSIX
+#  define SOCK_SHARED_MEMORY 1
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#else
+#  define SOCK_SHARED_MEMORY 0
+#endif
+
+#if defined(__linux__)
+#  define SOCK_FUTEX 1
+#  include <climits>
+#  include <linux/futex.h>
+#  include <sys/syscall.h>
+#else
+#  define SOCK_FUTEX 0
+#endif
+
+namespace KontrollerSock {
+
+constexpr const char kSharedMemoryName[] = "/KontrollerSock";
+
+// Name of the segment a device is published into, the base name for device 0 and "<name>.<device>" for the others
+inline std::string getSharedMemoryName(const char* name, uint16_t device) {
+   return device == 0 ? std::string(name) : std::string(name) + "." + std::to_string(device);
+}
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2 && ATOMIC_LLONG_LOCK_FREE == 2, "Shared memory needs lock free atomics");
+
+// The state along with the sequence number of the first event not reflected in it
+struct SharedSnapshot {
+   Kontroller::State state;
+   uint64_t sequence;
+};
+
+// Layout of the shared memory segment, written by the server and read by SharedMemoryClient (which only ever writes
+// the waiter count)
+// Bump kVersion whenever the layout changes.
+struct SharedSegment {
+   static const uint32_t kMagic = 0x4B534D53; // "KSMS"
+   static const uint32_t kVersion = 2;
+   static const size_t kEventCapacity = 4096;
+
+   uint32_t magic;
+   uint32_t version;
+   uint32_t size; // sizeof(SharedSegment), as seen by the server
+   std::atomic<uint32_t> open; // Set once the server has initialized everything, cleared once it stops publishing
+
+   // Incremented after every publish, readers block on it with a futex where available
+   std::atomic<uint32_t> wakeCounter;
+   // Number of readers blocked (or about to block) on the wake counter, publishing skips the wake up while it is zero
+   // A reader that dies while waiting leaves it raised, which only costs the publisher a wasted wake up.
+   std::atomic<uint32_t> waiters;
+
+   SeqLock<SharedSnapshot> snapshot;
+   FixedBroadcastRing<TimedEventPacket, kEventCapacity> events; // In host byte order
+};
+
+// Wakes every process blocked in waitForSharedSegment()
+inline void wakeSharedSegment(SharedSegment& segment) {
+   // Sequentially consistent on both sides, so either we see the waiter or the waiter's futex sees the new counter
+   segment.wakeCounter.fetch_add(1, std::memory_order_seq_cst);
+
+#if SOCK_FUTEX
+   if (segment.waiters.load(std::memory_order_seq_cst) != 0) {
+      ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&segment.wakeCounter), FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+   }
+#endif
+}
+
+// Blocks until the wake counter moves on from the given value, or until the timeout passes
+// Readers that can't write to the segment can't register as waiters, so they check back regularly instead.
+inline void waitForSharedSegment(SharedSegment& segment, bool writable, uint32_t wakeCounter, std::chrono::microseconds timeout) {
+#if SOCK_FUTEX
+   if (writable) {
+      segment.waiters.fetch_add(1, std::memory_order_seq_cst);
+
+      // Not a private futex, since the segment is shared between processes
+      timespec time = { static_cast<time_t>(timeout.count() / 1000000), static_cast<long>(timeout.count() % 1000000) * 1000 };
+      ::syscall(SYS_futex, reinterpret_cast<uint32_t*>(&segment.wakeCounter), FUTEX_WAIT, wakeCounter, &time, nullptr, 0);
+
+      segment.waiters.fetch_sub(1, std::memory_order_relaxed);
+      return;
+   }
+#else
+   (void)writable;
+#endif
+
+   // Without futexes, check back regularly
+   std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + timeout;
+   while (segment.wakeCounter.load(std::memory_order_acquire) == wakeCounter && std::chrono::steady_clock::now() < deadline) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+   }
+}
+
+#if SOCK_SHARED_MEMORY
+// A mapping of the shared segment, created by the server (and unlinked when it is done with it) or opened by a reader
+// Readers map it writable when they are allowed to (for the waiter count), read-only otherwise.
+class SharedSegmentMapping {
+public:
+   SharedSegmentMapping() = default;
+   SharedSegmentMapping(const SharedSegmentMapping& other) = delete;
+   SharedSegmentMapping& operator=(const SharedSegmentMapping& other) = delete;
+
+   ~SharedSegmentMapping() {
+      close();
+   }
+
+   bool create(const char* name) {
+      close();
+
+      // Replace any segment left behind by a server that didn't shut down cleanly
+      ::shm_unlink(name);
+      int fileDescriptor = ::shm_open(name, O_CREAT | O_EXCL | O_RDWR, 0644);
+      if (fileDescriptor == -1) {
+         printf("shm_open failed with error: %d\n", errno);
+         return false;
+      }
+
+      bool success = ::ftruncate(fileDescriptor, sizeof(SharedSegment)) == 0;
+      void* address = success ? ::mmap(nullptr, sizeof(SharedSegment), PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, 0) : MAP_FAILED;
+      ::close(fileDescriptor);
+      if (address == MAP_FAILED) {
+         printf("Unable to map shared memory, error: %d\n", errno);
+         ::shm_unlink(name);
+         return false;
+      }
+
+      segment = new (address) SharedSegment;
+      segment->magic = SharedSegment::kMagic;
+      segment->version = SharedSegment::kVersion;
+      segment->size = sizeof(SharedSegment);
+      segment->open.store(0, std::memory_order_relaxed);
+      segment->wakeCounter.store(0, std::memory_order_relaxed);
+      segment->waiters.store(0, std::memory_order_relaxed);
+
+      unlinkName = name;
+      writable = true;
+      return true;
+   }
+
+   bool open(const char* name) {
+      close();
+
+      // The segment is only writable by the server's user, others fall back to a read-only mapping
+      writable = true;
+      int fileDescriptor = ::shm_open(name, O_RDWR, 0);
+      if (fileDescriptor == -1 && errno == EACCES) {
+         writable = false;
+         fileDescriptor = ::shm_open(name, O_RDONLY, 0);
+      }
+      if (fileDescriptor == -1) {
+         return false;
+      }
+
+      struct stat status = {};
+      bool sizeMatches = ::fstat(fileDescriptor, &status) == 0 && status.st_size == static_cast<off_t>(sizeof(SharedSegment));
+      int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+      void* address = sizeMatches ? ::mmap(nullptr, sizeof(SharedSegment), protection, MAP_SHARED, fileDescriptor, 0) : MAP_FAILED;
+      ::close(fileDescriptor);
+      if (address == MAP_FAILED) {
+         return false;
+      }
+
+      segment = static_cast<SharedSegment*>(address);
+
+      // The segment may not have been initialized yet, or may have been left behind by a server that has stopped
+      if (!segment->open.load(std::memory_order_acquire)) {
+         close();
+         return false;
+      }
+
+      if (segment->magic != SharedSegment::kMagic || segment->version != SharedSegment::kVersion || segment->size != sizeof(SharedSegment)) {
+         printf("Shared memory segment %s has an unsupported layout\n", name);
+         close();
+         return false;
+      }
+
+      return true;
+   }
+
+   void close() {
+      if (segment) {
+         ::munmap(segment, sizeof(SharedSegment));
+         segment = nullptr;
+      }
+      writable = false;
+
+      if (unlinkName) {
+         ::shm_unlink(unlinkName);
+         unlinkName = nullptr;
+      }
+   }
+
+   SharedSegment* get() const {
+      return segment;
+   }
+
+   // Whether the segment may be written to (always the case for segments we created)
+   bool isWritable() const {
+      return writable;
+   }
+
+   explicit operator bool() const {
+      return segment != nullptr;
+   }
+
+private:
+   SharedSegment* segment = nullptr;
+   bool writable = false;
+   const char* unlinkName = nullptr; // Set for segments we created
+};
+#endif // SOCK_SHARED_MEMORY
+
+} // namespace KontrollerSock
+
+#endif
@@ -0,0 +1,68 @@
+#ifndef KONTROLLER_SOCK_SHARED_MEMORY_CLIENT_H
+#define KONTROLLER_SOCK_SHARED_MEMORY_CLIENT_H
+
+#include "KontrollerSock/Client.h"
+#include "KontrollerSock/SharedMemory.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace KontrollerSock {
+
+// Reads the state and events that a server on the same host publishes into shared memory (see
+// Server::Config::sharedMemoryName)
+// Reading from the segment never writes to it or makes a system call - only waitForEvents() does. There is
+// no network thread, so events are only picked up when polled for. Only one thread may poll / wait for events at a
+// time, but the state can be read from any thread.
+class SharedMemoryClient {
+public:
+   struct Stats {
+      uint64_t eventsReceived = 0;
+      uint64_t eventsMissed = 0; // Events overwritten before they were polled for
+   };
+
+   // Reads the given device's segment, see getSharedMemoryName()
+   explicit SharedMemoryClient(const char* segmentName = kSharedMemoryName, uint16_t segmentDevice = 0);
+
+   // Maps the segment, returns false if the server isn't publishing one (yet)
+   // Events published before opening aren't polled for, they are reflected in getState().
+   bool open();
+
+   void close();
+
+   bool isOpen() const;
+
+   // Whether the server is still publishing, once it stops the client has to be reopened to pick up a new server
+   bool isServerRunning() const;
+
+   // Everything published so far, no matter what has been polled for (a default state if not open)
+   Kontroller::State getState() const;
+
+   // Copies up to maxEvents events (oldest first), and returns how many were copied
+   // If polling falls more than a ring of events behind, the missed events are skipped (and counted), and polling
+   // carries on with the latest ones. getState() still reflects the skipped events.
+   size_t pollEvents(Client::Event* events, size_t maxEvents);
+
+   // Blocks until there are events to poll for, or until the timeout passes, returns whether there are any
+   bool waitForEvents(std::chrono::microseconds timeout);
+
+   Stats getStats() const {
+      return stats;
+   }
+
+private:
+   const std::string name;
+   const uint16_t device;
+#if SOCK_SHARED_MEMORY
+   SharedSegmentMapping mapping;
+#endif
+   uint64_t cursor;
+   Stats stats;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -0,0 +1,69 @@
+#ifndef KONTROLLER_SOCK_SNAPSHOT_H
+#define KONTROLLER_SOCK_SNAPSHOT_H
+
+#include "KontrollerSock/Controls.h"
+#include "KontrollerSock/Packet.h"
+#include "KontrollerSock/Sock.h"
+
+#include <Kontroller/Kontroller.h>
+
+#include <cstdint>
+#include <cstring>
+
+namespace KontrollerSock {
+
+inline uint32_t floatToNetwork(float value) {
+   uint32_t bits = 0;
+   static_assert(sizeof(bits) == sizeof(value), "Packet data size does not match event data size");
+   memcpy(&bits, &value, sizeof(bits));
+
+   return Sock::Endian::hostToNetworkLong(bits);
+}
+
+inline float networkToFloat(uint32_t networkBits) {
+   uint32_t bits = Sock::Endian::networkToHostLong(networkBits);
+   float value = 0.0f;
+   memcpy(&value, &bits, sizeof(value));
+
+   return value;
+}
+
+inline SnapshotPacket encodeSnapshot(const Kontroller::State& state) {
+   SnapshotPacket packet = {};
+   packet.header.type = EventPacket::kSnapshot;
+   packet.header.id = 0;
+   packet.header.value = sizeof(SnapshotPacket) - sizeof(EventPacket);
+   packet.header = hostToNetwork(packet.header);
+
+   uint32_t buttonBits[2] = {};
+   for (size_t index = 0; index < kNumButtons; ++index) {
+      if (getControlValue<bool>(state, kButtonControls[index])) {
+         buttonBits[index / 32] |= 1u << (index % 32);
+      }
+   }
+   packet.buttons[0] = Sock::Endian::hostToNetworkLong(buttonBits[0]);
+   packet.buttons[1] = Sock::Endian::hostToNetworkLong(buttonBits[1]);
+
+   for (size_t group = 0; group < kNumGroups; ++group) {
+      packet.dials[group] = floatToNetwork(getControlValue<float>(state, kDialControls[group]));
+      packet.sliders[group] = floatToNetwork(getControlValue<float>(state, kSliderControls[group]));
+   }
+
+   return packet;
+}
+
+inline void decodeSnapshot(const SnapshotPacket& packet, Kontroller::State& state) {
+   uint32_t buttonBits[2] = { Sock::Endian::networkToHostLong(packet.buttons[0]), Sock::Endian::networkToHostLong(packet.buttons[1]) };
+   for (size_t index = 0; index < kNumButtons; ++index) {
+      getControlValue<bool>(state, kButtonControls[index]) = (buttonBits[index / 32] & (1u << (index % 32))) != 0;
+   }
+
+   for (size_t group = 0; group < kNumGroups; ++group) {
+      getControlValue<float>(state, kDialControls[group]) = networkToFloat(packet.dials[group]);
+      getControlValue<float>(state, kSliderControls[group]) = networkToFloat(packet.sliders[group]);
+   }
+}
+
+} // namespace KontrollerSock
+
+#endif
@@ -25,6 +25,7 @@ using ssize_t = SSIZE_T;
 #  include <arpa/inet.h>
 #  include <netdb.h>
 #  include <netinet/tcp.h>
+#  include <poll.h>
 #  include <sys/errno.h>
 #  include <sys/ioctl.h>
 #  include <sys/socket.h>
@@ -42,16 +43,28 @@ constexpr Socket kInvalidSocket = INVALID_SOCKET;
 enum Errors {
    kNoError = 0,
    kWouldBlock = WSAEWOULDBLOCK,
-   kInProgress = WSAEINPROGRESS
+   kInProgress = WSAEINPROGRESS,
+   kInterrupted = WSAEINTR
 };
+using PollDescriptor = WSAPOLLFD;
+using PollCount = ULONG;
+constexpr int kNoSignal = 0;
 #elif SOCK_POSIX
 using Socket = int;
 constexpr Socket kInvalidSocket = -1;
 enum Errors {
    kNoError = 0,
    kWouldBlock = EWOULDBLOCK,
-   kInProgress = EINPROGRESS
+   kInProgress = EINPROGRESS,
+   kInterrupted = EINTR
 };
+using PollDescriptor = pollfd;
+using PollCount = nfds_t;
+#  if defined(MSG_NOSIGNAL)
+constexpr int kNoSignal = MSG_NOSIGNAL; // Don't raise SIGPIPE when writing to a closed connection
+#  else
+constexpr int kNoSignal = 0;
+#  endif
 #endif
 
 namespace System {
@@ -159,6 +172,14 @@ inline int listen(Socket socket, int backlog) {
    return ::listen(socket, backlog);
 }
 
+inline int poll(PollDescriptor* fds, PollCount nfds, int timeout) {
+#if SOCK_WINDOWS
+   return ::WSAPoll(fds, nfds, timeout);
+#elif SOCK_POSIX
+   return ::poll(fds, nfds, timeout);
+#endif
+}
+
 inline ssize_t recv(Socket socket, void* buf, size_t len, int flags) {
 #if SOCK_WINDOWS
    return ::recv(socket, static_cast<char*>(buf), static_cast<int>(len), flags);
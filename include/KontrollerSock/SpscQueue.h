@@ -0,0 +1,72 @@
+#ifndef KONTROLLER_SOCK_SPSC_QUEUE_H
+#define KONTROLLER_SOCK_SPSC_QUEUE_H
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <type_traits>
+
+namespace KontrollerSock {
+
+// Bounded single-producer / single-consumer queue
+// Neither side ever blocks - push() fails when the queue is full, and pop() returns nothing when it is empty.
+template<typename T>
+class SpscQueue {
+public:
+   static_assert(std::is_trivially_copyable<T>::value, "SpscQueue values must be trivially copyable");
+
+   // The capacity is rounded up to a power of two
+   explicit SpscQueue(size_t minCapacity) : mask(0), headIndex(0), tailIndex(0) {
+      size_t capacity = 1;
+      while (capacity < minCapacity) {
+         capacity <<= 1;
+      }
+
+      mask = capacity - 1;
+      values.reset(new T[capacity]);
+   }
+
+   size_t capacity() const {
+      return mask + 1;
+   }
+
+   // Producer only, returns false if the queue is full
+   bool push(const T& value) {
+      uint64_t tail = tailIndex.load(std::memory_order_relaxed);
+      if (tail - headIndex.load(std::memory_order_acquire) >= capacity()) {
+         return false;
+      }
+
+      values[tail & mask] = value;
+      tailIndex.store(tail + 1, std::memory_order_release);
+
+      return true;
+   }
+
+   // Consumer only, copies up to maxValues values out of the queue and returns how many were copied
+   size_t pop(T* out, size_t maxValues) {
+      uint64_t head = headIndex.load(std::memory_order_relaxed);
+      uint64_t available = tailIndex.load(std::memory_order_acquire) - head;
+
+      size_t count = available < maxValues ? static_cast<size_t>(available) : maxValues;
+      for (size_t i = 0; i < count; ++i) {
+         out[i] = values[(head + i) & mask];
+      }
+
+      headIndex.store(head + count, std::memory_order_release);
+      return count;
+   }
+
+private:
+   std::unique_ptr<T[]> values;
+   size_t mask;
+
+   // Padded onto separate cache lines so the producer and consumer don't contend
+   std::atomic<uint64_t> headIndex;
+   uint8_t headPadding[64 - sizeof(std::atomic<uint64_t>)];
+   std::atomic<uint64_t> tailIndex;
+};
+
+} // namespace KontrollerSock
+
+#endif
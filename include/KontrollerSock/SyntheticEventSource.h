@@ -0,0 +1,88 @@
+#ifndef KONTROLLER_SOCK_SYNTHETIC_EVENT_SOURCE_H
+#define KONTROLLER_SOCK_SYNTHETIC_EVENT_SOURCE_H
+
+#include "KontrollerSock/EventSource.h"
+
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <random>
+#include <thread>
+
+namespace KontrollerSock {
+
+// Generates events from its own thread at a configurable rate, so that a Server can be driven without any hardware
+class SyntheticEventSource : public EventSource {
+public:
+   enum class Pattern {
+      kSliderSweep, // Each slider in turn moves a step, sweeping back and forth
+      kButtonMash, // Random buttons are pressed and released
+      kBursts, // Bursts of random dial and slider moves, sent back to back
+      kInterleaved // Slider moves and button presses / releases take turns, each going through every control in order
+   };
+
+   struct Config {
+      Pattern pattern = Pattern::kSliderSweep;
+
+      // Average rate (bursts are spread out to match it), or zero to generate events as fast as possible
+      double eventsPerSecond = 1000.0;
+
+      // Number of events in each burst, only used by Pattern::kBursts
+      uint64_t burstSize = 64;
+
+      uint32_t seed = 1;
+   };
+
+   SyntheticEventSource();
+
+   explicit SyntheticEventSource(const Config& sourceConfig);
+
+   ~SyntheticEventSource();
+
+   void start();
+
+   void stop();
+
+   uint64_t getEventsGenerated() const {
+      return eventsGenerated.load(std::memory_order_relaxed);
+   }
+
+   // LEDs that are currently on (see getLEDMask()), as set through setLED()
+   uint32_t getLitLEDs() const {
+      return litLEDs.load(std::memory_order_relaxed);
+   }
+
+   Kontroller::State getState() override;
+
+   void setButtonCallback(ButtonCallback callback) override;
+   void setDialCallback(DialCallback callback) override;
+   void setSliderCallback(SliderCallback callback) override;
+
+   bool enableLEDControl(bool enable) override;
+   void setLED(Kontroller::LED led, bool on) override;
+
+private:
+   void run();
+   void generate(uint64_t index);
+
+   const Config config;
+   std::atomic_bool running;
+   std::thread thread;
+   std::mt19937 random;
+
+   std::mutex stateMutex;
+   Kontroller::State state;
+
+   // Held while calling callbacks, so that once a callback has been replaced the old one is no longer running
+   std::mutex callbackMutex;
+   ButtonCallback buttonCallback;
+   DialCallback dialCallback;
+   SliderCallback sliderCallback;
+
+   std::atomic<uint64_t> eventsGenerated;
+   std::atomic<uint32_t> litLEDs;
+};
+
+} // namespace KontrollerSock
+
+#endif
@@ -0,0 +1,1064 @@
+#include "KontrollerSock/Client.h"
+#include "KontrollerSock/Controls.h"
+#include "KontrollerSock/Relay.h"
+#include "KontrollerSock/ReplayEventSource.h"
+#include "KontrollerSock/Server.h"
+#include "KontrollerSock/SharedMemoryClient.h"
+#include "KontrollerSock/Snapshot.h"
+#include "KontrollerSock/SyntheticEventSource.h"
+
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if SOCK_POSIX
+#  include <csignal>
+#  include <sys/resource.h>
+#  include <sys/wait.h>
+#  include <unistd.h>
+#endif
+
+using namespace KontrollerSock;
+
+namespace {
+
+struct Options {
+   Server::Mode mode = Server::Mode::kEventLoop;
+   int numEventLoops = 1;
+   int numClients = 4;
+   int numDevices = 1;
+   bool conflate = false;
+   bool compact = false;
+   SyntheticEventSource::Pattern pattern = SyntheticEventSource::Pattern::kSliderSweep;
+   const char* patternName = "sweep";
+   double eventsPerSecond = 10000.0;
+   uint64_t burstSize = 64;
+   double seconds = 5.0;
+   int numReaders = 0;
+   int numSharedMemoryClients = 0;
+   bool sharedMemorySpin = false;
+   uint64_t publishIntervalMicroseconds = 0;
+   const char* journalPath = nullptr;
+   const char* replayPath = nullptr;
+   double replaySpeed = 1.0;
+   bool bounce = false;
+   Client::Subscription subscription;
+   const char* subscriptionName = "all";
+   int numRelays = 0;
+   int numConnectClients = 0;
+   int maxDatagramReceivers = 0;
+   double datagramLossRate = 0.0;
+   int maxFanOutClients = 0;
+};
+
+const char* kMulticastGroup = "239.255.40.80";
+
+const Histogram* findHistogram(const Metrics& metrics, const char* name) {
+   const Histogram* found = nullptr;
+   metrics.forEachHistogram([name, &found](const std::string& histogramName, const Histogram& histogram) {
+      if (histogramName == name) {
+         found = &histogram;
+      }
+   });
+
+   return found;
+}
+
+// Checks that events from the interleaved pattern arrive in the order they were captured: slider moves and button presses
+// taking turns, each going through every control in order, with capture times that never go backwards
+// Changes found in a state (which have no capture time) and dropped event markers start the sequence over.
+class OrderingCheck {
+public:
+   void check(const Client::Event* events, size_t numEvents) {
+      for (size_t i = 0; i < numEvents; ++i) {
+         if (events[i].device < kMaxDevices) {
+            check(devices[events[i].device], events[i]);
+         }
+      }
+   }
+
+   // Starts the sequence over, for when events were missed without anything to show for it in the stream
+   void restart() {
+      for (DeviceOrder& order : devices) {
+         order = DeviceOrder();
+      }
+   }
+
+   uint64_t getViolations() const {
+      return violations;
+   }
+
+private:
+   struct DeviceOrder {
+      uint64_t captureTime = 0;
+      int lastSlider = -1;
+      int lastButton = -1;
+      bool sliderNext = false;
+      bool started = false;
+   };
+
+   void check(DeviceOrder& order, const Client::Event& event) {
+      if (event.captureTime == 0 || event.type == EventPacket::kEventsDropped) {
+         order = DeviceOrder();
+         return;
+      }
+
+      bool slider = event.type == EventPacket::kSlider;
+      int index = slider ? kSliderIndex.find(event.id) : (event.type == EventPacket::kButton ? kButtonIndex.find(event.id) : -1);
+      bool inOrder = index >= 0 && event.captureTime >= order.captureTime;
+      if (order.started) {
+         int last = slider ? order.lastSlider : order.lastButton;
+         int numControls = static_cast<int>(slider ? kNumGroups : kNumButtons);
+         inOrder = inOrder && slider == order.sliderNext && (last < 0 || index == (last + 1) % numControls);
+      }
+
+      if (!inOrder) {
+         ++violations;
+      }
+
+      order.captureTime = event.captureTime;
+      (slider ? order.lastSlider : order.lastButton) = index;
+      order.sliderNext = !slider;
+      order.started = true;
+   }
+
+   DeviceOrder devices[kMaxDevices];
+   uint64_t violations = 0;
+};
+
+// Device 0's state behind a mutex, kept up to date from the batches the first client receives (so it is written as
+// often as the client's own state), as the baseline for what getState() would cost without its SeqLock
+class MutexState {
+public:
+   void apply(const Client::Event* events, const EventPacket* packets, size_t numEvents) {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (size_t i = 0; i < numEvents; ++i) {
+         if (events[i].device == 0) {
+            applyControlEvent(state, packets[i]);
+         }
+      }
+   }
+
+   Kontroller::State getState() const {
+      std::lock_guard<std::mutex> lock(mutex);
+      return state;
+   }
+
+private:
+   mutable std::mutex mutex;
+   Kontroller::State state {};
+};
+
+// Only the first group's controls
+Client::Subscription makeGroupSubscription() {
+   Client::Subscription subscription;
+   subscription.buttons = getControlMask(Kontroller::Button::kGroup1Solo) | getControlMask(Kontroller::Button::kGroup1Mute) | getControlMask(Kontroller::Button::kGroup1Record);
+   subscription.dials = getControlMask(Kontroller::Dial::kGroup1);
+   subscription.sliders = getControlMask(Kontroller::Slider::kGroup1);
+
+   return subscription;
+}
+
+// Only the transport buttons
+Client::Subscription makeTransportSubscription() {
+   Client::Subscription subscription;
+   subscription.buttons = getControlMask(Kontroller::Button::kRewind) | getControlMask(Kontroller::Button::kFastForward) | getControlMask(Kontroller::Button::kStop) | getControlMask(Kontroller::Button::kPlay) | getControlMask(Kontroller::Button::kRecord);
+   subscription.dials = 0;
+   subscription.sliders = 0;
+
+   return subscription;
+}
+
+void printUsage(const char* program) {
+   printf("Usage: %s [--mode thread|event] [--loops N] [--clients N] [--devices N] [--conflate] [--compact] [--pattern sweep|mash|burst|interleave] [--rate EVENTS_PER_SECOND] [--burst N] [--seconds N] [--readers N] [--shm N] [--shm-spin] [--interval MICROSECONDS] [--journal PATH] [--replay PATH] [--speed N] [--bounce] [--subscribe all|group1|transport] [--relays N] [--connect N] [--datagrams N] [--loss FRACTION] [--fanout N]\n", program);
+   printf("Runs a server and clients over loopback, driven by synthetic events, and prints the results as a line of JSON (the last line of output)\n");
+   printf("Devices runs that many synthetic devices, each generating events at the given rate, with the TCP clients spread over\n");
+   printf("them (each selecting a single device). It can't be combined with a replay or relays.\n");
+   printf("A rate of 0 generates events as fast as possible. Readers call getState() on the first client in a loop,\n");
+   printf("taking turns with reading a copy of its state behind a mutex (updated with every batch the client receives).\n");
+   printf("The interleave pattern has every client check that events arrive in the order they were captured, and fails the run\n");
+   printf("if any don't. It can't be combined with conflating, subscribing to less than everything, an interval, or a replay.\n");
+   printf("Shared memory clients read events from the server's shared memory segment, alongside the TCP clients (which may be 0).\n");
+   printf("They block until events arrive, unless --shm-spin is given, in which case they poll without ever making a system call.\n");
+   printf("An interval makes the server sample the state at that interval instead of publishing every event as it happens.\n");
+   printf("A journal path records everything the server publishes. A replay path drives the server from a recorded journal\n");
+   printf("instead of synthetic events, at the given speed relative to the recording (0 for as fast as possible).\n");
+   printf("Bouncing restarts the server halfway through, and reports how long the clients took to get the state back.\n");
+   printf("Subscribing limits the TCP clients to the first group's controls or the transport buttons, which the server filters for.\n");
+   printf("Relays make a two level tree, with the TCP clients spread over relays of the server instead of connecting to it directly.\n");
+   printf("Latency is then measured from capture on the server to receipt by the clients, so subtracting the relays' latency gives the\n");
+   printf("latency added by the extra hop.\n");
+   printf("Connecting starts that many more clients all at once before the run, and reports how long each took from calling run()\n");
+   printf("until it had applied the state (clients that never got it within the timeout are reported separately).\n");
+   printf("Datagrams runs a server sending multicast datagrams to 1, 10, 100... and finally N receivers in turn, each of which\n");
+   printf("throws away the given fraction of them. Once the source stops, every receiver has to get back to the server's state\n");
+   printf("(from heartbeats, snapshot requests and the sync sequence) or the run fails. The server runs in a process of its own,\n");
+   printf("so that its CPU time (which includes generating the events) can be reported for each number of receivers.\n");
+   printf("Fanout runs the server with 10, 100... and finally N clients in turn, once with a thread per client and once with\n");
+   printf("the event loop(s), and reports the latency and CPU time of each run.\n");
+}
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+   for (int i = 1; i < argc; ++i) {
+      const char* arg = argv[i];
+      const char* value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+      if (strcmp(arg, "--conflate") == 0) {
+         options.conflate = true;
+         continue;
+      }
+      if (strcmp(arg, "--compact") == 0) {
+         options.compact = true;
+         continue;
+      }
+      if (strcmp(arg, "--shm-spin") == 0) {
+         options.sharedMemorySpin = true;
+         continue;
+      }
+      if (strcmp(arg, "--bounce") == 0) {
+         options.bounce = true;
+         continue;
+      }
+
+      if (!value) {
+         return false;
+      }
+      ++i;
+
+      if (strcmp(arg, "--mode") == 0) {
+         if (strcmp(value, "thread") == 0) {
+            options.mode = Server::Mode::kThreadPerClient;
+         } else if (strcmp(value, "event") == 0) {
+            options.mode = Server::Mode::kEventLoop;
+         } else {
+            return false;
+         }
+      } else if (strcmp(arg, "--loops") == 0) {
+         options.numEventLoops = atoi(value);
+      } else if (strcmp(arg, "--clients") == 0) {
+         options.numClients = atoi(value);
+      } else if (strcmp(arg, "--devices") == 0) {
+         options.numDevices = atoi(value);
+      } else if (strcmp(arg, "--pattern") == 0) {
+         options.patternName = value;
+         if (strcmp(value, "sweep") == 0) {
+            options.pattern = SyntheticEventSource::Pattern::kSliderSweep;
+         } else if (strcmp(value, "mash") == 0) {
+            options.pattern = SyntheticEventSource::Pattern::kButtonMash;
+         } else if (strcmp(value, "burst") == 0) {
+            options.pattern = SyntheticEventSource::Pattern::kBursts;
+         } else if (strcmp(value, "interleave") == 0) {
+            options.pattern = SyntheticEventSource::Pattern::kInterleaved;
+         } else {
+            return false;
+         }
+      } else if (strcmp(arg, "--rate") == 0) {
+         options.eventsPerSecond = atof(value);
+      } else if (strcmp(arg, "--burst") == 0) {
+         options.burstSize = strtoull(value, nullptr, 10);
+      } else if (strcmp(arg, "--seconds") == 0) {
+         options.seconds = atof(value);
+      } else if (strcmp(arg, "--readers") == 0) {
+         options.numReaders = atoi(value);
+      } else if (strcmp(arg, "--shm") == 0) {
+         options.numSharedMemoryClients = atoi(value);
+      } else if (strcmp(arg, "--interval") == 0) {
+         options.publishIntervalMicroseconds = strtoull(value, nullptr, 10);
+      } else if (strcmp(arg, "--journal") == 0) {
+         options.journalPath = value;
+      } else if (strcmp(arg, "--replay") == 0) {
+         options.replayPath = value;
+         options.patternName = "replay";
+      } else if (strcmp(arg, "--speed") == 0) {
+         options.replaySpeed = atof(value);
+      } else if (strcmp(arg, "--relays") == 0) {
+         options.numRelays = atoi(value);
+      } else if (strcmp(arg, "--connect") == 0) {
+         options.numConnectClients = atoi(value);
+      } else if (strcmp(arg, "--datagrams") == 0) {
+         options.maxDatagramReceivers = atoi(value);
+      } else if (strcmp(arg, "--loss") == 0) {
+         options.datagramLossRate = atof(value);
+      } else if (strcmp(arg, "--fanout") == 0) {
+         options.maxFanOutClients = atoi(value);
+      } else if (strcmp(arg, "--subscribe") == 0) {
+         options.subscriptionName = value;
+         if (strcmp(value, "all") == 0) {
+            options.subscription = Client::Subscription();
+         } else if (strcmp(value, "group1") == 0) {
+            options.subscription = makeGroupSubscription();
+         } else if (strcmp(value, "transport") == 0) {
+            options.subscription = makeTransportSubscription();
+         } else {
+            return false;
+         }
+      } else {
+         return false;
+      }
+   }
+
+   // Replays and relays only carry a single device
+   if (options.numDevices < 1 || options.numDevices > static_cast<int>(kMaxDevices) || (options.numDevices > 1 && (options.replayPath || options.numRelays > 0))) {
+      return false;
+   }
+
+   // Anything that leaves events out, or publishes changes rather than events, would break the sequence the check expects
+   if (options.pattern == SyntheticEventSource::Pattern::kInterleaved && (options.conflate || strcmp(options.subscriptionName, "all") != 0 || options.publishIntervalMicroseconds > 0 || options.replayPath)) {
+      return false;
+   }
+
+   return options.numClients + options.numSharedMemoryClients + options.numConnectClients + options.maxDatagramReceivers + options.maxFanOutClients > 0 && options.seconds > 0.0;
+}
+
+struct FanOutStep {
+   Server::Mode mode = Server::Mode::kThreadPerClient;
+   int numClients = 0;
+   int connectTimeouts = 0;
+   uint64_t eventsGenerated = 0;
+   uint64_t eventsReceived = 0;
+   uint64_t eventsMissed = 0;
+   Histogram latency;
+   double cpuMicrosecondsPerEvent = 0.0; // The whole process, i.e. the server and all of the clients
+};
+
+bool runFanOutStep(const Options& options, Server::Mode mode, int numClients, FanOutStep& step) {
+   step.mode = mode;
+   step.numClients = numClients;
+
+   SyntheticEventSource::Config sourceConfig;
+   sourceConfig.pattern = options.pattern;
+   sourceConfig.eventsPerSecond = options.eventsPerSecond;
+   sourceConfig.burstSize = options.burstSize;
+   SyntheticEventSource source(sourceConfig);
+
+   Server::Config serverConfig;
+   serverConfig.mode = mode;
+   serverConfig.numEventLoops = options.numEventLoops;
+   Server server(serverConfig);
+   std::atomic_bool serverSucceeded(true);
+   std::thread serverThread([&server, &source, &serverSucceeded]() { serverSucceeded = server.run(source); });
+
+   Client::Config clientConfig;
+   clientConfig.conflate = options.conflate;
+   clientConfig.compact = options.compact;
+   std::vector<std::unique_ptr<Client>> clients;
+   std::vector<std::thread> clientThreads;
+   for (int i = 0; i < numClients; ++i) {
+      clients.emplace_back(new Client(clientConfig));
+      Client* client = clients.back().get();
+      clientThreads.emplace_back([client]() { client->run("127.0.0.1"); });
+   }
+
+   // Every client starts from the state, so that all of them are being sent to from the start
+   std::chrono::steady_clock::time_point connectDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+   for (const std::unique_ptr<Client>& client : clients) {
+      const Histogram* connectTime = findHistogram(client->getMetrics(), "connect.timeToState.us");
+      while (connectTime->getCount() == 0 && std::chrono::steady_clock::now() < connectDeadline) {
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+      if (connectTime->getCount() == 0) {
+         ++step.connectTimeouts;
+      }
+   }
+
+   std::clock_t startCpu = std::clock();
+   source.start();
+   std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+   source.stop();
+
+   // Let the clients catch up
+   std::this_thread::sleep_for(std::chrono::milliseconds(250));
+   double cpuSeconds = static_cast<double>(std::clock() - startCpu) / CLOCKS_PER_SEC;
+
+   step.eventsGenerated = source.getEventsGenerated();
+   step.cpuMicrosecondsPerEvent = step.eventsGenerated > 0 ? cpuSeconds * 1000000.0 / step.eventsGenerated : 0.0;
+   for (const std::unique_ptr<Client>& client : clients) {
+      Client::Stats stats = client->getStats();
+      step.eventsReceived += stats.eventsReceived;
+      step.eventsMissed += stats.eventsMissed;
+      step.latency.merge(*findHistogram(client->getMetrics(), "latency.captureToReceive.us"));
+
+      client->shutDown();
+   }
+   for (std::thread& thread : clientThreads) {
+      thread.join();
+   }
+
+   server.shutDown();
+   serverThread.join();
+
+   return serverSucceeded;
+}
+
+int runFanOutBench(const Options& options) {
+   std::vector<int> clientCounts;
+   for (int numClients = 10; numClients < options.maxFanOutClients; numClients *= 10) {
+      clientCounts.push_back(numClients);
+   }
+   clientCounts.push_back(options.maxFanOutClients);
+
+   bool serverSucceeded = true;
+   std::string steps;
+   for (int numClients : clientCounts) {
+      for (Server::Mode mode : { Server::Mode::kThreadPerClient, Server::Mode::kEventLoop }) {
+         FanOutStep step;
+         serverSucceeded = runFanOutStep(options, mode, numClients, step) && serverSucceeded;
+
+         char line[512];
+         snprintf(line, sizeof(line), "%s{\"mode\":\"%s\",\"clients\":%d,\"connectTimeouts\":%d,\"eventsGenerated\":%llu,\"eventsReceived\":%llu,\"eventsMissed\":%llu,"
+                  "\"latencyP50Us\":%llu,\"latencyP99Us\":%llu,\"latencyMaxUs\":%llu,\"cpuUsPerEvent\":%.3f}",
+                  steps.empty() ? "" : ",", mode == Server::Mode::kEventLoop ? "event" : "thread", step.numClients, step.connectTimeouts,
+                  static_cast<unsigned long long>(step.eventsGenerated), static_cast<unsigned long long>(step.eventsReceived), static_cast<unsigned long long>(step.eventsMissed),
+                  static_cast<unsigned long long>(step.latency.getPercentile(50.0)), static_cast<unsigned long long>(step.latency.getPercentile(99.0)), static_cast<unsigned long long>(step.latency.getMax()),
+                  step.cpuMicrosecondsPerEvent);
+         steps += line;
+      }
+   }
+
+   printf("{\"loops\":%d,\"conflate\":%s,\"compact\":%s,\"pattern\":\"%s\",\"targetRate\":%.0f,\"seconds\":%.3f,\"fanOutSteps\":[%s],\"serverOk\":%s}\n",
+          options.numEventLoops, options.conflate ? "true" : "false", options.compact ? "true" : "false", options.patternName, options.eventsPerSecond, options.seconds, steps.c_str(),
+          serverSucceeded ? "true" : "false");
+
+   return serverSucceeded ? 0 : 1;
+}
+
+#if SOCK_POSIX
+uint64_t getCpuMicroseconds() {
+   rusage usage = {};
+   getrusage(RUSAGE_SELF, &usage);
+
+   return static_cast<uint64_t>(usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000 + static_cast<uint64_t>(usage.ru_utime.tv_usec + usage.ru_stime.tv_usec);
+}
+
+bool readAll(int fd, void* data, size_t size) {
+   uint8_t* bytes = static_cast<uint8_t*>(data);
+   while (size > 0) {
+      ssize_t result = read(fd, bytes, size);
+      if (result <= 0) {
+         return false;
+      }
+      bytes += result;
+      size -= static_cast<size_t>(result);
+   }
+
+   return true;
+}
+
+bool writeAll(int fd, const void* data, size_t size) {
+   const uint8_t* bytes = static_cast<const uint8_t*>(data);
+   while (size > 0) {
+      ssize_t result = write(fd, bytes, size);
+      if (result <= 0) {
+         return false;
+      }
+      bytes += result;
+      size -= static_cast<size_t>(result);
+   }
+
+   return true;
+}
+
+struct DatagramServerResults {
+   uint64_t eventsGenerated = 0;
+   uint64_t datagramsSent = 0;
+   uint64_t cpuMicroseconds = 0; // From starting the source until shutting down, i.e. including recovery
+   bool serverOk = false;
+};
+
+// Runs in the server's process, driven by single byte commands: 'g' starts the source, 's' stops it and replies with the
+// state it ended up in, and 'q' replies with the results and shuts the server down
+void runDatagramServer(const Options& options, int commandFd, int resultFd) {
+   SyntheticEventSource::Config sourceConfig;
+   sourceConfig.pattern = options.pattern;
+   sourceConfig.eventsPerSecond = options.eventsPerSecond;
+   sourceConfig.burstSize = options.burstSize;
+   SyntheticEventSource source(sourceConfig);
+
+   Server::Config serverConfig;
+   serverConfig.mode = options.mode;
+   serverConfig.numEventLoops = options.numEventLoops;
+   serverConfig.datagramAddress = kMulticastGroup;
+   Server server(serverConfig);
+   std::atomic_bool serverSucceeded(true);
+   std::thread serverThread([&server, &source, &serverSucceeded]() { serverSucceeded = server.run(source); });
+
+   uint64_t startCpu = getCpuMicroseconds();
+   char command = 0;
+   while (readAll(commandFd, &command, sizeof(command)) && command != 'q') {
+      if (command == 'g') {
+         startCpu = getCpuMicroseconds();
+         source.start();
+      } else if (command == 's') {
+         source.stop();
+         SnapshotPacket state = encodeSnapshot(source.getState());
+         writeAll(resultFd, &state, sizeof(state));
+      }
+   }
+
+   DatagramServerResults results;
+   results.cpuMicroseconds = getCpuMicroseconds() - startCpu;
+   results.eventsGenerated = source.getEventsGenerated();
+   results.datagramsSent = server.getStats().datagramsSent;
+
+   server.shutDown();
+   serverThread.join();
+   results.serverOk = serverSucceeded;
+   writeAll(resultFd, &results, sizeof(results));
+}
+
+struct DatagramStep {
+   int numReceivers = 0;
+   DatagramServerResults server;
+   uint64_t eventsReceived = 0;
+   uint64_t eventsMissed = 0;
+   uint64_t latencyP50 = 0;
+   uint64_t latencyP99 = 0;
+   double recoverySeconds = 0.0; // From stopping the source until every receiver had the server's state
+   int mismatches = 0; // Receivers that never got there
+};
+
+bool runDatagramStep(const Options& options, int numReceivers, DatagramStep& step) {
+   step.numReceivers = numReceivers;
+
+   int commandPipe[2];
+   int resultPipe[2];
+   if (pipe(commandPipe) != 0 || pipe(resultPipe) != 0) {
+      printf("pipe failed with error: %d\n", errno);
+      return false;
+   }
+
+   pid_t pid = fork();
+   if (pid < 0) {
+      printf("fork failed with error: %d\n", errno);
+      return false;
+   }
+   if (pid == 0) {
+      close(commandPipe[1]);
+      close(resultPipe[0]);
+      runDatagramServer(options, commandPipe[0], resultPipe[1]);
+      _exit(0);
+   }
+   close(commandPipe[0]);
+   close(resultPipe[1]);
+   int commandFd = commandPipe[1];
+   int resultFd = resultPipe[0];
+
+   Client::Config clientConfig;
+   clientConfig.datagrams = true;
+   clientConfig.multicastGroup = kMulticastGroup;
+   clientConfig.datagramLossRate = options.datagramLossRate;
+   std::vector<std::unique_ptr<Client>> receivers;
+   std::vector<std::thread> receiverThreads;
+   for (int i = 0; i < numReceivers; ++i) {
+      receivers.emplace_back(new Client(clientConfig));
+      Client* receiver = receivers.back().get();
+      receiverThreads.emplace_back([receiver]() { receiver->run("127.0.0.1"); });
+   }
+
+   // Every receiver starts from the state, so that events flow to all of them from the start
+   std::chrono::steady_clock::time_point connectDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+   for (const std::unique_ptr<Client>& receiver : receivers) {
+      const Histogram* connectTime = findHistogram(receiver->getMetrics(), "connect.timeToState.us");
+      while (connectTime->getCount() == 0 && std::chrono::steady_clock::now() < connectDeadline) {
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+   }
+
+   char command = 'g';
+   bool success = writeAll(commandFd, &command, sizeof(command));
+   std::this_thread::sleep_for(std::chrono::duration<double>(options.seconds));
+
+   command = 's';
+   SnapshotPacket serverState = {};
+   success = success && writeAll(commandFd, &command, sizeof(command)) && readAll(resultFd, &serverState, sizeof(serverState));
+   std::chrono::steady_clock::time_point stopTime = std::chrono::steady_clock::now();
+
+   // Lost datagrams at the end only show up in the next heartbeat, and every gap costs a round trip for the state
+   std::chrono::steady_clock::time_point recoveryDeadline = stopTime + std::chrono::seconds(5);
+   do {
+      step.mismatches = 0;
+      for (const std::unique_ptr<Client>& receiver : receivers) {
+         SnapshotPacket receiverState = encodeSnapshot(receiver->getState());
+         if (memcmp(&receiverState, &serverState, sizeof(receiverState)) != 0) {
+            ++step.mismatches;
+         }
+      }
+
+      if (step.mismatches > 0) {
+         std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+   } while (success && step.mismatches > 0 && std::chrono::steady_clock::now() < recoveryDeadline);
+   step.recoverySeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stopTime).count();
+
+   command = 'q';
+   success = success && writeAll(commandFd, &command, sizeof(command)) && readAll(resultFd, &step.server, sizeof(step.server));
+
+   Histogram latency;
+   for (const std::unique_ptr<Client>& receiver : receivers) {
+      Client::Stats stats = receiver->getStats();
+      step.eventsReceived += stats.eventsReceived;
+      step.eventsMissed += stats.eventsMissed;
+      latency.merge(*findHistogram(receiver->getMetrics(), "latency.captureToReceive.us"));
+
+      receiver->shutDown();
+   }
+   for (std::thread& thread : receiverThreads) {
+      thread.join();
+   }
+   step.latencyP50 = latency.getPercentile(50.0);
+   step.latencyP99 = latency.getPercentile(99.0);
+
+   close(commandFd);
+   close(resultFd);
+   int status = 0;
+   waitpid(pid, &status, 0);
+
+   return success && WIFEXITED(status) && WEXITSTATUS(status) == 0 && step.server.serverOk;
+}
+
+int runDatagramBench(const Options& options) {
+   // A server process that dies shouldn't take the bench with it
+   signal(SIGPIPE, SIG_IGN);
+
+   std::vector<int> receiverCounts;
+   for (int numReceivers = 1; numReceivers < options.maxDatagramReceivers; numReceivers *= 10) {
+      receiverCounts.push_back(numReceivers);
+   }
+   receiverCounts.push_back(options.maxDatagramReceivers);
+
+   bool serverSucceeded = true;
+   bool recovered = true;
+   std::string steps;
+   for (int numReceivers : receiverCounts) {
+      DatagramStep step;
+      serverSucceeded = runDatagramStep(options, numReceivers, step) && serverSucceeded;
+      recovered = recovered && step.mismatches == 0;
+
+      double cpuMicrosecondsPerEvent = step.server.eventsGenerated > 0 ? static_cast<double>(step.server.cpuMicroseconds) / step.server.eventsGenerated : 0.0;
+      char line[512];
+      snprintf(line, sizeof(line), "%s{\"receivers\":%d,\"eventsGenerated\":%llu,\"datagramsSent\":%llu,\"serverCpuUs\":%llu,\"serverCpuUsPerEvent\":%.3f,"
+               "\"eventsReceived\":%llu,\"eventsMissed\":%llu,\"latencyP50Us\":%llu,\"latencyP99Us\":%llu,\"recoveryMs\":%.1f,\"stateMismatches\":%d}",
+               steps.empty() ? "" : ",", step.numReceivers, static_cast<unsigned long long>(step.server.eventsGenerated), static_cast<unsigned long long>(step.server.datagramsSent),
+               static_cast<unsigned long long>(step.server.cpuMicroseconds), cpuMicrosecondsPerEvent,
+               static_cast<unsigned long long>(step.eventsReceived), static_cast<unsigned long long>(step.eventsMissed), static_cast<unsigned long long>(step.latencyP50), static_cast<unsigned long long>(step.latencyP99),
+               step.recoverySeconds * 1000.0, step.mismatches);
+      steps += line;
+   }
+
+   printf("{\"mode\":\"%s\",\"loops\":%d,\"pattern\":\"%s\",\"targetRate\":%.0f,\"seconds\":%.3f,\"datagramLoss\":%.4f,\"datagramSteps\":[%s],\"recovered\":%s,\"serverOk\":%s}\n",
+          options.mode == Server::Mode::kEventLoop ? "event" : "thread", options.numEventLoops, options.patternName, options.eventsPerSecond, options.seconds, options.datagramLossRate, steps.c_str(),
+          recovered ? "true" : "false", serverSucceeded ? "true" : "false");
+
+   return serverSucceeded && recovered ? 0 : 1;
+}
+#endif
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+   Options options;
+   if (!parseOptions(argc, argv, options)) {
+      printUsage(argv[0]);
+      return 1;
+   }
+
+   if (options.maxFanOutClients > 0) {
+      return runFanOutBench(options);
+   }
+
+   if (options.maxDatagramReceivers > 0) {
+#if SOCK_POSIX
+      return runDatagramBench(options);
+#else
+      printf("Datagram runs are only supported on POSIX platforms\n");
+      return 1;
+#endif
+   }
+
+   SyntheticEventSource::Config sourceConfig;
+   sourceConfig.pattern = options.pattern;
+   sourceConfig.eventsPerSecond = options.eventsPerSecond;
+   sourceConfig.burstSize = options.burstSize;
+   SyntheticEventSource syntheticSource(sourceConfig);
+
+   // Devices other than the first, each with a source of its own
+   std::vector<std::unique_ptr<SyntheticEventSource>> extraSources;
+   for (int i = 1; i < options.numDevices; ++i) {
+      extraSources.emplace_back(new SyntheticEventSource(sourceConfig));
+   }
+
+   ReplayEventSource::Config replayConfig;
+   replayConfig.path = options.replayPath;
+   replayConfig.speed = options.replaySpeed;
+   ReplayEventSource replaySource(replayConfig);
+   if (options.replayPath && !replaySource.open()) {
+      return 1;
+   }
+
+   std::vector<EventSource*> sources;
+   sources.push_back(options.replayPath ? static_cast<EventSource*>(&replaySource) : &syntheticSource);
+   for (const std::unique_ptr<SyntheticEventSource>& extraSource : extraSources) {
+      sources.push_back(extraSource.get());
+   }
+
+   Server::Config serverConfig;
+   serverConfig.mode = options.mode;
+   serverConfig.numEventLoops = options.numEventLoops;
+   serverConfig.publishInterval = std::chrono::microseconds(options.publishIntervalMicroseconds);
+   if (options.numSharedMemoryClients > 0) {
+      serverConfig.sharedMemoryName = kSharedMemoryName;
+   }
+   serverConfig.journalPath = options.journalPath;
+   std::unique_ptr<Server> server(new Server(serverConfig));
+   bool serverSucceeded = false;
+   std::thread serverThread([&server, &sources, &serverSucceeded]() { serverSucceeded = server->run(sources); });
+
+   // Totals over every server run (there are two when bouncing)
+   Server::Stats serverStats;
+   uint64_t bytesSent = 0;
+   uint64_t eventsPublished = 0;
+   uint64_t eventsFiltered = 0;
+   auto stopServer = [&]() {
+      Server::Stats stats = server->getStats();
+      serverStats.eventsSent += stats.eventsSent;
+      serverStats.sendCalls += stats.sendCalls;
+      server->getMetrics().forEachCounter([&bytesSent, &eventsPublished, &eventsFiltered](const std::string& name, const Counter& counter) {
+         if (name == "bytes.sent") {
+            bytesSent += counter.get();
+         } else if (name == "events.published") {
+            eventsPublished += counter.get();
+         } else if (name == "events.filtered") {
+            eventsFiltered += counter.get();
+         }
+      });
+
+      server->shutDown();
+      serverThread.join();
+   };
+
+   // Each relay listens on the next port up from the server's
+   std::vector<std::string> relayEndpoints;
+   std::vector<std::string> relayPorts;
+   for (int i = 0; i < options.numRelays; ++i) {
+      relayPorts.push_back(std::to_string(atoi(kPort) + 1 + i));
+      relayEndpoints.push_back("127.0.0.1:" + relayPorts.back());
+   }
+
+   std::vector<std::unique_ptr<Relay>> relays;
+   std::vector<std::thread> relayThreads;
+   std::atomic_bool relaysSucceeded(true);
+   for (int i = 0; i < options.numRelays; ++i) {
+      Relay::Config relayConfig;
+      relayConfig.downstream.mode = options.mode;
+      relayConfig.downstream.numEventLoops = options.numEventLoops;
+      relayConfig.downstream.port = relayPorts[i].c_str();
+      relays.emplace_back(new Relay(relayConfig));
+      Relay* relay = relays.back().get();
+      relayThreads.emplace_back([relay, &relaysSucceeded]() {
+         if (!relay->run("127.0.0.1")) {
+            relaysSucceeded = false;
+         }
+      });
+   }
+
+   Client::Config clientConfig;
+   clientConfig.conflate = options.conflate;
+   clientConfig.compact = options.compact;
+   clientConfig.subscription = options.subscription;
+   bool checkOrdering = options.pattern == SyntheticEventSource::Pattern::kInterleaved;
+   std::vector<std::unique_ptr<Client>> clients;
+   std::vector<std::thread> clientThreads;
+   std::vector<std::unique_ptr<OrderingCheck>> orderingChecks;
+   MutexState mutexState;
+   for (int i = 0; i < options.numClients; ++i) {
+      Client::Config deviceClientConfig = clientConfig;
+      deviceClientConfig.devices = 1u << (i % options.numDevices);
+      clients.emplace_back(new Client(deviceClientConfig));
+      Client* client = clients.back().get();
+      OrderingCheck* orderingCheck = nullptr;
+      if (checkOrdering) {
+         orderingChecks.emplace_back(new OrderingCheck());
+         orderingCheck = orderingChecks.back().get();
+      }
+      MutexState* readersState = i == 0 && options.numReaders > 0 ? &mutexState : nullptr;
+      if (orderingCheck || readersState) {
+         client->setBatchCallback([orderingCheck, readersState](const Client::Event* events, const EventPacket* packets, size_t numEvents) {
+            if (orderingCheck) {
+               orderingCheck->check(events, numEvents);
+            }
+            if (readersState) {
+               readersState->apply(events, packets, numEvents);
+            }
+         });
+      }
+      std::string endpoint = relays.empty() ? "127.0.0.1" : relayEndpoints[i % relays.size()];
+      clientThreads.emplace_back([client, endpoint]() { client->run(endpoint.c_str()); });
+   }
+
+   // Shared memory clients either block until events arrive or spin
+   std::atomic_bool sharedMemoryRunning(true);
+   std::atomic<uint64_t> sharedMemoryEventsReceived(0);
+   std::atomic<uint64_t> sharedMemoryEventsMissed(0);
+   std::atomic<uint64_t> orderingViolations(0);
+   Histogram sharedMemoryLatency;
+   std::vector<std::thread> sharedMemoryThreads;
+   for (int i = 0; i < options.numSharedMemoryClients; ++i) {
+      sharedMemoryThreads.emplace_back([&]() {
+         SharedMemoryClient client;
+         while (sharedMemoryRunning && !client.open()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+         }
+
+         Client::Event events[256];
+         OrderingCheck orderingCheck;
+         uint64_t eventsMissed = 0;
+         while (sharedMemoryRunning) {
+            if (!options.sharedMemorySpin && !client.waitForEvents(std::chrono::milliseconds(100))) {
+               continue;
+            }
+
+            size_t count = client.pollEvents(events, 256);
+            for (size_t j = 0; j < count; ++j) {
+               sharedMemoryLatency.record(static_cast<uint64_t>(events[j].latency));
+            }
+            // Events skipped on an overrun can be anywhere in the batch, so that batch isn't checked
+            if (checkOrdering && client.getStats().eventsMissed != eventsMissed) {
+               eventsMissed = client.getStats().eventsMissed;
+               orderingCheck.restart();
+            } else if (checkOrdering) {
+               orderingCheck.check(events, count);
+            }
+         }
+
+         orderingViolations += orderingCheck.getViolations();
+
+         sharedMemoryEventsReceived += client.getStats().eventsReceived;
+         sharedMemoryEventsMissed += client.getStats().eventsMissed;
+      });
+   }
+
+   // Give everything time to connect and receive the initial state
+   std::this_thread::sleep_for(std::chrono::milliseconds(500));
+
+   // A storm of clients connecting at once, each timed from calling run() until it has applied the state
+   Histogram connectTime;
+   int connectTimeouts = 0;
+   if (options.numConnectClients > 0) {
+      std::vector<std::unique_ptr<Client>> connectClients;
+      std::vector<std::thread> connectThreads;
+      for (int i = 0; i < options.numConnectClients; ++i) {
+         connectClients.emplace_back(new Client(clientConfig));
+      }
+      for (const std::unique_ptr<Client>& connectClient : connectClients) {
+         Client* client = connectClient.get();
+         connectThreads.emplace_back([client]() { client->run("127.0.0.1"); });
+      }
+
+      std::chrono::steady_clock::time_point connectDeadline = std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      for (const std::unique_ptr<Client>& client : connectClients) {
+         const Histogram* clientConnectTime = findHistogram(client->getMetrics(), "connect.timeToState.us");
+         while (clientConnectTime->getCount() == 0 && std::chrono::steady_clock::now() < connectDeadline) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+         }
+
+         if (clientConnectTime->getCount() > 0) {
+            connectTime.merge(*clientConnectTime);
+         } else {
+            ++connectTimeouts;
+         }
+      }
+
+      for (const std::unique_ptr<Client>& client : connectClients) {
+         client->shutDown();
+      }
+      for (std::thread& thread : connectThreads) {
+         thread.join();
+      }
+   }
+
+   // Readers take turns with both ways of reading the state, a block of reads at a time, so both see the same load
+   std::atomic_bool reading(options.numReaders > 0);
+   std::atomic<uint64_t> numReads(0);
+   std::atomic<uint64_t> readNanoseconds(0);
+   std::atomic<uint64_t> numMutexReads(0);
+   std::atomic<uint64_t> mutexReadNanoseconds(0);
+   std::atomic<uint64_t> readChecksum(0); // Only there so that the reads have a result
+   std::vector<std::thread> readerThreads;
+   for (int i = 0; i < options.numReaders; ++i) {
+      readerThreads.emplace_back([&]() {
+         static const uint64_t kReadBlock = 1024;
+         uint64_t reads[2] = {};
+         uint64_t nanoseconds[2] = {};
+         uint64_t checksum = 0;
+         Kontroller::State previousState {};
+         for (int useMutex = 0; reading; useMutex = !useMutex) {
+            std::chrono::steady_clock::time_point blockStart = std::chrono::steady_clock::now();
+            for (uint64_t j = 0; j < kReadBlock; ++j) {
+               // Compared with the previous read, so that copying the whole state can't be optimized away
+               Kontroller::State state = useMutex ? mutexState.getState() : clients[0]->getState();
+               checksum += memcmp(&state, &previousState, sizeof(state)) != 0;
+               previousState = state;
+            }
+            nanoseconds[useMutex] += static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - blockStart).count());
+            reads[useMutex] += kReadBlock;
+         }
+
+         numReads += reads[0];
+         readNanoseconds += nanoseconds[0];
+         numMutexReads += reads[1];
+         mutexReadNanoseconds += nanoseconds[1];
+         readChecksum += checksum;
+      });
+   }
+
+   std::clock_t startCpu = std::clock();
+   std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+   // A replay stops early once the whole journal has been played back
+   std::chrono::steady_clock::time_point endTime = startTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double>(options.seconds));
+   std::chrono::steady_clock::time_point bounceTime = startTime + (endTime - startTime) / 2;
+   bool bounced = !options.bounce;
+   if (options.replayPath) {
+      replaySource.start();
+   } else {
+      syntheticSource.start();
+      for (const std::unique_ptr<SyntheticEventSource>& extraSource : extraSources) {
+         extraSource->start();
+      }
+   }
+
+   while (!(options.replayPath && replaySource.isFinished()) && std::chrono::steady_clock::now() < endTime) {
+      if (!bounced && std::chrono::steady_clock::now() >= bounceTime) {
+         // The source keeps going while the server is down, so the clients have to resync from the new server's state
+         stopServer();
+         bool firstRunSucceeded = serverSucceeded;
+         server.reset(new Server(serverConfig));
+         serverThread = std::thread([&server, &sources, &serverSucceeded, firstRunSucceeded]() { serverSucceeded = server->run(sources) && firstRunSucceeded; });
+         bounced = true;
+      }
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+   }
+
+   if (options.replayPath) {
+      replaySource.stop();
+   } else {
+      syntheticSource.stop();
+      for (const std::unique_ptr<SyntheticEventSource>& extraSource : extraSources) {
+         extraSource->stop();
+      }
+   }
+
+   double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+   // Let the clients catch up
+   std::this_thread::sleep_for(std::chrono::milliseconds(250));
+
+   double cpuSeconds = static_cast<double>(std::clock() - startCpu) / CLOCKS_PER_SEC;
+
+   reading = false;
+   for (std::thread& thread : readerThreads) {
+      thread.join();
+   }
+
+   sharedMemoryRunning = false;
+   for (std::thread& thread : sharedMemoryThreads) {
+      thread.join();
+   }
+
+   Histogram latency;
+   Histogram resyncTime;
+   uint64_t eventsReceived = 0;
+   uint64_t eventsMissed = 0;
+   for (const std::unique_ptr<Client>& client : clients) {
+      Client::Stats stats = client->getStats();
+      eventsReceived += stats.eventsReceived;
+      eventsMissed += stats.eventsMissed;
+
+      client->getMetrics().forEachHistogram([&latency, &resyncTime](const std::string& name, const Histogram& histogram) {
+         if (name == "latency.captureToReceive.us") {
+            latency.merge(histogram);
+         } else if (name == "reconnect.resyncTime.us") {
+            resyncTime.merge(histogram);
+         }
+      });
+   }
+
+   // Latency as far as the first level of the tree
+   Histogram relayLatency;
+   for (const std::unique_ptr<Relay>& relay : relays) {
+      relay->getClient().getMetrics().forEachHistogram([&relayLatency](const std::string& name, const Histogram& histogram) {
+         if (name == "latency.captureToReceive.us") {
+            relayLatency.merge(histogram);
+         }
+      });
+   }
+
+   for (const std::unique_ptr<Client>& client : clients) {
+      client->shutDown();
+   }
+   for (std::thread& thread : clientThreads) {
+      thread.join();
+   }
+
+   // The checks ran on the client threads, which have all finished
+   for (const std::unique_ptr<OrderingCheck>& orderingCheck : orderingChecks) {
+      orderingViolations += orderingCheck->getViolations();
+   }
+   bool ordered = orderingViolations == 0;
+
+   for (const std::unique_ptr<Relay>& relay : relays) {
+      relay->shutDown();
+   }
+   for (std::thread& thread : relayThreads) {
+      thread.join();
+   }
+
+   stopServer();
+   serverSucceeded = serverSucceeded && relaysSucceeded;
+
+   uint64_t eventsGenerated = options.replayPath ? replaySource.getEventsReplayed() : syntheticSource.getEventsGenerated();
+   for (const std::unique_ptr<SyntheticEventSource>& extraSource : extraSources) {
+      eventsGenerated += extraSource->getEventsGenerated();
+   }
+   double cpuMicrosecondsPerEvent = eventsGenerated > 0 ? cpuSeconds * 1000000.0 / eventsGenerated : 0.0;
+   double nanosecondsPerRead = numReads > 0 ? static_cast<double>(readNanoseconds) / numReads : 0.0;
+   double nanosecondsPerMutexRead = numMutexReads > 0 ? static_cast<double>(mutexReadNanoseconds) / numMutexReads : 0.0;
+   double bytesPerEvent = serverStats.eventsSent > 0 ? static_cast<double>(bytesSent) / serverStats.eventsSent : 0.0;
+   long long hopLatency = relays.empty() ? 0 : static_cast<long long>(latency.getPercentile(50.0)) - static_cast<long long>(relayLatency.getPercentile(50.0));
+
+   // CPU time covers the whole process, i.e. the server, all of the clients, and any readers
+   printf("{\"mode\":\"%s\",\"loops\":%d,\"clients\":%d,\"devices\":%d,\"conflate\":%s,\"compact\":%s,\"subscription\":\"%s\",\"pattern\":\"%s\",\"targetRate\":%.0f,\"publishIntervalUs\":%llu,\"seconds\":%.3f,"
+          "\"eventsGenerated\":%llu,\"eventsPublished\":%llu,\"eventsSent\":%llu,\"eventsFiltered\":%llu,\"bytesPerEvent\":%.2f,\"sendCalls\":%llu,\"eventsReceived\":%llu,\"eventsMissed\":%llu,"
+          "\"generatedPerSecond\":%.1f,\"receivedPerSecond\":%.1f,"
+          "\"latencyP50Us\":%llu,\"latencyP99Us\":%llu,\"latencyP999Us\":%llu,\"latencyMaxUs\":%llu,"
+          "\"cpuUsPerEvent\":%.3f,\"getStateReads\":%llu,\"getStateNs\":%.1f,\"mutexGetStateReads\":%llu,\"mutexGetStateNs\":%.1f,"
+          "\"shmClients\":%d,\"shmSpin\":%s,\"shmEventsReceived\":%llu,\"shmEventsMissed\":%llu,\"shmLatencyP50Us\":%llu,\"shmLatencyP99Us\":%llu,\"shmLatencyMaxUs\":%llu,"
+          "\"bounce\":%s,\"resyncs\":%llu,\"resyncP50Us\":%llu,\"resyncMaxUs\":%llu,"
+          "\"relays\":%d,\"relayLatencyP50Us\":%llu,\"relayLatencyP99Us\":%llu,\"hopLatencyP50Us\":%lld,"
+          "\"connectClients\":%d,\"connectTimeouts\":%d,\"connectP50Us\":%llu,\"connectP99Us\":%llu,\"connectMaxUs\":%llu,"
+          "\"orderingChecked\":%s,\"orderingViolations\":%llu,\"serverOk\":%s}\n",
+          options.mode == Server::Mode::kEventLoop ? "event" : "thread", options.numEventLoops, options.numClients, options.numDevices, options.conflate ? "true" : "false", options.compact ? "true" : "false", options.subscriptionName, options.patternName, options.eventsPerSecond, static_cast<unsigned long long>(options.publishIntervalMicroseconds), elapsed,
+          static_cast<unsigned long long>(eventsGenerated), static_cast<unsigned long long>(eventsPublished), static_cast<unsigned long long>(serverStats.eventsSent), static_cast<unsigned long long>(eventsFiltered), bytesPerEvent, static_cast<unsigned long long>(serverStats.sendCalls), static_cast<unsigned long long>(eventsReceived), static_cast<unsigned long long>(eventsMissed),
+          eventsGenerated / elapsed, eventsReceived / elapsed,
+          static_cast<unsigned long long>(latency.getPercentile(50.0)), static_cast<unsigned long long>(latency.getPercentile(99.0)), static_cast<unsigned long long>(latency.getPercentile(99.9)), static_cast<unsigned long long>(latency.getMax()),
+          cpuMicrosecondsPerEvent, static_cast<unsigned long long>(numReads.load()), nanosecondsPerRead, static_cast<unsigned long long>(numMutexReads.load()), nanosecondsPerMutexRead,
+          options.numSharedMemoryClients, options.sharedMemorySpin ? "true" : "false", static_cast<unsigned long long>(sharedMemoryEventsReceived.load()), static_cast<unsigned long long>(sharedMemoryEventsMissed.load()),
+          static_cast<unsigned long long>(sharedMemoryLatency.getPercentile(50.0)), static_cast<unsigned long long>(sharedMemoryLatency.getPercentile(99.0)), static_cast<unsigned long long>(sharedMemoryLatency.getMax()),
+          options.bounce ? "true" : "false", static_cast<unsigned long long>(resyncTime.getCount()), static_cast<unsigned long long>(resyncTime.getPercentile(50.0)), static_cast<unsigned long long>(resyncTime.getMax()),
+          options.numRelays, static_cast<unsigned long long>(relayLatency.getPercentile(50.0)), static_cast<unsigned long long>(relayLatency.getPercentile(99.0)), hopLatency,
+          options.numConnectClients, connectTimeouts, static_cast<unsigned long long>(connectTime.getPercentile(50.0)), static_cast<unsigned long long>(connectTime.getPercentile(99.0)), static_cast<unsigned long long>(connectTime.getMax()),
+          checkOrdering ? "true" : "false", static_cast<unsigned long long>(orderingViolations.load()),
+          serverSucceeded ? "true" : "false");
+
+   return serverSucceeded && ordered ? 0 : 1;
+}
@@ -0,0 +1,214 @@
+#include "KontrollerSock/CompactFrame.h"
+#include "KontrollerSock/Packet.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <vector>
+
+using namespace KontrollerSock;
+
+namespace {
+
+enum class Pattern {
+   kSliderSweep, // Each slider in turn moves a step, sweeping back and forth
+   kButtonMash, // Random buttons are pressed and released
+   kRandom // Random dial and slider values
+};
+
+struct Options {
+   Pattern pattern = Pattern::kSliderSweep;
+   const char* patternName = "sweep";
+   size_t numEvents = 1'000'000;
+   size_t batchSize = 64;
+   int iterations = 10;
+};
+
+void printUsage(const char* program) {
+   printf("Usage: %s [--pattern sweep|mash|random] [--events N] [--batch N] [--iterations N]\n", program);
+   printf("Encodes and decodes events with the compact encoding, and prints the results as a line of JSON\n");
+   printf("Events are encoded in batches of the given size, like the server does with the events it drains at once.\n");
+}
+
+bool parseOptions(int argc, char* argv[], Options& options) {
+   for (int i = 1; i + 1 < argc; i += 2) {
+      const char* arg = argv[i];
+      const char* value = argv[i + 1];
+
+      if (strcmp(arg, "--pattern") == 0) {
+         options.patternName = value;
+         if (strcmp(value, "sweep") == 0) {
+            options.pattern = Pattern::kSliderSweep;
+         } else if (strcmp(value, "mash") == 0) {
+            options.pattern = Pattern::kButtonMash;
+         } else if (strcmp(value, "random") == 0) {
+            options.pattern = Pattern::kRandom;
+         } else {
+            return false;
+         }
+      } else if (strcmp(arg, "--events") == 0) {
+         options.numEvents = strtoull(value, nullptr, 10);
+      } else if (strcmp(arg, "--batch") == 0) {
+         options.batchSize = strtoull(value, nullptr, 10);
+      } else if (strcmp(arg, "--iterations") == 0) {
+         options.iterations = atoi(value);
+      } else {
+         return false;
+      }
+   }
+
+   return argc % 2 == 1 && options.numEvents > 0 && options.batchSize > 0 && options.iterations > 0;
+}
+
+EventPacket makeFloatEvent(EventPacket::Type type, uint16_t id, float value) {
+   EventPacket event;
+   event.type = type;
+   event.id = id;
+   memcpy(&event.value, &value, sizeof(event.value));
+
+   return event;
+}
+
+std::vector<TimedEventPacket> generateEvents(const Options& options) {
+   std::mt19937 random(1);
+   std::vector<TimedEventPacket> packets(options.numEvents);
+   bool buttons[64] = {};
+
+   for (size_t i = 0; i < packets.size(); ++i) {
+      TimedEventPacket& packet = packets[i];
+      packet.header.type = EventPacket::kTimedEvent;
+      packet.header.id = 0;
+      packet.header.value = static_cast<uint32_t>(i);
+      packet.setCaptureTime(1'000'000 + i);
+
+      switch (options.pattern) {
+      case Pattern::kSliderSweep: {
+         // Moves back and forth between 0 and 1 in 127 steps each way, matching the controller's resolution
+         uint64_t position = (i / 8) % 254;
+         float value = (position < 127 ? position : 253 - position) / 127.0f;
+         packet.event = makeFloatEvent(EventPacket::kSlider, static_cast<uint16_t>(static_cast<int>(Kontroller::Slider::kGroup1) + i % 8), value);
+         break;
+      }
+      case Pattern::kButtonMash: {
+         uint16_t id = static_cast<uint16_t>(static_cast<int>(Kontroller::Button::kTrackPrevious) + random() % 35);
+         buttons[id] = !buttons[id];
+         packet.event.type = EventPacket::kButton;
+         packet.event.id = id;
+         packet.event.value = buttons[id] ? 1 : 0;
+         break;
+      }
+      case Pattern::kRandom: {
+         EventPacket::Type type = (random() & 1) != 0 ? EventPacket::kDial : EventPacket::kSlider;
+         packet.event = makeFloatEvent(type, static_cast<uint16_t>(1 + random() % 8), (random() % 128) / 127.0f);
+         break;
+      }
+      }
+   }
+
+   return packets;
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+   Options options;
+   if (!parseOptions(argc, argv, options)) {
+      printUsage(argv[0]);
+      return 1;
+   }
+
+   std::vector<TimedEventPacket> packets = generateEvents(options);
+   std::vector<uint8_t> timedBuffer;
+   std::vector<uint8_t> compactBuffer;
+   timedBuffer.reserve(packets.size() * sizeof(TimedEventPacket));
+   compactBuffer.reserve(packets.size() * (kMaxCompactEventSize + sizeof(CompactFrameHeader)));
+
+   double timedEncodeSeconds = 0.0;
+   double compactEncodeSeconds = 0.0;
+   double decodeSeconds = 0.0;
+   uint64_t numFrames = 0;
+   uint64_t mismatches = 0;
+
+   for (int iteration = 0; iteration < options.iterations; ++iteration) {
+      // What the server sends without the compact encoding, for comparison
+      timedBuffer.clear();
+      std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+      for (const TimedEventPacket& packet : packets) {
+         TimedEventPacket networkPacket = hostToNetwork(packet);
+         const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&networkPacket);
+         timedBuffer.insert(timedBuffer.end(), bytes, bytes + sizeof(networkPacket));
+      }
+      timedEncodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      compactBuffer.clear();
+      CompactEncoder encoder;
+      numFrames = 0;
+      start = std::chrono::steady_clock::now();
+      for (size_t first = 0; first < packets.size(); first += options.batchSize) {
+         size_t count = std::min(options.batchSize, packets.size() - first);
+         numFrames += appendCompactFrames(compactBuffer, packets.data() + first, count, encoder);
+      }
+      compactEncodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      CompactDecoder decoder;
+      std::vector<EventPacket> decoded;
+      decoded.reserve(packets.size());
+      start = std::chrono::steady_clock::now();
+      size_t offset = 0;
+      while (offset + sizeof(CompactFrameHeader) <= compactBuffer.size()) {
+         CompactFrameHeader networkHeader;
+         memcpy(&networkHeader, compactBuffer.data() + offset, sizeof(networkHeader));
+         CompactFrameHeader header = networkToHost(networkHeader);
+         offset += sizeof(networkHeader);
+
+         size_t end = offset + header.header.id;
+         while (offset < end) {
+            EventPacket event;
+            size_t used = decoder.decode(compactBuffer.data() + offset, end - offset, event);
+            if (used == 0) {
+               break;
+            }
+
+            offset += used;
+            decoded.push_back(event);
+         }
+         offset = end;
+      }
+      decodeSeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+      // Values only have to match to within the quantization
+      mismatches = decoded.size() == packets.size() ? 0 : packets.size();
+      for (size_t i = 0; i < decoded.size() && i < packets.size(); ++i) {
+         const EventPacket& expected = packets[i].event;
+         const EventPacket& actual = decoded[i];
+         bool matches = expected.type == actual.type && expected.id == actual.id;
+         if (matches && expected.type == EventPacket::kButton) {
+            matches = (expected.value != 0) == (actual.value != 0);
+         } else if (matches) {
+            float expectedValue = 0.0f;
+            float actualValue = 0.0f;
+            memcpy(&expectedValue, &expected.value, sizeof(expectedValue));
+            memcpy(&actualValue, &actual.value, sizeof(actualValue));
+            matches = CompactValues::quantize(expectedValue) == CompactValues::quantize(actualValue);
+         }
+
+         mismatches += matches ? 0 : 1;
+      }
+   }
+
+   double totalEvents = static_cast<double>(packets.size()) * options.iterations;
+   double timedBytesPerEvent = static_cast<double>(timedBuffer.size()) / packets.size();
+   double compactBytesPerEvent = static_cast<double>(compactBuffer.size()) / packets.size();
+
+   printf("{\"pattern\":\"%s\",\"events\":%llu,\"batch\":%llu,\"frames\":%llu,"
+          "\"timedBytesPerEvent\":%.3f,\"compactBytesPerEvent\":%.3f,\"compression\":%.2f,"
+          "\"timedEncodePerSecond\":%.0f,\"compactEncodePerSecond\":%.0f,\"compactDecodePerSecond\":%.0f,\"mismatches\":%llu}\n",
+          options.patternName, static_cast<unsigned long long>(packets.size()), static_cast<unsigned long long>(options.batchSize), static_cast<unsigned long long>(numFrames),
+          timedBytesPerEvent, compactBytesPerEvent, timedBytesPerEvent / compactBytesPerEvent,
+          totalEvents / timedEncodeSeconds, totalEvents / compactEncodeSeconds, totalEvents / decodeSeconds, static_cast<unsigned long long>(mismatches));
+
+   return mismatches == 0 ? 0 : 1;
+}
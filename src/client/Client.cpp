@@ -1,77 +1,77 @@
 #include "KontrollerSock/Client.h"
+#include "KontrollerSock/Controls.h"
+#include "KontrollerSock/Poller.h"
+#include "KontrollerSock/ReceiveBuffer.h"
+#include "KontrollerSock/Snapshot.h"
 
+#include <algorithm>
+#include <chrono>
 #include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
 
 namespace KontrollerSock {
 
 namespace {
 
-float* getDialVal(Kontroller::State &state, Kontroller::Dial dial) {
-   switch (dial) {
-   case Kontroller::Dial::kGroup1: return &state.groups[0].dial;
-   case Kontroller::Dial::kGroup2: return &state.groups[1].dial;
-   case Kontroller::Dial::kGroup3: return &state.groups[2].dial;
-   case Kontroller::Dial::kGroup4: return &state.groups[3].dial;
-   case Kontroller::Dial::kGroup5: return &state.groups[4].dial;
-   case Kontroller::Dial::kGroup6: return &state.groups[5].dial;
-   case Kontroller::Dial::kGroup7: return &state.groups[6].dial;
-   case Kontroller::Dial::kGroup8: return &state.groups[7].dial;
-   default: return nullptr;
-   }
-}
-
-float* getSliderVal(Kontroller::State &state, Kontroller::Slider slider) {
-   switch (slider) {
-   case Kontroller::Slider::kGroup1: return &state.groups[0].slider;
-   case Kontroller::Slider::kGroup2: return &state.groups[1].slider;
-   case Kontroller::Slider::kGroup3: return &state.groups[2].slider;
-   case Kontroller::Slider::kGroup4: return &state.groups[3].slider;
-   case Kontroller::Slider::kGroup5: return &state.groups[4].slider;
-   case Kontroller::Slider::kGroup6: return &state.groups[5].slider;
-   case Kontroller::Slider::kGroup7: return &state.groups[6].slider;
-   case Kontroller::Slider::kGroup8: return &state.groups[7].slider;
-   default: return nullptr;
-   }
-}
-
-bool* getButtonVal(Kontroller::State &state, Kontroller::Button button) {
-   switch (button) {
-   case Kontroller::Button::kTrackPrevious: return &state.trackPrevious;
-   case Kontroller::Button::kTrackNext: return &state.trackNext;
-   case Kontroller::Button::kCycle: return &state.cycle;
-   case Kontroller::Button::kMarkerSet: return &state.markerSet;
-   case Kontroller::Button::kMarkerPrevious: return &state.markerPrevious;
-   case Kontroller::Button::kMarkerNext: return &state.markerNext;
-   case Kontroller::Button::kRewind: return &state.rewind;
-   case Kontroller::Button::kFastForward: return &state.fastForward;
-   case Kontroller::Button::kStop: return &state.stop;
-   case Kontroller::Button::kPlay: return &state.play;
-   case Kontroller::Button::kRecord: return &state.record;
-   case Kontroller::Button::kGroup1Solo: return &state.groups[0].solo;
-   case Kontroller::Button::kGroup1Mute: return &state.groups[0].mute;
-   case Kontroller::Button::kGroup1Record: return &state.groups[0].record;
-   case Kontroller::Button::kGroup2Solo: return &state.groups[1].solo;
-   case Kontroller::Button::kGroup2Mute: return &state.groups[1].mute;
-   case Kontroller::Button::kGroup2Record: return &state.groups[1].record;
-   case Kontroller::Button::kGroup3Solo: return &state.groups[2].solo;
-   case Kontroller::Button::kGroup3Mute: return &state.groups[2].mute;
-   case Kontroller::Button::kGroup3Record: return &state.groups[2].record;
-   case Kontroller::Button::kGroup4Solo: return &state.groups[3].solo;
-   case Kontroller::Button::kGroup4Mute: return &state.groups[3].mute;
-   case Kontroller::Button::kGroup4Record: return &state.groups[3].record;
-   case Kontroller::Button::kGroup5Solo: return &state.groups[4].solo;
-   case Kontroller::Button::kGroup5Mute: return &state.groups[4].mute;
-   case Kontroller::Button::kGroup5Record: return &state.groups[4].record;
-   case Kontroller::Button::kGroup6Solo: return &state.groups[5].solo;
-   case Kontroller::Button::kGroup6Mute: return &state.groups[5].mute;
-   case Kontroller::Button::kGroup6Record: return &state.groups[5].record;
-   case Kontroller::Button::kGroup7Solo: return &state.groups[6].solo;
-   case Kontroller::Button::kGroup7Mute: return &state.groups[6].mute;
-   case Kontroller::Button::kGroup7Record: return &state.groups[6].record;
-   case Kontroller::Button::kGroup8Solo: return &state.groups[7].solo;
-   case Kontroller::Button::kGroup8Mute: return &state.groups[7].mute;
-   case Kontroller::Button::kGroup8Record: return &state.groups[7].record;
-   default: return nullptr;
+Client::Event makeEvent(uint16_t device, EventPacket::Type type, uint16_t id, bool pressed, float value, int64_t latency, uint64_t captureTime) {
+   Client::Event event;
+   event.type = type;
+   event.id = id;
+   event.pressed = pressed;
+   event.value = value;
+   event.latency = latency;
+   event.captureTime = captureTime;
+   event.device = device;
+   event.numDropped = 0;
+
+   return event;
+}
+
+EventPacket makeLEDPacket(EventPacket::Type type, uint16_t device, uint32_t ledMask) {
+   EventPacket packet;
+   packet.type = type;
+   packet.id = device;
+   packet.value = ledMask;
+
+   return packet;
+}
+
+EventPacket makeSubscriptionPacket(EventPacket::Type controlType, uint16_t word, uint64_t mask) {
+   EventPacket packet;
+   packet.type = EventPacket::kSubscribe;
+   packet.id = static_cast<uint16_t>((word << 8) | controlType);
+   packet.value = static_cast<uint32_t>(mask >> (word * 32));
+
+   return packet;
+}
+
+bool isEverything(const Client::Subscription& subscription) {
+   return subscription.buttons == kAllControls && subscription.dials == kAllControls && subscription.sliders == kAllControls;
+}
+
+// Stands in for events dropped from the event queue's overflow
+Client::Event makeDroppedEvent(uint16_t device, uint64_t numDropped) {
+   Client::Event event = makeEvent(device, EventPacket::kEventsDropped, 0, false, 0.0f, 0, 0);
+   event.numDropped = numDropped;
+
+   return event;
+}
+
+// Slot in Client::overflowSlots for events that replace the one waiting in the overflow list, -1 for button edges
+int getOverflowSlot(const Client::Event& event) {
+   switch (event.type) {
+   case EventPacket::kDial:
+      return kDialIndex.find(event.id);
+   case EventPacket::kSlider: {
+      int index = kSliderIndex.find(event.id);
+      return index >= 0 ? static_cast<int>(kNumGroups) + index : -1;
+   }
+   case EventPacket::kEventsDropped:
+      return static_cast<int>(kNumGroups * 2);
+   default:
+      return -1;
    }
 }
 
@@ -81,68 +81,232 @@ enum class ReceiveResult {
    kTimeout
 };
 
-bool receiveData(Sock::Socket socket, uint8_t* data, size_t size) {
-   size_t bytesRead = 0;
+// Poller tokens
+const uint64_t kStreamToken = 0;
+const uint64_t kDatagramToken = 1;
+
+using ClientReceiveBuffer = ReceiveBuffer<16 * 1024>;
+
+bool sendData(Sock::Socket socket, const uint8_t* data, size_t size) {
+   size_t bytesWritten = 0;
 
-   while (bytesRead < size) {
-      ssize_t result = Sock::recv(socket, data + bytesRead, size - bytesRead, 0);
-      if (result <= 0) {
-         // Connection lost
-         printf("recv failed with error: %d\n", Sock::System::getLastError());
-         return false;
+   while (bytesWritten < size) {
+      ssize_t result = Sock::send(socket, data + bytesWritten, size - bytesWritten, Sock::kNoSignal);
+      if (result == Sock::kSocketError) {
+         int error = Sock::System::getLastError();
+         if (error != Sock::kWouldBlock) {
+            printf("send failed with error: %d\n", error);
+            return false;
+         }
+
+         // Wait (with timeout) until there is room in the send buffer
+         Sock::PollDescriptor descriptor = {};
+         descriptor.fd = socket;
+         descriptor.events = POLLOUT;
+         if (Sock::poll(&descriptor, 1, 100) < 0) { // 100ms
+            return false;
+         }
+         continue;
       }
 
-      bytesRead += result;
+      bytesWritten += result;
    }
 
    return true;
 }
 
-ReceiveResult receivePacket(Sock::Socket socket, EventPacket& packet) {
-   // Wait (with timeout) until there is data available
-   fd_set fds;
-   FD_ZERO(&fds);
-   FD_SET(socket, &fds);
-   timeval timeout = { 0, 100'000 }; // 100ms
-   int selectResult = Sock::select(socket + 1, &fds, nullptr, nullptr, &timeout);
-   if (selectResult < 0) {
+bool sendPacket(Sock::Socket socket, EventPacket packet) {
+   EventPacket networkPacket = hostToNetwork(packet);
+   return sendData(socket, reinterpret_cast<const uint8_t*>(&networkPacket), sizeof(networkPacket));
+}
+
+// Waits (with timeout) for a non-blocking connect to complete
+// Sockets are polled rather than selected, since a process running many clients can have sockets numbered past FD_SETSIZE
+bool waitForConnection(Sock::Socket socket, std::chrono::milliseconds wait) {
+   Sock::PollDescriptor descriptor = {};
+   descriptor.fd = socket;
+   descriptor.events = POLLOUT;
+   int pollResult = Sock::poll(&descriptor, 1, static_cast<int>(wait.count()));
+   if (pollResult <= 0 || (descriptor.revents & (POLLERR | POLLHUP))) {
+      return false;
+   }
+
+   int error = 0;
+   socklen_t errorLen = sizeof(error);
+   int optResult = Sock::getsockopt(socket, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+   return optResult != Sock::kSocketError && error == 0;
+}
+
+// Splits "host:port" (or just "host", for the default port) into its parts
+void parseEndpoint(const char* endpoint, std::string& host, std::string& port) {
+   host = endpoint;
+   port = kPort;
+
+   size_t separator = host.rfind(':');
+   if (separator != std::string::npos && host.find(':') == separator) {
+      port = host.substr(separator + 1);
+      host.resize(separator);
+   }
+}
+
+// Decodes every complete message in the buffer, leaving any partial message buffered
+template<typename EventFunction, typename TimedEventFunction, typename CompactFrameFunction, typename SnapshotFunction>
+void decodeMessages(ClientReceiveBuffer& buffer, EventFunction onEvent, TimedEventFunction onTimedEvent, CompactFrameFunction onCompactFrame, SnapshotFunction onSnapshot) {
+   while (buffer.readSize() >= sizeof(EventPacket)) {
+      EventPacket networkHeader;
+      memcpy(&networkHeader, buffer.readPointer(), sizeof(networkHeader));
+      EventPacket header = networkToHost(networkHeader);
+
+      if (header.type == EventPacket::kSnapshot) {
+         if (buffer.readSize() < sizeof(SnapshotPacket)) {
+            break;
+         }
+
+         SnapshotPacket snapshotPacket;
+         memcpy(&snapshotPacket, buffer.readPointer(), sizeof(snapshotPacket));
+         buffer.consume(sizeof(snapshotPacket));
+
+         onSnapshot(snapshotPacket);
+      } else if (header.type == EventPacket::kTimedEvent) {
+         if (buffer.readSize() < sizeof(TimedEventPacket)) {
+            break;
+         }
+
+         TimedEventPacket networkPacket;
+         memcpy(&networkPacket, buffer.readPointer(), sizeof(networkPacket));
+         buffer.consume(sizeof(networkPacket));
+
+         onTimedEvent(networkToHost(networkPacket));
+      } else if (header.type == EventPacket::kCompactFrame) {
+         if (buffer.readSize() < sizeof(CompactFrameHeader) + header.id) {
+            break;
+         }
+
+         CompactFrameHeader networkFrameHeader;
+         memcpy(&networkFrameHeader, buffer.readPointer(), sizeof(networkFrameHeader));
+         onCompactFrame(networkToHost(networkFrameHeader), buffer.readPointer() + sizeof(networkFrameHeader), header.id);
+         buffer.consume(sizeof(networkFrameHeader) + header.id);
+      } else {
+         buffer.consume(sizeof(networkHeader));
+
+         onEvent(header);
+      }
+   }
+
+   buffer.compact();
+}
+
+// Creates a non-blocking socket bound to the datagram port, joined to the multicast group (if there is one)
+SocketHandle createDatagramSocket(const char* multicastGroup) {
+   SocketHandle datagramSocket;
+
+   datagramSocket.data = Sock::socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP);
+   if (datagramSocket.data == Sock::kInvalidSocket) {
+      printf("socket failed with error: %d\n", Sock::System::getLastError());
+      return {};
+   }
+
+   // Lets several clients on the same host receive the same multicast group
+   int reuseAddress = 1;
+   int optResult = Sock::setsockopt(datagramSocket.data, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+   if (optResult == Sock::kSocketError) {
+      printf("Unable to share the datagram port, error: %d\n", Sock::System::getLastError());
+   }
+
+   sockaddr_in address = {};
+   address.sin_family = AF_INET;
+   address.sin_addr.s_addr = Sock::Endian::hostToNetworkLong(INADDR_ANY);
+   address.sin_port = Sock::Endian::hostToNetworkShort(static_cast<uint16_t>(atoi(kDatagramPort)));
+   int bindResult = Sock::bind(datagramSocket.data, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+   if (bindResult == Sock::kSocketError) {
+      printf("bind failed with error: %d\n", Sock::System::getLastError());
+      return {};
+   }
+
+   if (multicastGroup) {
+      ip_mreq membership = {};
+      membership.imr_interface.s_addr = Sock::Endian::hostToNetworkLong(INADDR_ANY);
+      if (inet_pton(AF_INET, multicastGroup, &membership.imr_multiaddr) != 1) {
+         printf("Invalid multicast group: %s\n", multicastGroup);
+         return {};
+      }
+
+      optResult = Sock::setsockopt(datagramSocket.data, IPPROTO_IP, IP_ADD_MEMBERSHIP, &membership, sizeof(membership));
+      if (optResult == Sock::kSocketError) {
+         printf("Unable to join multicast group, error: %d\n", Sock::System::getLastError());
+         return {};
+      }
+   }
+
+   unsigned long nonBlocking = 1;
+   int ioctlResult = Sock::ioctl(datagramSocket.data, FIONBIO, &nonBlocking);
+   if (ioctlResult == Sock::kSocketError) {
+      printf("ioctl failed with error: %d\n", Sock::System::getLastError());
+      return {};
+   }
+
+   return datagramSocket;
+}
+
+// Waits (with timeout, or until woken up) for data on either socket, and reads as much as is available on the stream socket
+ReceiveResult receive(Poller& poller, std::vector<Poller::Event>& events, Sock::Socket socket, ClientReceiveBuffer& buffer, bool& datagramsPending) {
+   datagramsPending = false;
+
+   if (!poller.wait(events, 100)) { // 100ms
       return ReceiveResult::kError;
-   } else if (selectResult == 0) {
-      return ReceiveResult::kTimeout;
    }
 
-   // Make sure there is at least one full packet's worth of data available
-   EventPacket dummyPacket;
-   ssize_t bytesReady = Sock::recv(socket, &dummyPacket, sizeof(dummyPacket), MSG_PEEK);
-   if (bytesReady < 0) {
-      int error = Sock::System::getLastError();
-      if (error != Sock::kWouldBlock) {
-         return ReceiveResult::kError;
+   bool streamPending = false;
+   for (const Poller::Event& event : events) {
+      if (event.token == kDatagramToken) {
+         datagramsPending = true;
+      } else {
+         streamPending = true;
       }
    }
-   if (bytesReady != sizeof(EventPacket)) {
-      return ReceiveResult::kTimeout;
+   if (!streamPending) {
+      return datagramsPending ? ReceiveResult::kSuccess : ReceiveResult::kTimeout;
    }
 
-   // Read the data
-   EventPacket networkPacket;
-   if (!receiveData(socket, reinterpret_cast<uint8_t*>(&networkPacket), sizeof(networkPacket))) {
+   // Read as much as is available
+   ssize_t result = Sock::recv(socket, buffer.writePointer(), buffer.writeCapacity(), 0);
+   if (result == 0) {
+      // Connection closed
       return ReceiveResult::kError;
+   } else if (result < 0) {
+      int error = Sock::System::getLastError();
+      if (error != Sock::kWouldBlock) {
+         printf("recv failed with error: %d\n", error);
+         return ReceiveResult::kError;
+      }
+
+      return datagramsPending ? ReceiveResult::kSuccess : ReceiveResult::kTimeout;
    }
 
-   // Translate from network byte order to host byte order
-   packet.type = Sock::Endian::networkToHostShort(networkPacket.type);
-   packet.id = Sock::Endian::networkToHostShort(networkPacket.id);
-   packet.value = Sock::Endian::networkToHostLong(networkPacket.value);
+   buffer.commitWrite(static_cast<size_t>(result));
    return ReceiveResult::kSuccess;
 }
 
 } // namespace
 
-Client::Client() : shuttingDown(false), state{} {
+Client::Client() : Client(Config{}) {
+}
+
+Client::Client(const Config& clientConfig)
+   : config(clientConfig), shuttingDown(false), poller(nullptr), snapshotRequests(0), currentDevice(0), ledsPending(false), subscription(clientConfig.subscription), subscriptionPending(false), filtering(false), eventsReceived(metrics.counter("events.received")), eventsMissed(metrics.counter("events.missed")), eventsDropped(metrics.counter("queue.eventsDropped")), bytesReceived(metrics.counter("bytes.received")), datagramsReceived(metrics.counter("datagrams.received")), connectionsLost(metrics.counter("connections.lost")), lastLatency(metrics.gauge("latency.last.us")), eventLatency(metrics.histogram("latency.captureToReceive.us")), applyTime(metrics.histogram("batch.applyTime.ns")), resyncTime(metrics.histogram("reconnect.resyncTime.us")), connectTime(metrics.histogram("connect.timeToState.us")), overflowStart(0), overflowSlots{} {
+   if (config.eventQueueCapacity > 0) {
+      eventQueue.reset(new SpscQueue<Event>(config.eventQueueCapacity));
+   }
 }
 
 void Client::run(const char* endpoint) {
+   run(std::vector<const char*> { endpoint });
+}
+
+void Client::run(const std::vector<const char*>& endpoints) {
+   std::chrono::steady_clock::time_point runStartTime = std::chrono::steady_clock::now();
+   bool stateReceived = false;
+
    // Initialize the socket system
    int initializeResult = Sock::System::initialize();
    SocketSystemHandle socketSystemHandle(initializeResult);
@@ -151,99 +315,837 @@ void Client::run(const char* endpoint) {
       return;
    }
 
+   SocketHandle datagramSocket;
+   if (config.datagrams) {
+      datagramSocket = createDatagramSocket(config.multicastGroup);
+      if (!datagramSocket) {
+         printf("Unable to receive datagrams, falling back to TCP\n");
+      }
+   }
+
+   // Data from the server is waited for with a poller, so that other threads can wake the network thread up when there
+   // is something to send (e.g. LEDs or a snapshot request)
+   Poller networkPoller;
+   if (!networkPoller || (datagramSocket && !networkPoller.add(datagramSocket.data, Poller::kReadable, kDatagramToken))) {
+      printf("Unable to create network poller\n");
+      return;
+   }
+
+   struct PollerGuard {
+      Client& client;
+
+      ~PollerGuard() {
+         std::lock_guard<std::mutex> lock(client.pollerMutex);
+         client.poller = nullptr;
+      }
+   } pollerGuard { *this };
+   {
+      std::lock_guard<std::mutex> lock(pollerMutex);
+      poller = &networkPoller;
+   }
+   std::vector<Poller::Event> pollerEvents;
+
+   std::vector<Endpoint> resolvedEndpoints(endpoints.size());
+   for (size_t i = 0; i < endpoints.size(); ++i) {
+      parseEndpoint(endpoints[i], resolvedEndpoints[i].host, resolvedEndpoints[i].port);
+   }
+
+   std::minstd_rand random(std::random_device{}());
+   int numFailures = 0; // Consecutive attempts that didn't get as far as receiving anything
+   bool resyncing = false;
+   std::chrono::steady_clock::time_point disconnectTime;
+
    while (!shuttingDown) {
-      SocketHandle clientSocket = connect(endpoint);
+      SocketHandle clientSocket;
+      for (Endpoint& endpoint : resolvedEndpoints) {
+         clientSocket = connect(endpoint);
+         if (clientSocket || shuttingDown) {
+            break;
+         }
+      }
+
       if (!clientSocket) {
-         std::this_thread::sleep_for(std::chrono::milliseconds(500));
+         waitToReconnect(numFailures++, random);
+         continue;
+      }
+
+      // Introduce ourselves as soon as the connection is established, the server waits for this before sending the state
+      EventPacket hello;
+      hello.type = EventPacket::kHello;
+      hello.id = kProtocolVersion;
+      hello.value = 0;
+      if (config.conflate) {
+         hello.value |= kHelloConflate;
+      }
+      if (datagramSocket) {
+         hello.value |= kHelloDatagrams;
+      }
+      if (config.compact) {
+         hello.value |= kHelloCompact;
+      }
+
+      EventPacket networkIntroduction[2 + kNumControlTypes * 2];
+      size_t introductionSize = 0;
+      networkIntroduction[introductionSize++] = hostToNetwork(hello);
+
+      if (config.devices != 1) {
+         EventPacket selectDevices;
+         selectDevices.type = EventPacket::kSelectDevices;
+         selectDevices.id = 0;
+         selectDevices.value = config.devices;
+         networkIntroduction[introductionSize++] = hostToNetwork(selectDevices);
+      }
+
+      // Sent along with the hello (in a single write), so that the server has it before it sends anything, and never
+      // has to send the events we don't want
+      subscriptionPending = false;
+      filtering = false;
+      introductionSize += makeSubscriptionPackets(networkIntroduction + introductionSize);
+
+      if (!sendData(clientSocket.data, reinterpret_cast<const uint8_t*>(networkIntroduction), introductionSize * sizeof(EventPacket))) {
+         waitToReconnect(numFailures++, random);
+         continue;
+      }
+
+      ClientReceiveBuffer receiveBuffer;
+      snapshotRequests = 0;
+
+      // The server may have lost track of our LEDs (e.g. it has restarted), so send them all again
+      {
+         std::lock_guard<std::mutex> lock(ledMutex);
+         for (LEDState& ledState : leds) {
+            ledState.pending = ledState.set;
+         }
+      }
+      ledsPending = true;
+
+      // The server sends the state of every device as soon as it gets our hello
+      for (DeviceState& device : devices) {
+         device.streamSequenceKnown = false;
+      }
+      currentDevice = 0;
+      datagramStream = DatagramStream();
+      datagramStream.awaitingState = true;
+      std::vector<uint8_t> datagramBuffer(kMaxDatagramSize);
+
+      if (!networkPoller.add(clientSocket.data, Poller::kReadable, kStreamToken)) {
+         printf("Unable to watch socket, error: %d\n", Sock::System::getLastError());
+         waitToReconnect(numFailures++, random);
          continue;
       }
 
       while (!shuttingDown) {
-         EventPacket packet;
-         ReceiveResult result = receivePacket(clientSocket.data, packet);
+         uint32_t requestedDevices = snapshotRequests.exchange(0);
+         bool requestsSent = true;
+         for (uint16_t device = 0; device < kMaxDevices && requestsSent; ++device) {
+            if (requestedDevices & (1u << device)) {
+               EventPacket request;
+               request.type = EventPacket::kSnapshotRequest;
+               request.id = device;
+               request.value = 0;
+
+               requestsSent = sendPacket(clientSocket.data, request);
+            }
+         }
+         if (!requestsSent) {
+            break;
+         }
+
+         if (ledsPending.exchange(false) && !sendLEDs(clientSocket.data)) {
+            break;
+         }
+
+         if (subscriptionPending.exchange(false) && !sendSubscription(clientSocket.data)) {
+            break;
+         }
+
+         bool datagramsPending = false;
+         size_t previousReadSize = receiveBuffer.readSize();
+         ReceiveResult result = receive(networkPoller, pollerEvents, clientSocket.data, receiveBuffer, datagramsPending);
 
          if (result == ReceiveResult::kSuccess) {
-            updateState(packet);
+            std::chrono::steady_clock::time_point applyStart = std::chrono::steady_clock::now();
+            bytesReceived.add(receiveBuffer.readSize() - previousReadSize);
+
+            // The server starts with the state, so we're back in sync from here on
+            numFailures = 0;
+            if (resyncing) {
+               resyncTime.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(applyStart - disconnectTime).count()));
+               resyncing = false;
+            }
+
+            bool stateApplied = false;
+            decodeMessages(receiveBuffer, [this](const EventPacket& packet) {
+               if (packet.type == EventPacket::kSyncSequence) {
+                  syncDatagrams(packet.value);
+               } else if (packet.type == EventPacket::kDevice) {
+                  selectDevice(packet.id);
+               } else {
+                  applyEvent(currentDevice, packet, 0);
+               }
+            }, [this](const TimedEventPacket& timedPacket) {
+               applyTimedEvent(timedPacket);
+            }, [this](const CompactFrameHeader& header, const uint8_t* payload, size_t size) {
+               applyCompactFrame(header, payload, size);
+            }, [this, &stateApplied](const SnapshotPacket& snapshotPacket) {
+               applySnapshot(snapshotPacket);
+               stateApplied = true;
+            });
+
+            // Drain every datagram that has arrived
+            while (datagramsPending) {
+               ssize_t size = Sock::recvfrom(datagramSocket.data, datagramBuffer.data(), datagramBuffer.size(), 0, nullptr, nullptr);
+               if (size < 0) {
+                  break;
+               }
+
+               if (config.datagramLossRate > 0.0 && std::uniform_real_distribution<double>(0.0, 1.0)(random) < config.datagramLossRate) {
+                  continue;
+               }
+
+               datagramsReceived.add();
+               bytesReceived.add(static_cast<uint64_t>(size));
+               applyDatagram(datagramBuffer.data(), static_cast<size_t>(size));
+            }
+
+            // Publish the whole batch at once
+            for (DeviceState& device : devices) {
+               if (device.changed) {
+                  device.publishedState.store(device.state);
+                  device.changed = false;
+               }
+            }
+            if (stateApplied && !stateReceived) {
+               connectTime.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - runStartTime).count()));
+               stateReceived = true;
+            }
+            applyTime.record(static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - applyStart).count()));
          } else if (result == ReceiveResult::kError) {
             break;
          }
+
+         // Also retries events that didn't fit in the queue last time
+         deliverEvents();
+      }
+      networkPoller.remove(clientSocket.data);
+
+      if (!shuttingDown) {
+         if (!resyncing) {
+            connectionsLost.add();
+            disconnectTime = std::chrono::steady_clock::now();
+            resyncing = true;
+         }
+
+         waitToReconnect(numFailures++, random);
       }
    }
 }
 
-KontrollerSock::SocketHandle Client::connect(const char* endpoint) {
+KontrollerSock::SocketHandle Client::connect(Endpoint& endpoint) {
+   if (endpoint.addresses.empty() || std::chrono::steady_clock::now() - endpoint.resolveTime >= config.addressLifetime) {
+      resolve(endpoint);
+   }
+
+   for (const sockaddr_in& address : endpoint.addresses) {
+      SocketHandle clientSocket = connect(address);
+      if (clientSocket || shuttingDown) {
+         return clientSocket;
+      }
+   }
+
+   return {};
+}
+
+KontrollerSock::SocketHandle Client::connect(const sockaddr_in& address) {
    SocketHandle clientSocket;
 
-   // Create / connect the socket
-   {
-      AddrInfoHandle addrInfo;
-
-      addrinfo hints = {};
-      hints.ai_family = AF_INET;
-      hints.ai_socktype = SOCK_STREAM;
-      hints.ai_protocol = IPPROTO_TCP;
-      hints.ai_flags = AI_PASSIVE;
-      int addrInfoResult = Sock::getaddrinfo(endpoint, kPort, &hints, &addrInfo.data);
-      if (addrInfoResult != 0) {
-         printf("getaddrinfo failed with error: %d\n", addrInfoResult);
+   clientSocket.data = Sock::socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+   if (clientSocket.data == Sock::kInvalidSocket) {
+      printf("socket failed with error: %d\n", Sock::System::getLastError());
+      return {};
+   }
+
+   unsigned long nonBlocking = 1;
+   int ioctrlResult = Sock::ioctl(clientSocket.data, FIONBIO, &nonBlocking);
+   if (ioctrlResult == Sock::kSocketError) {
+      printf("ioctl failed with error: %d\n", Sock::System::getLastError());
+      return {};
+   }
+
+   // Requests are small and few, and shouldn't wait for the server to acknowledge the previous ones
+   int tcpNoDelay = 1;
+   int optResult = Sock::setsockopt(clientSocket.data, IPPROTO_TCP, TCP_NODELAY, &tcpNoDelay, sizeof(tcpNoDelay));
+   if (optResult == Sock::kSocketError) {
+      printf("Unable to disable the Nagle algorithm, requests may be delayed\n");
+   }
+
+   int connectResult = Sock::connect(clientSocket.data, reinterpret_cast<const sockaddr*>(&address), sizeof(address));
+   if (connectResult == Sock::kSocketError) {
+      int error = Sock::System::getLastError();
+      if (error != Sock::kNoError && error != Sock::kWouldBlock && error != Sock::kInProgress) {
+         printf("connect failed with error: %d\n", Sock::System::getLastError());
          return {};
       }
+   }
 
-      clientSocket.data = Sock::socket(addrInfo.data->ai_family, addrInfo.data->ai_socktype, addrInfo.data->ai_protocol);
-      if (clientSocket.data == Sock::kInvalidSocket) {
-         printf("socket failed with error: %d\n", Sock::System::getLastError());
-         return {};
+   // A refused connection fails right away, only unreachable hosts take the whole timeout
+   if (!waitForConnection(clientSocket.data, config.connectTimeout)) {
+      return {};
+   }
+
+   return clientSocket;
+}
+
+void Client::resolve(Endpoint& endpoint) {
+   // Even a failed lookup counts, so that the cached addresses keep being used through a DNS outage without asking again every time
+   endpoint.resolveTime = std::chrono::steady_clock::now();
+
+   AddrInfoHandle addrInfo;
+
+   addrinfo hints = {};
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_protocol = IPPROTO_TCP;
+   int addrInfoResult = Sock::getaddrinfo(endpoint.host.c_str(), endpoint.port.c_str(), &hints, &addrInfo.data);
+   if (addrInfoResult != 0) {
+      printf("getaddrinfo failed with error: %d\n", addrInfoResult);
+      return;
+   }
+
+   endpoint.addresses.clear();
+   for (const addrinfo* info = addrInfo.data; info; info = info->ai_next) {
+      if (info->ai_family == AF_INET && info->ai_addrlen == sizeof(sockaddr_in)) {
+         sockaddr_in address;
+         memcpy(&address, info->ai_addr, sizeof(address));
+         endpoint.addresses.push_back(address);
       }
+   }
+}
 
-      unsigned long nonBlocking = 1;
-      int ioctrlResult = Sock::ioctl(clientSocket.data, FIONBIO, &nonBlocking);
-      if (ioctrlResult == Sock::kSocketError) {
-         printf("ioctl failed with error: %d\n", Sock::System::getLastError());
-         return {};
+void Client::waitToReconnect(int numFailures, std::minstd_rand& random) {
+   std::chrono::milliseconds delay = config.minReconnectDelay;
+   for (int i = 0; i < numFailures && delay < config.maxReconnectDelay; ++i) {
+      delay *= 2;
+   }
+   delay = std::min(delay, config.maxReconnectDelay);
+
+   // Shortened by up to half
+   std::chrono::microseconds jitter(0);
+   if (delay.count() > 0) {
+      jitter = std::chrono::microseconds(random() % (std::chrono::duration_cast<std::chrono::microseconds>(delay).count() / 2 + 1));
+   }
+   std::chrono::steady_clock::time_point reconnectTime = std::chrono::steady_clock::now() + delay - jitter;
+
+   // In short steps, so that shutting down isn't held up
+   while (!shuttingDown && std::chrono::steady_clock::now() < reconnectTime) {
+      std::this_thread::sleep_for(std::min<std::chrono::steady_clock::duration>(reconnectTime - std::chrono::steady_clock::now(), std::chrono::milliseconds(100)));
+   }
+}
+
+void Client::wake() {
+   std::lock_guard<std::mutex> lock(pollerMutex);
+   if (poller) {
+      poller->wake();
+   }
+}
+
+void Client::setLED(Kontroller::LED led, bool on, uint16_t device) {
+   if (device >= kMaxDevices || (getLEDMask(led) & kAllLEDs) == 0) {
+      return;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(ledMutex);
+      LEDState& ledState = leds[device];
+      if (on) {
+         ledState.lit |= getLEDMask(led);
+      } else {
+         ledState.lit &= ~getLEDMask(led);
       }
+      ledState.set |= getLEDMask(led);
+      ledState.pending |= getLEDMask(led);
+   }
 
-      int connectResult = Sock::connect(clientSocket.data, addrInfo.data->ai_addr, static_cast<socklen_t>(addrInfo.data->ai_addrlen));
-      if (connectResult == Sock::kSocketError) {
-         int error = Sock::System::getLastError();
-         if (error != Sock::kNoError && error != Sock::kWouldBlock && error != Sock::kInProgress) {
-            printf("connect failed with error: %d\n", Sock::System::getLastError());
-            return {};
+   // The network thread only needs waking up once for a burst of commands, it sends everything pending when it does
+   if (!ledsPending.exchange(true)) {
+      wake();
+   }
+}
+
+bool Client::sendLEDs(Sock::Socket socket) {
+   // Every device's changes go out in a single write, at most one packet each for the LEDs turned on and off
+   EventPacket networkPackets[kMaxDevices * 2];
+   size_t numPackets = 0;
+   {
+      std::lock_guard<std::mutex> lock(ledMutex);
+      for (uint16_t device = 0; device < kMaxDevices; ++device) {
+         LEDState& ledState = leds[device];
+         uint32_t on = ledState.pending & ledState.lit;
+         uint32_t off = ledState.pending & ~ledState.lit;
+         ledState.pending = 0;
+
+         if (on != 0) {
+            networkPackets[numPackets++] = hostToNetwork(makeLEDPacket(EventPacket::kSetLEDs, device, on));
+         }
+         if (off != 0) {
+            networkPackets[numPackets++] = hostToNetwork(makeLEDPacket(EventPacket::kClearLEDs, device, off));
          }
       }
    }
 
-   return clientSocket;
+   return numPackets == 0 || sendData(socket, reinterpret_cast<const uint8_t*>(networkPackets), numPackets * sizeof(EventPacket));
 }
 
-void Client::updateState(const EventPacket& packet) {
-   bool boolValue = packet.value != 0;
-   float floatValue = 0.0f;
-   static_assert(sizeof(packet.value) == sizeof(floatValue), "Packet data size does not match event data size");
-   memcpy(&floatValue, &packet.value, sizeof(floatValue));
+void Client::subscribe(const Subscription& newSubscription) {
+   {
+      std::lock_guard<std::mutex> lock(subscriptionMutex);
+      subscription = newSubscription;
+   }
+   subscriptionPending = true;
+   wake();
+}
 
-   switch (packet.type) {
-   case EventPacket::kButton:
-      if (bool* buttonValue = getButtonVal(state, static_cast<Kontroller::Button>(packet.id)))
-      {
-         std::lock_guard<std::mutex> lock(mutex);
-         *buttonValue = boolValue;
+size_t Client::makeSubscriptionPackets(EventPacket* networkPackets) {
+   Subscription currentSubscription;
+   {
+      std::lock_guard<std::mutex> lock(subscriptionMutex);
+      currentSubscription = subscription;
+   }
+
+   // The server starts out sending everything, so there is nothing to send until the subscription narrows that down
+   if (!filtering && isEverything(currentSubscription)) {
+      return 0;
+   }
+   filtering = !isEverything(currentSubscription);
+
+   // Each mask takes two packets
+   const uint64_t masks[kNumControlTypes] = { currentSubscription.buttons, currentSubscription.dials, currentSubscription.sliders };
+   size_t numPackets = 0;
+   for (size_t type = 0; type < kNumControlTypes; ++type) {
+      for (uint16_t word = 0; word < 2; ++word) {
+         EventPacket::Type controlType = static_cast<EventPacket::Type>(EventPacket::kButton + type);
+         networkPackets[numPackets++] = hostToNetwork(makeSubscriptionPacket(controlType, word, masks[type]));
       }
-      break;
-   case EventPacket::kDial:
-      if (float* dialValue = getDialVal(state, static_cast<Kontroller::Dial>(packet.id)))
-      {
-         std::lock_guard<std::mutex> lock(mutex);
-         *dialValue = floatValue;
+   }
+
+   return numPackets;
+}
+
+bool Client::sendSubscription(Sock::Socket socket) {
+   // All of it goes out in a single write
+   EventPacket networkPackets[kNumControlTypes * 2];
+   size_t numPackets = makeSubscriptionPackets(networkPackets);
+
+   return numPackets == 0 || sendData(socket, reinterpret_cast<const uint8_t*>(networkPackets), numPackets * sizeof(EventPacket));
+}
+
+Kontroller::State Client::getState(uint16_t device) const {
+   return device < kMaxDevices ? devices[device].publishedState.load() : Kontroller::State{};
+}
+
+bool Client::getButton(Kontroller::Button button, uint16_t device) const {
+   if (device >= kMaxDevices) {
+      return false;
+   }
+
+   return devices[device].publishedState.read([button](const Kontroller::State& currentState) {
+      const bool* value = getButtonValue(currentState, static_cast<uint16_t>(button));
+      return value ? *value : false;
+   });
+}
+
+float Client::getDial(Kontroller::Dial dial, uint16_t device) const {
+   if (device >= kMaxDevices) {
+      return 0.0f;
+   }
+
+   return devices[device].publishedState.read([dial](const Kontroller::State& currentState) {
+      const float* value = getDialValue(currentState, static_cast<uint16_t>(dial));
+      return value ? *value : 0.0f;
+   });
+}
+
+float Client::getSlider(Kontroller::Slider slider, uint16_t device) const {
+   if (device >= kMaxDevices) {
+      return 0.0f;
+   }
+
+   return devices[device].publishedState.read([slider](const Kontroller::State& currentState) {
+      const float* value = getSliderValue(currentState, static_cast<uint16_t>(slider));
+      return value ? *value : 0.0f;
+   });
+}
+
+void Client::setButtonCallback(ButtonCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   buttonCallback = std::move(callback);
+}
+
+void Client::setDialCallback(DialCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   dialCallback = std::move(callback);
+}
+
+void Client::setSliderCallback(SliderCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   sliderCallback = std::move(callback);
+}
+
+void Client::setBatchCallback(BatchCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   batchCallback = std::move(callback);
+}
+
+size_t Client::pollEvents(Event* events, size_t maxEvents) {
+   return eventQueue ? eventQueue->pop(events, maxEvents) : 0;
+}
+
+Client::Stats Client::getStats() const {
+   Stats stats;
+   stats.eventsReceived = eventsReceived.get();
+   stats.eventsMissed = eventsMissed.get();
+   stats.eventsDropped = eventsDropped.get();
+   stats.latencySamples = eventLatency.getCount();
+   stats.lastLatency = lastLatency.get();
+   stats.maxLatency = static_cast<int64_t>(eventLatency.getMax());
+   stats.totalLatency = static_cast<int64_t>(eventLatency.getSum());
+
+   return stats;
+}
+
+void Client::applyEvent(uint16_t device, const EventPacket& packet, uint64_t captureTime) {
+   eventsReceived.add();
+   int64_t latency = captureTime != 0 ? recordLatency(captureTime) : 0;
+
+   DeviceState& deviceState = devices[device];
+   if (!applyControlEvent(deviceState.state, packet)) {
+      return;
+   }
+   deviceState.changed = true;
+
+   EventPacket::Type type = static_cast<EventPacket::Type>(packet.type);
+   bool pressed = type == EventPacket::kButton && packet.value != 0;
+   float value = 0.0f;
+   if (type != EventPacket::kButton) {
+      static_assert(sizeof(packet.value) == sizeof(value), "Packet data size does not match event data size");
+      memcpy(&value, &packet.value, sizeof(value));
+   }
+
+   batchEvents.push_back(makeEvent(device, type, packet.id, pressed, value, latency, captureTime));
+   batchPackets.push_back(packet);
+}
+
+void Client::applyTimedEvent(const TimedEventPacket& packet) {
+   advanceStreamSequence(packet.header.value, 1);
+   applyEvent(currentDevice, packet.event, packet.getCaptureTime());
+}
+
+void Client::applyCompactFrame(const CompactFrameHeader& header, const uint8_t* payload, size_t size) {
+   // Every event in the frame gets the capture time of the first one, so latencies are an upper bound
+   uint64_t captureTime = header.getCaptureTime();
+   uint32_t numEvents = 0;
+
+   size_t offset = 0;
+   while (offset < size) {
+      EventPacket packet;
+      size_t used = devices[currentDevice].compactDecoder.decode(payload + offset, size - offset, packet);
+      if (used == 0) {
+         // The rest of the frame can't be trusted, and neither can the values that later frames are relative to
+         printf("Malformed compact frame, requesting state\n");
+         requestSnapshot(currentDevice);
+         break;
       }
-      break;
-   case EventPacket::kSlider:
-      if (float* sliderValue = getSliderVal(state, static_cast<Kontroller::Slider>(packet.id)))
-      {
-         std::lock_guard<std::mutex> lock(mutex);
-         *sliderValue = floatValue;
+      offset += used;
+
+      applyEvent(currentDevice, packet, captureTime);
+      ++numEvents;
+   }
+
+   advanceStreamSequence(header.header.value, numEvents);
+}
+
+void Client::advanceStreamSequence(uint32_t sequence, uint32_t numEvents) {
+   DeviceState& deviceState = devices[currentDevice];
+   if (deviceState.streamSequenceKnown && sequence != deviceState.nextStreamSequence) {
+      int32_t offset = static_cast<int32_t>(sequence - deviceState.nextStreamSequence);
+      // Events the server filtered out leave gaps too, which it doesn't expect us to make up for (when it has to drop
+      // events, it follows up with the state itself)
+      if (offset > 0 && !filtering) {
+         eventsMissed.add(static_cast<uint64_t>(offset));
+
+         // Events the server conflated away don't need a new state, anything else does
+         if (!config.conflate) {
+            requestSnapshot(currentDevice);
+         }
+      }
+   }
+   deviceState.streamSequenceKnown = true;
+   deviceState.nextStreamSequence = sequence + numEvents;
+}
+
+void Client::selectDevice(uint16_t device) {
+   if (device >= kMaxDevices) {
+      printf("Ignoring switch to unknown device: %u\n", static_cast<unsigned int>(device));
+      return;
+   }
+
+   currentDevice = device;
+}
+
+int64_t Client::recordLatency(uint64_t captureTime) {
+   int64_t latency = static_cast<int64_t>(getTimestamp() - captureTime);
+   lastLatency.set(latency);
+   eventLatency.record(latency > 0 ? static_cast<uint64_t>(latency) : 0);
+
+   return latency;
+}
+
+void Client::applySnapshot(const SnapshotPacket& packet) {
+   // Events after a state don't have to follow on from the ones before it (or be relative to them)
+   DeviceState& deviceState = devices[currentDevice];
+   deviceState.streamSequenceKnown = false;
+   deviceState.compactDecoder.reset();
+
+   Kontroller::State previousState = deviceState.state;
+   decodeSnapshot(packet, deviceState.state);
+   deviceState.changed = true;
+
+   // Turn whatever the snapshot changed into events, so listeners see the same edges they would have from the stream
+   uint16_t device = currentDevice;
+   forEachChangedControl(previousState, deviceState.state, [this, device](EventPacket::Type type, uint16_t id, bool pressed, float value) {
+      batchEvents.push_back(makeEvent(device, type, id, pressed, value, 0, 0));
+      batchPackets.push_back(makeControlPacket(type, id, pressed, value));
+   });
+}
+
+void Client::applyDatagram(const uint8_t* data, size_t size) {
+   if (size < sizeof(EventPacket)) {
+      return;
+   }
+
+   EventPacket networkHeader;
+   memcpy(&networkHeader, data, sizeof(networkHeader));
+   EventPacket header = networkToHost(networkHeader);
+
+   // Servers before timed datagrams send the events without a capture time
+   size_t headerSize = sizeof(EventPacket);
+   uint64_t captureTime = 0;
+   if (header.type == EventPacket::kTimedDatagram && size >= sizeof(TimedDatagramHeader)) {
+      TimedDatagramHeader networkTimedHeader;
+      memcpy(&networkTimedHeader, data, sizeof(networkTimedHeader));
+      headerSize = sizeof(TimedDatagramHeader);
+      captureTime = networkToHost(networkTimedHeader).getCaptureTime();
+   } else if (header.type != EventPacket::kDatagram) {
+      return;
+   }
+
+   if (size != headerSize + sizeof(EventPacket) * header.id) {
+      return;
+   }
+
+   // A datagram without any events is a heartbeat, which only tells us what the next sequence number should be
+   if (header.id == 0) {
+      int32_t offset = static_cast<int32_t>(header.value - datagramStream.nextSequence);
+      if (datagramStream.synced && offset > 0) {
+         eventsMissed.add(static_cast<uint64_t>(offset));
+         datagramStream.synced = false;
+         if (!datagramStream.awaitingState) {
+            datagramStream.awaitingState = true;
+            requestSnapshot();
+         }
       }
-      break;
+      return;
    }
+
+   // Every event in the datagram gets the capture time of the first one, so latencies are an upper bound
+   for (uint16_t i = 0; i < header.id; ++i) {
+      EventPacket networkPacket;
+      memcpy(&networkPacket, data + headerSize + sizeof(EventPacket) * i, sizeof(networkPacket));
+      applyDatagramEvent(header.value + i, networkToHost(networkPacket), captureTime);
+   }
+}
+
+void Client::applyDatagramEvent(uint32_t sequence, const EventPacket& packet, uint64_t captureTime) {
+   static const size_t kMaxStashedEvents = 4096;
+
+   if (datagramStream.synced) {
+      int32_t offset = static_cast<int32_t>(sequence - datagramStream.nextSequence);
+      if (offset < 0) {
+         // Already applied, or reflected in the state
+         return;
+      }
+
+      if (offset == 0) {
+         applyEvent(0, packet, captureTime);
+         ++datagramStream.nextSequence;
+         return;
+      }
+
+      // Events were lost (or reordered), so the state has to be fetched again over TCP
+      eventsMissed.add(static_cast<uint64_t>(offset));
+      datagramStream.synced = false;
+   }
+
+   if (!datagramStream.awaitingState) {
+      datagramStream.awaitingState = true;
+      requestSnapshot();
+   }
+
+   // Hold on to events until we know which ones the state will reflect
+   if (datagramStream.stashedEvents.size() >= kMaxStashedEvents) {
+      datagramStream.stashedEvents.clear();
+   }
+   datagramStream.stashedEvents.push_back(StashedEvent { sequence, packet, captureTime });
+}
+
+void Client::syncDatagrams(uint32_t sequence) {
+   datagramStream.synced = true;
+   datagramStream.awaitingState = false;
+   datagramStream.nextSequence = sequence;
+
+   // Apply whatever arrived while waiting for the state (which may still have gaps in it)
+   std::vector<StashedEvent> stashedEvents;
+   stashedEvents.swap(datagramStream.stashedEvents);
+   std::sort(stashedEvents.begin(), stashedEvents.end(), [sequence](const StashedEvent& first, const StashedEvent& second) {
+      return static_cast<int32_t>(first.sequence - sequence) < static_cast<int32_t>(second.sequence - sequence);
+   });
+
+   for (const StashedEvent& stashedEvent : stashedEvents) {
+      applyDatagramEvent(stashedEvent.sequence, stashedEvent.packet, stashedEvent.captureTime);
+   }
+}
+
+void Client::addOverflowEvent(const Event& event) {
+   // Only the latest value of a dial / slider matters, so it takes the place of the one waiting (if any)
+   int slot = getOverflowSlot(event);
+   if (slot >= 0 && overflowSlots[event.device][slot] != 0) {
+      Event& waiting = overflowEvents[overflowSlots[event.device][slot] - 1 - overflowStart];
+      if (event.type == EventPacket::kEventsDropped) {
+         waiting.numDropped += event.numDropped;
+      } else {
+         waiting = event;
+      }
+      return;
+   }
+
+   // Markers always fit (there is only ever one per device)
+   if (overflowEvents.size() >= config.eventQueueCapacity && event.type != EventPacket::kEventsDropped) {
+      if (slot >= 0) {
+         eventsDropped.add();
+         addOverflowEvent(makeDroppedEvent(event.device, 1));
+         return;
+      }
+
+      // Every button edge matters, so they push out the oldest dial / slider change instead
+      auto oldest = std::find_if(overflowEvents.begin(), overflowEvents.end(), [](const Event& waiting) {
+         return waiting.type == EventPacket::kDial || waiting.type == EventPacket::kSlider;
+      });
+      if (oldest != overflowEvents.end()) {
+         uint16_t device = oldest->device;
+         overflowEvents.erase(oldest);
+         indexOverflowEvents();
+
+         eventsDropped.add();
+         addOverflowEvent(makeDroppedEvent(device, 1));
+      } else {
+         dropOverflowEvents();
+      }
+   }
+
+   overflowEvents.push_back(event);
+   if (slot >= 0) {
+      overflowSlots[event.device][slot] = overflowStart + overflowEvents.size();
+   }
+}
+
+void Client::indexOverflowEvents() {
+   for (uint64_t (&deviceSlots)[kNumOverflowSlots] : overflowSlots) {
+      std::fill(std::begin(deviceSlots), std::end(deviceSlots), 0);
+   }
+
+   for (size_t i = 0; i < overflowEvents.size(); ++i) {
+      int slot = getOverflowSlot(overflowEvents[i]);
+      if (slot >= 0) {
+         overflowSlots[overflowEvents[i].device][slot] = overflowStart + i + 1;
+      }
+   }
+}
+
+void Client::dropOverflowEvents() {
+   // Whoever is polling has fallen too far behind to catch up event by event, so they get to start over from the state
+   uint64_t numDropped[kMaxDevices] = {};
+   for (const Event& event : overflowEvents) {
+      // Earlier markers are folded into the new ones
+      if (event.type == EventPacket::kEventsDropped) {
+         numDropped[event.device] += event.numDropped;
+      } else {
+         numDropped[event.device] += 1;
+         eventsDropped.add();
+      }
+   }
+
+   overflowEvents.clear();
+   for (uint16_t device = 0; device < kMaxDevices; ++device) {
+      if (numDropped[device] > 0) {
+         overflowEvents.push_back(makeDroppedEvent(device, numDropped[device]));
+      }
+   }
+   indexOverflowEvents();
+}
+
+void Client::deliverEvents() {
+   if (!batchEvents.empty()) {
+      std::lock_guard<std::mutex> lock(callbackMutex);
+
+      if (batchCallback) {
+         batchCallback(batchEvents.data(), batchPackets.data(), batchEvents.size());
+      }
+
+      for (const Event& event : batchEvents) {
+         switch (event.type) {
+         case EventPacket::kButton:
+            if (buttonCallback) {
+               buttonCallback(static_cast<Kontroller::Button>(event.id), event.pressed);
+            }
+            break;
+         case EventPacket::kDial:
+            if (dialCallback) {
+               dialCallback(static_cast<Kontroller::Dial>(event.id), event.value);
+            }
+            break;
+         case EventPacket::kSlider:
+            if (sliderCallback) {
+               sliderCallback(static_cast<Kontroller::Slider>(event.id), event.value);
+            }
+            break;
+         default:
+            break;
+         }
+      }
+   }
+
+   if (eventQueue) {
+      // Once anything has overflowed, everything goes through the overflow list to keep events in order
+      for (const Event& event : batchEvents) {
+         if (overflowEvents.empty() && eventQueue->push(event)) {
+            continue;
+         }
+
+         addOverflowEvent(event);
+      }
+
+      while (!overflowEvents.empty() && eventQueue->push(overflowEvents.front())) {
+         int slot = getOverflowSlot(overflowEvents.front());
+         if (slot >= 0) {
+            overflowSlots[overflowEvents.front().device][slot] = 0;
+         }
+         overflowEvents.pop_front();
+         ++overflowStart;
+      }
+   }
+
+   batchEvents.clear();
+   batchPackets.clear();
 }
 
 } // namespace KontrollerSock
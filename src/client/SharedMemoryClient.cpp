@@ -0,0 +1,144 @@
+#include "KontrollerSock/SharedMemoryClient.h"
+
+#include <cstring>
+
+namespace KontrollerSock {
+
+namespace {
+
+Client::Event makeEvent(uint16_t device, const TimedEventPacket& packet, uint64_t now) {
+   Client::Event event;
+   event.type = static_cast<EventPacket::Type>(packet.event.type);
+   event.id = packet.event.id;
+   event.pressed = packet.event.value != 0;
+   event.value = 0.0f;
+   if (event.type != EventPacket::kButton) {
+      memcpy(&event.value, &packet.event.value, sizeof(event.value));
+   }
+
+   uint64_t captureTime = packet.getCaptureTime();
+   event.latency = now > captureTime ? static_cast<int64_t>(now - captureTime) : 0;
+   event.captureTime = captureTime;
+   event.device = device;
+   event.numDropped = 0;
+
+   return event;
+}
+
+} // namespace
+
+SharedMemoryClient::SharedMemoryClient(const char* segmentName, uint16_t segmentDevice) : name(getSharedMemoryName(segmentName, segmentDevice)), device(segmentDevice), cursor(0) {
+}
+
+bool SharedMemoryClient::open() {
+#if SOCK_SHARED_MEMORY
+   if (!mapping.open(name.c_str())) {
+      return false;
+   }
+
+   cursor = mapping.get()->events.head();
+   return true;
+#else
+   return false;
+#endif
+}
+
+void SharedMemoryClient::close() {
+#if SOCK_SHARED_MEMORY
+   mapping.close();
+#endif
+}
+
+bool SharedMemoryClient::isOpen() const {
+#if SOCK_SHARED_MEMORY
+   return static_cast<bool>(mapping);
+#else
+   return false;
+#endif
+}
+
+bool SharedMemoryClient::isServerRunning() const {
+#if SOCK_SHARED_MEMORY
+   return mapping && mapping.get()->open.load(std::memory_order_acquire) != 0;
+#else
+   return false;
+#endif
+}
+
+Kontroller::State SharedMemoryClient::getState() const {
+#if SOCK_SHARED_MEMORY
+   if (mapping) {
+      return mapping.get()->snapshot.load().state;
+   }
+#endif
+
+   return Kontroller::State{};
+}
+
+size_t SharedMemoryClient::pollEvents(Client::Event* events, size_t maxEvents) {
+#if SOCK_SHARED_MEMORY
+   if (!mapping) {
+      return 0;
+   }
+
+   const SharedSegment& segment = *mapping.get();
+   static const size_t kMaxBatchSize = 64;
+   TimedEventPacket packets[kMaxBatchSize];
+   uint64_t now = getTimestamp();
+   size_t numEvents = 0;
+
+   while (numEvents < maxEvents) {
+      size_t batchSize = maxEvents - numEvents < kMaxBatchSize ? maxEvents - numEvents : kMaxBatchSize;
+
+      bool overrun = false;
+      size_t count = segment.events.read(cursor, packets, batchSize, overrun);
+      if (overrun) {
+         // Skip ahead to whatever is still in the ring (with some slack, since the server may be publishing right now)
+         uint64_t head = segment.events.head();
+         uint64_t newCursor = head - segment.events.capacity() / 2;
+         stats.eventsMissed += newCursor - cursor;
+         cursor = newCursor;
+         continue;
+      }
+
+      if (count == 0) {
+         break;
+      }
+
+      for (size_t i = 0; i < count; ++i) {
+         events[numEvents++] = makeEvent(device, packets[i], now);
+      }
+   }
+
+   stats.eventsReceived += numEvents;
+   return numEvents;
+#else
+   return 0;
+#endif
+}
+
+bool SharedMemoryClient::waitForEvents(std::chrono::microseconds timeout) {
+#if SOCK_SHARED_MEMORY
+   if (!mapping) {
+      return false;
+   }
+
+   SharedSegment& segment = *mapping.get();
+
+   // Read the wake counter first, so that an event published after checking the head still wakes us up
+   uint32_t wakeCounter = segment.wakeCounter.load(std::memory_order_acquire);
+   if (segment.events.head() != cursor) {
+      return true;
+   }
+
+   if (segment.open.load(std::memory_order_acquire)) {
+      waitForSharedSegment(segment, mapping.isWritable(), wakeCounter, timeout);
+   }
+
+   return segment.events.head() != cursor;
+#else
+   return false;
+#endif
+}
+
+} // namespace KontrollerSock
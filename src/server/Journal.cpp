@@ -0,0 +1,347 @@
+#include "KontrollerSock/Controls.h"
+#include "KontrollerSock/Journal.h"
+#include "KontrollerSock/Sock.h"
+
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <new>
+
+#if SOCK_POSIX
+#  include <fcntl.h>
+#  include <sys/mman.h>
+#  include <sys/stat.h>
+#  include <unistd.h>
+#endif
+
+namespace KontrollerSock {
+
+namespace {
+
+// The file is extended (and mapped) this many blocks at a time, so the writer rarely has to touch anything but memory
+const uint64_t kBlocksPerChunk = 256;
+
+uint64_t getBlockOffset(uint64_t index) {
+   // The header takes up the first block
+   return (index + 1) * kJournalBlockSize;
+}
+
+uint8_t* mapChunk(int fileDescriptor, uint64_t firstBlock) {
+#if SOCK_POSIX
+   // Grows the file with zeros, so blocks that haven't been started yet have no checkpoint magic
+   if (::ftruncate(fileDescriptor, static_cast<off_t>(getBlockOffset(firstBlock + kBlocksPerChunk))) != 0) {
+      printf("Unable to extend journal, error: %d\n", errno);
+      return nullptr;
+   }
+
+   void* address = ::mmap(nullptr, kBlocksPerChunk * kJournalBlockSize, PROT_READ | PROT_WRITE, MAP_SHARED, fileDescriptor, static_cast<off_t>(getBlockOffset(firstBlock)));
+   if (address == MAP_FAILED) {
+      printf("Unable to map journal, error: %d\n", errno);
+      return nullptr;
+   }
+
+   // Fault every block in for writing (with the zero that is already there), so that starting a block never faults - a
+   // fault would also have to wait for whatever mapping or unmapping the map thread is doing
+   uint8_t* chunk = static_cast<uint8_t*>(address);
+   for (uint64_t i = 0; i < kBlocksPerChunk; ++i) {
+      *static_cast<volatile uint8_t*>(chunk + i * kJournalBlockSize) = 0;
+   }
+
+   return chunk;
+#else
+   return nullptr;
+#endif
+}
+
+void unmapChunk(uint8_t* chunk) {
+#if SOCK_POSIX
+   if (chunk) {
+      ::munmap(chunk, kBlocksPerChunk * kJournalBlockSize);
+   }
+#endif
+}
+
+} // namespace
+
+JournalWriter::JournalWriter()
+   : fileDescriptor(-1), chunk(nullptr), chunkFirstBlock(0), block(nullptr), numBlocks(0), state{}, sequence(0), eventsWritten(0), stopMapping(false), prepareRequested(false),
+     preparedChunk(nullptr), prepareFailed(false), retiredChunk(nullptr) {
+}
+
+JournalWriter::~JournalWriter() {
+   close();
+}
+
+bool JournalWriter::create(const char* path, const Kontroller::State& initialState, uint64_t initialSequence) {
+   close();
+
+#if SOCK_POSIX
+   fileDescriptor = ::open(path, O_CREAT | O_TRUNC | O_RDWR, 0644);
+   if (fileDescriptor == -1) {
+      printf("Unable to create journal %s, error: %d\n", path, errno);
+      return false;
+   }
+
+   JournalHeader header = {};
+   header.magic = JournalHeader::kMagic;
+   header.version = JournalHeader::kVersion;
+   header.blockSize = static_cast<uint32_t>(kJournalBlockSize);
+   header.stateSize = static_cast<uint32_t>(sizeof(Kontroller::State));
+   header.startTime = getTimestamp();
+   if (::pwrite(fileDescriptor, &header, sizeof(header), 0) != static_cast<ssize_t>(sizeof(header))) {
+      printf("Unable to write journal header, error: %d\n", errno);
+      close();
+      return false;
+   }
+
+   // The first chunk is mapped right away, and the map thread gets started on the next one
+   chunk = mapChunk(fileDescriptor, 0);
+   if (!chunk) {
+      close();
+      return false;
+   }
+   chunkFirstBlock = 0;
+   prepareRequested = true;
+   mapThread = std::thread([this]() { runMapThread(); });
+
+   state = initialState;
+   sequence = initialSequence;
+   if (!startBlock(header.startTime)) {
+      close();
+      return false;
+   }
+
+   return true;
+#else
+   printf("Journals are not supported on this platform\n");
+   return false;
+#endif
+}
+
+void JournalWriter::append(const TimedEventPacket& packet) {
+   if (!block) {
+      return;
+   }
+
+   uint64_t captureTime = packet.getCaptureTime();
+   uint32_t numEvents = block->checkpoint.numEvents.load(std::memory_order_relaxed);
+   if (numEvents == kJournalEventsPerBlock) {
+      if (!startBlock(captureTime)) {
+         close();
+         return;
+      }
+      numEvents = 0;
+   }
+
+   JournalEvent& event = block->events[numEvents];
+   event.captureTime = captureTime;
+   event.event = packet.event;
+   block->checkpoint.numEvents.store(numEvents + 1, std::memory_order_release);
+
+   applyControlEvent(state, packet.event);
+   ++sequence;
+   ++eventsWritten;
+}
+
+void JournalWriter::close() {
+   if (mapThread.joinable()) {
+      {
+         std::lock_guard<std::mutex> lock(mapMutex);
+         stopMapping = true;
+      }
+      mapCv.notify_all();
+      mapThread.join();
+   }
+
+   unmapChunk(chunk);
+   unmapChunk(preparedChunk);
+   unmapChunk(retiredChunk);
+   chunk = nullptr;
+   preparedChunk = nullptr;
+   retiredChunk = nullptr;
+   block = nullptr;
+   stopMapping = false;
+   prepareRequested = false;
+   prepareFailed = false;
+
+#if SOCK_POSIX
+
+   if (fileDescriptor != -1) {
+      // Drop the blocks that were mapped ahead of time but never reached
+      if (::ftruncate(fileDescriptor, static_cast<off_t>(getBlockOffset(numBlocks))) != 0) {
+         printf("Unable to trim journal, error: %d\n", errno);
+      }
+      ::close(fileDescriptor);
+      fileDescriptor = -1;
+   }
+#endif
+
+   numBlocks = 0;
+}
+
+bool JournalWriter::startBlock(uint64_t time) {
+   if (numBlocks == chunkFirstBlock + kBlocksPerChunk && !advanceChunk()) {
+      return false;
+   }
+
+   uint8_t* address = chunk + (numBlocks - chunkFirstBlock) * kJournalBlockSize;
+   JournalBlock* newBlock = new (address) JournalBlock;
+   newBlock->checkpoint.numEvents.store(0, std::memory_order_relaxed);
+   newBlock->checkpoint.time = time;
+   newBlock->checkpoint.sequence = sequence;
+   newBlock->checkpoint.state = state;
+   newBlock->checkpoint.magic = JournalCheckpoint::kMagic;
+
+   block = newBlock;
+   ++numBlocks;
+   return true;
+}
+
+bool JournalWriter::advanceChunk() {
+   std::unique_lock<std::mutex> lock(mapMutex);
+   mapCv.wait(lock, [this]() { return preparedChunk || prepareFailed; });
+   if (!preparedChunk) {
+      return false;
+   }
+
+   // Hand the full chunk over to be unmapped, and have the one after the new chunk prepared
+   retiredChunk = chunk;
+   chunk = preparedChunk;
+   chunkFirstBlock += kBlocksPerChunk;
+   preparedChunk = nullptr;
+   prepareRequested = true;
+   lock.unlock();
+
+   mapCv.notify_all();
+   return true;
+}
+
+void JournalWriter::runMapThread() {
+   std::unique_lock<std::mutex> lock(mapMutex);
+   while (true) {
+      mapCv.wait(lock, [this]() { return stopMapping || prepareRequested || retiredChunk; });
+      if (stopMapping) {
+         break;
+      }
+
+      uint8_t* oldChunk = retiredChunk;
+      bool prepare = prepareRequested;
+      uint64_t firstBlock = chunkFirstBlock + kBlocksPerChunk;
+      retiredChunk = nullptr;
+      prepareRequested = false;
+
+      // The system calls are made without the lock, so that the writer is never held up by them unless it has to be
+      lock.unlock();
+      unmapChunk(oldChunk);
+      uint8_t* newChunk = prepare ? mapChunk(fileDescriptor, firstBlock) : nullptr;
+      lock.lock();
+
+      if (prepare) {
+         preparedChunk = newChunk;
+         prepareFailed = newChunk == nullptr;
+         mapCv.notify_all();
+      }
+   }
+}
+
+JournalReader::JournalReader() : header(nullptr), size(0), numBlocks(0) {
+}
+
+JournalReader::~JournalReader() {
+   close();
+}
+
+bool JournalReader::open(const char* path) {
+   close();
+
+#if SOCK_POSIX
+   int fileDescriptor = ::open(path, O_RDONLY);
+   if (fileDescriptor == -1) {
+      printf("Unable to open journal %s, error: %d\n", path, errno);
+      return false;
+   }
+
+   struct stat status = {};
+   bool largeEnough = ::fstat(fileDescriptor, &status) == 0 && status.st_size >= static_cast<off_t>(getBlockOffset(0));
+   void* address = largeEnough ? ::mmap(nullptr, static_cast<size_t>(status.st_size), PROT_READ, MAP_SHARED, fileDescriptor, 0) : MAP_FAILED;
+   ::close(fileDescriptor);
+   if (address == MAP_FAILED) {
+      printf("Journal %s is not a valid journal\n", path);
+      return false;
+   }
+
+   header = static_cast<const JournalHeader*>(address);
+   size = static_cast<size_t>(status.st_size);
+
+   if (header->magic != JournalHeader::kMagic || header->version != JournalHeader::kVersion || header->blockSize != kJournalBlockSize || header->stateSize != sizeof(Kontroller::State)) {
+      printf("Journal %s has an unsupported layout\n", path);
+      close();
+      return false;
+   }
+
+   // A journal that is still being written (or whose writer crashed) has zeroed blocks at the end, which haven't been started
+   numBlocks = size / kJournalBlockSize - 1;
+   while (numBlocks > 0 && getBlock(numBlocks - 1).checkpoint.magic != JournalCheckpoint::kMagic) {
+      --numBlocks;
+   }
+
+   if (numBlocks == 0) {
+      printf("Journal %s has no checkpoints\n", path);
+      close();
+      return false;
+   }
+
+   return true;
+#else
+   printf("Journals are not supported on this platform\n");
+   return false;
+#endif
+}
+
+void JournalReader::close() {
+#if SOCK_POSIX
+   if (header) {
+      ::munmap(const_cast<JournalHeader*>(header), size);
+   }
+#endif
+
+   header = nullptr;
+   size = 0;
+   numBlocks = 0;
+}
+
+const JournalBlock& JournalReader::getBlock(uint64_t index) const {
+   assert(header && index < (size / kJournalBlockSize) - 1);
+
+   return *reinterpret_cast<const JournalBlock*>(reinterpret_cast<const uint8_t*>(header) + getBlockOffset(index));
+}
+
+uint64_t JournalReader::findBlock(uint64_t time) const {
+   // Checkpoint times only go up (as long as the clock does), so only log(n) blocks are touched no matter how long the journal is
+   uint64_t first = 0;
+   uint64_t last = numBlocks;
+   while (last - first > 1) {
+      uint64_t middle = first + (last - first) / 2;
+      if (getBlock(middle).checkpoint.time <= time) {
+         first = middle;
+      } else {
+         last = middle;
+      }
+   }
+
+   return first;
+}
+
+uint64_t JournalReader::getStartTime() const {
+   return getNumEvents(0) > 0 ? getBlock(0).events[0].captureTime : getBlock(0).checkpoint.time;
+}
+
+uint64_t JournalReader::getEndTime() const {
+   const JournalBlock& lastBlock = getBlock(numBlocks - 1);
+   uint32_t numEvents = getNumEvents(numBlocks - 1);
+
+   return numEvents > 0 ? lastBlock.events[numEvents - 1].captureTime : lastBlock.checkpoint.time;
+}
+
+} // namespace KontrollerSock
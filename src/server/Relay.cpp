@@ -0,0 +1,132 @@
+#include "KontrollerSock/Controls.h"
+#include "KontrollerSock/Relay.h"
+
+#include <thread>
+
+namespace KontrollerSock {
+
+namespace {
+
+size_t getNumMirroredDevices(uint32_t deviceMask) {
+   size_t numDevices = 1;
+   for (size_t device = 0; device < kMaxDevices; ++device) {
+      if (deviceMask & (1u << device)) {
+         numDevices = device + 1;
+      }
+   }
+
+   return numDevices;
+}
+
+} // namespace
+
+Relay::MirroredDevice::MirroredDevice(Client& upstreamClient, uint16_t deviceIndex) : client(upstreamClient), index(deviceIndex), relaying(false), state{} {
+}
+
+void Relay::MirroredDevice::relay(const Client::Event* events, const EventPacket* eventPackets, size_t numEvents) {
+   std::lock_guard<std::mutex> callbackLock(callbackMutex);
+
+   // Until the server listens for events, it only ever sees the client's latest state
+   if (!eventsCallback) {
+      return;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(stateMutex);
+      for (size_t i = 0; i < numEvents; ++i) {
+         applyControlEvent(state, eventPackets[i]);
+      }
+   }
+
+   eventsCallback(eventPackets, numEvents, events[0].captureTime);
+}
+
+Kontroller::State Relay::MirroredDevice::getState() {
+   std::lock_guard<std::mutex> lock(stateMutex);
+   if (!relaying) {
+      state = client.getState(index);
+   }
+
+   return state;
+}
+
+bool Relay::MirroredDevice::setEventsCallback(EventsCallback callback) {
+   std::lock_guard<std::mutex> callbackLock(callbackMutex);
+   eventsCallback = std::move(callback);
+   relaying = static_cast<bool>(eventsCallback);
+
+   if (!eventsCallback) {
+      return true;
+   }
+
+   // Catch up on whatever changed upstream since the server last got the state, as a single batch
+   Kontroller::State upstreamState = client.getState(index);
+   Kontroller::State previousState;
+   {
+      std::lock_guard<std::mutex> lock(stateMutex);
+      previousState = state;
+      state = upstreamState;
+   }
+
+   packets.clear();
+   forEachChangedControl(previousState, upstreamState, [this](EventPacket::Type type, uint16_t id, bool pressed, float value) {
+      packets.push_back(makeControlPacket(type, id, pressed, value));
+   });
+   if (!packets.empty()) {
+      eventsCallback(packets.data(), packets.size(), 0);
+   }
+
+   return true;
+}
+
+Relay::Relay(const Config& relayConfig) : client(relayConfig.upstream), server(relayConfig.downstream) {
+   size_t numDevices = getNumMirroredDevices(relayConfig.upstream.devices);
+   for (size_t device = 0; device < numDevices; ++device) {
+      devices.emplace_back(new MirroredDevice(client, static_cast<uint16_t>(device)));
+   }
+
+   client.setBatchCallback([this](const Client::Event* events, const EventPacket* packets, size_t numEvents) { forward(events, packets, numEvents); });
+}
+
+bool Relay::run(const char* endpoint) {
+   return run(std::vector<const char*> { endpoint });
+}
+
+bool Relay::run(const std::vector<const char*>& endpoints) {
+   std::thread clientThread([this, endpoints]() { client.run(endpoints); });
+
+   std::vector<EventSource*> sources;
+   for (std::unique_ptr<MirroredDevice>& device : devices) {
+      sources.push_back(device.get());
+   }
+   bool success = server.run(sources);
+
+   client.shutDown();
+   clientThread.join();
+
+   return success;
+}
+
+void Relay::shutDown() {
+   server.shutDown();
+   client.shutDown();
+}
+
+void Relay::forward(const Client::Event* events, const EventPacket* packets, size_t numEvents) {
+   // Events are passed on in runs that belong to the same device and were captured at the same time (a whole compact
+   // frame, or a whole state's worth of changes), which are then published together
+   size_t runStart = 0;
+   for (size_t i = 1; i <= numEvents; ++i) {
+      if (i < numEvents && events[i].device == events[runStart].device && events[i].captureTime == events[runStart].captureTime) {
+         continue;
+      }
+
+      uint16_t device = events[runStart].device;
+      if (device < devices.size()) {
+         devices[device]->relay(events + runStart, packets + runStart, i - runStart);
+      }
+      runStart = i;
+   }
+}
+
+} // namespace KontrollerSock
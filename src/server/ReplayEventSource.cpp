@@ -0,0 +1,223 @@
+#include "KontrollerSock/ReplayEventSource.h"
+#include "KontrollerSock/Controls.h"
+
+#include <chrono>
+#include <cstring>
+
+namespace KontrollerSock {
+
+namespace {
+
+// Longest the replay thread sleeps for at a time, so that it notices seeks and being stopped during long pauses
+const std::chrono::milliseconds kMaxSleep(100);
+
+} // namespace
+
+ReplayEventSource::ReplayEventSource(const Config& sourceConfig) : config(sourceConfig), running(false), finished(false), block(0), eventIndex(0), seekRequested(false), seekTime(0), state{}, eventsReplayed(0) {
+}
+
+ReplayEventSource::~ReplayEventSource() {
+   stop();
+}
+
+bool ReplayEventSource::open() {
+   stop();
+
+   if (!config.path || !reader.open(config.path)) {
+      return false;
+   }
+
+   block = 0;
+   eventIndex = 0;
+   finished = false;
+
+   std::lock_guard<std::mutex> lock(stateMutex);
+   state = reader.getBlock(0).checkpoint.state;
+   return true;
+}
+
+void ReplayEventSource::start() {
+   if (reader && !running.exchange(true)) {
+      thread = std::thread([this]() { run(); });
+   }
+}
+
+void ReplayEventSource::stop() {
+   running = false;
+   if (thread.joinable()) {
+      thread.join();
+   }
+}
+
+void ReplayEventSource::seek(uint64_t time) {
+   if (!reader) {
+      return;
+   }
+
+   if (running) {
+      seekTime.store(time, std::memory_order_relaxed);
+      seekRequested.store(true, std::memory_order_release);
+   } else {
+      moveTo(time, false);
+   }
+}
+
+uint64_t ReplayEventSource::getStartTime() const {
+   return reader ? reader.getStartTime() : 0;
+}
+
+uint64_t ReplayEventSource::getEndTime() const {
+   return reader ? reader.getEndTime() : 0;
+}
+
+Kontroller::State ReplayEventSource::getState() {
+   std::lock_guard<std::mutex> lock(stateMutex);
+   return state;
+}
+
+void ReplayEventSource::setButtonCallback(ButtonCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   buttonCallback = std::move(callback);
+}
+
+void ReplayEventSource::setDialCallback(DialCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   dialCallback = std::move(callback);
+}
+
+void ReplayEventSource::setSliderCallback(SliderCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   sliderCallback = std::move(callback);
+}
+
+void ReplayEventSource::run() {
+   // Events are due relative to the first one replayed since starting (or seeking, or looping), so pauses are kept
+   bool anchored = false;
+   uint64_t anchorTime = 0;
+   std::chrono::steady_clock::time_point anchorWallTime;
+
+   while (running) {
+      if (seekRequested.exchange(false, std::memory_order_acquire)) {
+         moveTo(seekTime.load(std::memory_order_relaxed), true);
+         anchored = false;
+      }
+
+      if (eventIndex == reader.getNumEvents(block)) {
+         if (block + 1 < reader.getNumBlocks()) {
+            ++block;
+            eventIndex = 0;
+         } else if (config.loop) {
+            // Back to just before the first event, so that it is replayed rather than folded into the state
+            setPosition(0, 0, reader.getBlock(0).checkpoint.state, true);
+            anchored = false;
+
+            // Starting over doesn't get anywhere if there are no events after the start (e.g. an idle recording)
+            if (block + 1 == reader.getNumBlocks() && eventIndex == reader.getNumEvents(block)) {
+               std::this_thread::sleep_for(std::chrono::milliseconds(10));
+            }
+         } else {
+            finished.store(true, std::memory_order_release);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+         }
+         continue;
+      }
+
+      const JournalEvent& event = reader.getBlock(block).events[eventIndex];
+      if (config.speed > 0.0) {
+         std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+         if (!anchored) {
+            anchorTime = event.captureTime;
+            anchorWallTime = now;
+            anchored = true;
+         }
+
+         // Capture times come from the system clock, so they could go backwards
+         uint64_t elapsed = event.captureTime > anchorTime ? event.captureTime - anchorTime : 0;
+         std::chrono::steady_clock::time_point dueTime = anchorWallTime + std::chrono::duration_cast<std::chrono::steady_clock::duration>(std::chrono::duration<double, std::micro>(elapsed / config.speed));
+         if (dueTime > now) {
+            std::this_thread::sleep_until(dueTime < now + kMaxSleep ? dueTime : now + kMaxSleep);
+            continue;
+         }
+      }
+
+      replay(event.event);
+      ++eventIndex;
+      eventsReplayed.fetch_add(1, std::memory_order_relaxed);
+   }
+}
+
+void ReplayEventSource::moveTo(uint64_t time, bool report) {
+   // Start from the closest checkpoint, and apply the events leading up to the time
+   uint64_t targetBlock = reader.findBlock(time);
+   const JournalBlock& journalBlock = reader.getBlock(targetBlock);
+   uint32_t numEvents = reader.getNumEvents(targetBlock);
+
+   Kontroller::State newState = journalBlock.checkpoint.state;
+   uint32_t index = 0;
+   while (index < numEvents && journalBlock.events[index].captureTime <= time) {
+      applyControlEvent(newState, journalBlock.events[index].event);
+      ++index;
+   }
+
+   setPosition(targetBlock, index, newState, report);
+}
+
+void ReplayEventSource::setPosition(uint64_t newBlock, uint32_t newEventIndex, const Kontroller::State& newState, bool report) {
+   block = newBlock;
+   eventIndex = newEventIndex;
+   finished.store(false, std::memory_order_release);
+
+   std::lock_guard<std::mutex> callbackLock(callbackMutex);
+
+   Kontroller::State previousState;
+   {
+      std::lock_guard<std::mutex> lock(stateMutex);
+      previousState = state;
+      state = newState;
+   }
+
+   if (report) {
+      forEachChangedControl(previousState, newState, [this](EventPacket::Type type, uint16_t id, bool pressed, float value) {
+         notify(type, id, pressed, value);
+      });
+   }
+}
+
+void ReplayEventSource::replay(const EventPacket& event) {
+   std::lock_guard<std::mutex> callbackLock(callbackMutex);
+
+   {
+      std::lock_guard<std::mutex> lock(stateMutex);
+      if (!applyControlEvent(state, event)) {
+         return;
+      }
+   }
+
+   float value = 0.0f;
+   memcpy(&value, &event.value, sizeof(value));
+   notify(static_cast<EventPacket::Type>(event.type), event.id, event.value != 0, value);
+}
+
+void ReplayEventSource::notify(EventPacket::Type type, uint16_t id, bool pressed, float value) {
+   switch (type) {
+   case EventPacket::kButton:
+      if (buttonCallback) {
+         buttonCallback(static_cast<Kontroller::Button>(id), pressed);
+      }
+      break;
+   case EventPacket::kDial:
+      if (dialCallback) {
+         dialCallback(static_cast<Kontroller::Dial>(id), value);
+      }
+      break;
+   case EventPacket::kSlider:
+      if (sliderCallback) {
+         sliderCallback(static_cast<Kontroller::Slider>(id), value);
+      }
+      break;
+   default:
+      break;
+   }
+}
+
+} // namespace KontrollerSock
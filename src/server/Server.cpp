@@ -1,8 +1,15 @@
+#include "KontrollerSock/Controls.h"
 #include "KontrollerSock/Handles.h"
+#include "KontrollerSock/Journal.h"
 #include "KontrollerSock/Packet.h"
+#include "KontrollerSock/Poller.h"
+#include "KontrollerSock/ReceiveBuffer.h"
 #include "KontrollerSock/Server.h"
+#include "KontrollerSock/SharedMemory.h"
+#include "KontrollerSock/Snapshot.h"
 #include "KontrollerSock/Sock.h"
 
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 
@@ -10,14 +17,48 @@ namespace KontrollerSock {
 
 namespace {
 
-bool sendData(Sock::Socket socket, const uint8_t* data, size_t size) {
+const uint64_t kListenToken = UINT64_MAX;
+
+// How often the datagram sender sends a heartbeat when no events are flowing
+const std::chrono::milliseconds kHeartbeatInterval(100);
+
+using RequestBuffer = ReceiveBuffer<256>;
+
+// Waits for any of the events on a single socket, rounding the timeout up to whole milliseconds
+// poll() rather than select(), since sockets numbered past FD_SETSIZE are common with thousands of connections
+int pollSocket(Sock::Socket socket, short events, std::chrono::microseconds wait) {
+   Sock::PollDescriptor descriptor = {};
+   descriptor.fd = socket;
+   descriptor.events = events;
+
+   return Sock::poll(&descriptor, 1, static_cast<int>((wait.count() + 999) / 1000));
+}
+
+bool waitForWritable(Sock::Socket socket, std::chrono::microseconds wait) {
+   return pollSocket(socket, POLLOUT, wait) > 0;
+}
+
+// Writes all of the data to a non-blocking socket, giving up if the socket stays full for longer than the timeout
+bool sendData(Sock::Socket socket, const uint8_t* data, size_t size, std::chrono::milliseconds timeout, uint64_t& numSendCalls, bool& timedOut) {
    size_t bytesWritten = 0;
+   timedOut = false;
 
    while (bytesWritten < size) {
-      ssize_t result = Sock::send(socket, data + bytesWritten, size - bytesWritten, 0);
+      ++numSendCalls;
+      ssize_t result = Sock::send(socket, data + bytesWritten, size - bytesWritten, Sock::kNoSignal);
       if (result == Sock::kSocketError) {
-         // Connection lost
-         return false;
+         if (Sock::System::getLastError() != Sock::kWouldBlock) {
+            // Connection lost
+            return false;
+         }
+
+         // The client isn't keeping up, the deadline is reset whenever it makes progress
+         if (!waitForWritable(socket, timeout)) {
+            timedOut = true;
+            return false;
+         }
+
+         continue;
       }
 
       assert(result > 0);
@@ -27,115 +68,100 @@ bool sendData(Sock::Socket socket, const uint8_t* data, size_t size) {
    return true;
 }
 
-bool sendPacket(Sock::Socket socket, EventPacket packet) {
-   EventPacket networkPacket;
-   networkPacket.type = Sock::Endian::hostToNetworkShort(packet.type);
-   networkPacket.id = Sock::Endian::hostToNetworkShort(packet.id);
-   networkPacket.value = Sock::Endian::hostToNetworkLong(packet.value);
+void appendPacket(std::vector<uint8_t>& buffer, EventPacket packet) {
+   EventPacket networkPacket = hostToNetwork(packet);
 
-   return sendData(socket, reinterpret_cast<const uint8_t*>(&networkPacket), sizeof(networkPacket));
+   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&networkPacket);
+   buffer.insert(buffer.end(), bytes, bytes + sizeof(networkPacket));
 }
 
-bool sendEvents(Sock::Socket socket, const std::vector<ButtonEvent>& buttonEvents, const std::vector<DialEvent>& dialEvents, const std::vector<SliderEvent>& sliderEvents) {
-   bool success = true;
+EventPacket makeButtonPacket(Kontroller::Button button, bool pressed) {
+   EventPacket packet;
+   packet.type = EventPacket::kButton;
+   packet.id = static_cast<uint16_t>(button);
+   packet.value = static_cast<uint32_t>(pressed);
+
+   return packet;
+}
 
-   for (ButtonEvent buttonEvent : buttonEvents) {
-      EventPacket packet;
-      packet.type = EventPacket::kButton;
-      packet.id = static_cast<uint16_t>(buttonEvent.button);
-      packet.value = static_cast<uint32_t>(buttonEvent.pressed);
+EventPacket makeFloatPacket(EventPacket::Type type, uint16_t id, float value) {
+   EventPacket packet;
+   packet.type = type;
+   packet.id = id;
+   static_assert(sizeof(packet.value) == sizeof(value), "Packet data size does not match event data size");
+   memcpy(&packet.value, &value, sizeof(packet.value));
 
-      success = success && sendPacket(socket, packet);
+   return packet;
+}
+
+EventPacket makeDialPacket(Kontroller::Dial dial, float value) {
+   return makeFloatPacket(EventPacket::kDial, static_cast<uint16_t>(dial), value);
+}
+
+EventPacket makeSliderPacket(Kontroller::Slider slider, float value) {
+   return makeFloatPacket(EventPacket::kSlider, static_cast<uint16_t>(slider), value);
+}
+
+void appendTimedPacket(std::vector<uint8_t>& buffer, const TimedEventPacket& packet) {
+   TimedEventPacket networkPacket = hostToNetwork(packet);
+   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&networkPacket);
+   buffer.insert(buffer.end(), bytes, bytes + sizeof(networkPacket));
+}
+
+// Appends the events with their sequence numbers and capture times if the client understands them, bare otherwise
+void appendPackets(std::vector<uint8_t>& buffer, const std::vector<TimedEventPacket>& packets, bool timed) {
+   if (timed) {
+      buffer.reserve(buffer.size() + packets.size() * sizeof(TimedEventPacket));
+
+      for (const TimedEventPacket& packet : packets) {
+         appendTimedPacket(buffer, packet);
+      }
+
+      return;
    }
 
-   for (DialEvent dialEvent : dialEvents) {
-      EventPacket packet;
-      packet.type = EventPacket::kDial;
-      packet.id = static_cast<uint16_t>(dialEvent.dial);
-      static_assert(sizeof(packet.value) == sizeof(dialEvent.value), "Packet data size does not match event data size");
-      memcpy(&packet.value, &dialEvent.value, sizeof(packet.value));
+   buffer.reserve(buffer.size() + packets.size() * sizeof(EventPacket));
 
-      success = success && sendPacket(socket, packet);
+   for (const TimedEventPacket& packet : packets) {
+      appendPacket(buffer, packet.event);
    }
+}
 
-   for (SliderEvent sliderEvent : sliderEvents) {
-      EventPacket packet;
-      packet.type = EventPacket::kSlider;
-      packet.id = static_cast<uint16_t>(sliderEvent.slider);
-      static_assert(sizeof(packet.value) == sizeof(sliderEvent.value), "Packet data size does not match event data size");
-      memcpy(&packet.value, &sliderEvent.value, sizeof(packet.value));
+size_t appendInitialState(std::vector<uint8_t>& buffer, const Kontroller::State& state) {
+   size_t numPackets = kNumButtons + kNumGroups * 2;
+   buffer.reserve(buffer.size() + numPackets * sizeof(EventPacket));
 
-      success = success && sendPacket(socket, packet);
+   for (const ControlDescriptor& control : kButtonControls) {
+      appendPacket(buffer, makeButtonPacket(static_cast<Kontroller::Button>(control.id), getControlValue<bool>(state, control)));
    }
 
-   return success;
+   for (const ControlDescriptor& control : kDialControls) {
+      appendPacket(buffer, makeDialPacket(static_cast<Kontroller::Dial>(control.id), getControlValue<float>(state, control)));
+   }
+
+   for (const ControlDescriptor& control : kSliderControls) {
+      appendPacket(buffer, makeSliderPacket(static_cast<Kontroller::Slider>(control.id), getControlValue<float>(state, control)));
+   }
+
+   return numPackets;
+}
+
+// Lets the client know which device what follows belongs to, if it isn't the one it was last told about
+void appendDeviceSwitch(std::vector<uint8_t>& buffer, uint16_t& currentDevice, uint16_t device) {
+   if (device == currentDevice) {
+      return;
+   }
+
+   EventPacket devicePacket;
+   devicePacket.type = EventPacket::kDevice;
+   devicePacket.id = device;
+   devicePacket.value = 0;
+   appendPacket(buffer, devicePacket);
+
+   currentDevice = device;
 }
 
-bool sendInitialState(Sock::Socket socket, const Kontroller::State& state) {
-   std::vector<ButtonEvent> buttonEvents;
-   buttonEvents.reserve(35);
-   buttonEvents.push_back({ Kontroller::Button::kTrackPrevious, state.trackPrevious });
-   buttonEvents.push_back({ Kontroller::Button::kTrackNext, state.trackNext });
-   buttonEvents.push_back({ Kontroller::Button::kCycle, state.cycle });
-   buttonEvents.push_back({ Kontroller::Button::kMarkerSet, state.markerSet });
-   buttonEvents.push_back({ Kontroller::Button::kMarkerPrevious, state.markerPrevious });
-   buttonEvents.push_back({ Kontroller::Button::kMarkerNext, state.markerNext });
-   buttonEvents.push_back({ Kontroller::Button::kRewind, state.rewind });
-   buttonEvents.push_back({ Kontroller::Button::kFastForward, state.fastForward });
-   buttonEvents.push_back({ Kontroller::Button::kStop, state.stop });
-   buttonEvents.push_back({ Kontroller::Button::kPlay, state.play });
-   buttonEvents.push_back({ Kontroller::Button::kRecord, state.record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup1Solo, state.groups[0].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup1Mute, state.groups[0].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup1Record, state.groups[0].record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup2Solo, state.groups[1].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup2Mute, state.groups[1].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup2Record, state.groups[1].record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup3Solo, state.groups[2].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup3Mute, state.groups[2].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup3Record, state.groups[2].record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup4Solo, state.groups[3].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup4Mute, state.groups[3].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup4Record, state.groups[3].record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup5Solo, state.groups[4].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup5Mute, state.groups[4].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup5Record, state.groups[4].record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup6Solo, state.groups[5].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup6Mute, state.groups[5].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup6Record, state.groups[5].record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup7Solo, state.groups[6].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup7Mute, state.groups[6].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup7Record, state.groups[6].record });
-   buttonEvents.push_back({ Kontroller::Button::kGroup8Solo, state.groups[7].solo });
-   buttonEvents.push_back({ Kontroller::Button::kGroup8Mute, state.groups[7].mute });
-   buttonEvents.push_back({ Kontroller::Button::kGroup8Record, state.groups[7].record });
-
-   std::vector<DialEvent> dialEvents;
-   dialEvents.reserve(8);
-   dialEvents.push_back({ Kontroller::Dial::kGroup1, state.groups[0].dial });
-   dialEvents.push_back({ Kontroller::Dial::kGroup2, state.groups[1].dial });
-   dialEvents.push_back({ Kontroller::Dial::kGroup3, state.groups[2].dial });
-   dialEvents.push_back({ Kontroller::Dial::kGroup4, state.groups[3].dial });
-   dialEvents.push_back({ Kontroller::Dial::kGroup5, state.groups[4].dial });
-   dialEvents.push_back({ Kontroller::Dial::kGroup6, state.groups[5].dial });
-   dialEvents.push_back({ Kontroller::Dial::kGroup7, state.groups[6].dial });
-   dialEvents.push_back({ Kontroller::Dial::kGroup8, state.groups[7].dial });
-
-   std::vector<SliderEvent> sliderEvents;
-   sliderEvents.reserve(8);
-   sliderEvents.push_back({ Kontroller::Slider::kGroup1, state.groups[0].slider });
-   sliderEvents.push_back({ Kontroller::Slider::kGroup2, state.groups[1].slider });
-   sliderEvents.push_back({ Kontroller::Slider::kGroup3, state.groups[2].slider });
-   sliderEvents.push_back({ Kontroller::Slider::kGroup4, state.groups[3].slider });
-   sliderEvents.push_back({ Kontroller::Slider::kGroup5, state.groups[4].slider });
-   sliderEvents.push_back({ Kontroller::Slider::kGroup6, state.groups[5].slider });
-   sliderEvents.push_back({ Kontroller::Slider::kGroup7, state.groups[6].slider });
-   sliderEvents.push_back({ Kontroller::Slider::kGroup8, state.groups[7].slider });
-
-   return sendEvents(socket, buttonEvents, dialEvents, sliderEvents);
-}
-
-SocketHandle createListenSocket() {
+SocketHandle createListenSocket(const char* port) {
    SocketHandle listenSocket;
 
    {
@@ -146,7 +172,7 @@ SocketHandle createListenSocket() {
       hints.ai_socktype = SOCK_STREAM;
       hints.ai_protocol = IPPROTO_TCP;
       hints.ai_flags = AI_PASSIVE;
-      int addrInfoResult = Sock::getaddrinfo(nullptr, kPort, &hints, &addrInfo.data);
+      int addrInfoResult = Sock::getaddrinfo(nullptr, port, &hints, &addrInfo.data);
       if (addrInfoResult != 0) {
          printf("getaddrinfo failed with error: %d\n", addrInfoResult);
          return {};
@@ -165,6 +191,16 @@ SocketHandle createListenSocket() {
          return {};
       }
 
+#if SOCK_POSIX
+      // Lets a restarted server listen again straight away, rather than once the connections it closed leave TIME_WAIT
+      // (not on Windows, where this would let other processes bind the same port)
+      int reuseAddress = 1;
+      int optResult = Sock::setsockopt(listenSocket.data, SOL_SOCKET, SO_REUSEADDR, &reuseAddress, sizeof(reuseAddress));
+      if (optResult == Sock::kSocketError) {
+         printf("Unable to reuse the listen address, error: %d\n", Sock::System::getLastError());
+      }
+#endif
+
       int bindResult = Sock::bind(listenSocket.data, addrInfo.data->ai_addr, static_cast<socklen_t>(addrInfo.data->ai_addrlen));
       if (bindResult == Sock::kSocketError) {
          printf("bind failed with error: %d\n", Sock::System::getLastError());
@@ -181,10 +217,191 @@ SocketHandle createListenSocket() {
    return listenSocket;
 }
 
+// Creates the socket used to send datagrams, and resolves where to send them
+SocketHandle createDatagramSocket(const char* address, int multicastTtl, sockaddr_in& destination) {
+   SocketHandle datagramSocket;
+
+   AddrInfoHandle addrInfo;
+
+   addrinfo hints = {};
+   hints.ai_family = AF_INET;
+   hints.ai_socktype = SOCK_DGRAM;
+   hints.ai_protocol = IPPROTO_UDP;
+   int addrInfoResult = Sock::getaddrinfo(address, kDatagramPort, &hints, &addrInfo.data);
+   if (addrInfoResult != 0) {
+      printf("getaddrinfo failed with error: %d\n", addrInfoResult);
+      return {};
+   }
+
+   datagramSocket.data = Sock::socket(addrInfo.data->ai_family, addrInfo.data->ai_socktype, addrInfo.data->ai_protocol);
+   if (datagramSocket.data == Sock::kInvalidSocket) {
+      printf("socket failed with error: %d\n", Sock::System::getLastError());
+      return {};
+   }
+
+   memcpy(&destination, addrInfo.data->ai_addr, sizeof(destination));
+
+   if (IN_MULTICAST(Sock::Endian::networkToHostLong(destination.sin_addr.s_addr))) {
+      int ttl = multicastTtl;
+      int optResult = Sock::setsockopt(datagramSocket.data, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl));
+      if (optResult == Sock::kSocketError) {
+         printf("Unable to set the multicast TTL, error: %d\n", Sock::System::getLastError());
+      }
+   }
+
+   return datagramSocket;
+}
+
+// Collapses dial / slider events for the same control into the most recent one (which keeps its place in the stream),
+// returns the number of events removed. Button events are always kept, since each one is a discrete edge.
+size_t conflateEvents(std::vector<TimedEventPacket>& packets) {
+   static const size_t kMaxControls = 64;
+   uint32_t seenControls[kMaxControls];
+   size_t numSeenControls = 0;
+
+   // Walk backwards so that the first occurrence seen for each control is the latest one
+   size_t writeIndex = packets.size();
+   for (size_t readIndex = packets.size(); readIndex-- > 0;) {
+      const EventPacket& packet = packets[readIndex].event;
+
+      if (packet.type == EventPacket::kDial || packet.type == EventPacket::kSlider) {
+         uint32_t control = (static_cast<uint32_t>(packet.type) << 16) | packet.id;
+         if (std::find(seenControls, seenControls + numSeenControls, control) != seenControls + numSeenControls) {
+            continue;
+         }
+
+         if (numSeenControls < kMaxControls) {
+            seenControls[numSeenControls++] = control;
+         }
+      }
+
+      packets[--writeIndex] = packets[readIndex];
+   }
+
+   packets.erase(packets.begin(), packets.begin() + writeIndex);
+   return writeIndex;
+}
+
+// Removes events for controls outside the subscription, returns the number of events removed
+size_t filterEvents(std::vector<TimedEventPacket>& packets, const uint64_t (&subscriptions)[kNumControlTypes]) {
+   size_t writeIndex = 0;
+   for (size_t readIndex = 0; readIndex < packets.size(); ++readIndex) {
+      if (isSubscribed(subscriptions, packets[readIndex].event)) {
+         packets[writeIndex++] = packets[readIndex];
+      }
+   }
+
+   size_t numRemoved = packets.size() - writeIndex;
+   packets.resize(writeIndex);
+   return numRemoved;
+}
+
+bool hasPendingInput(Sock::Socket socket, std::chrono::microseconds wait) {
+   return pollSocket(socket, POLLIN, wait) != 0;
+}
+
+// Reads whatever the client has sent and decodes any complete requests, returns false if the connection has been closed
+bool receiveRequests(Sock::Socket socket, RequestBuffer& buffer, std::vector<EventPacket>& requests) {
+   ssize_t result = Sock::recv(socket, buffer.writePointer(), buffer.writeCapacity(), 0);
+   if (result == 0) {
+      return false;
+   }
+
+   if (result == Sock::kSocketError) {
+      return Sock::System::getLastError() == Sock::kWouldBlock;
+   }
+
+   buffer.commitWrite(static_cast<size_t>(result));
+   buffer.decodePackets(requests);
+   return true;
+}
+
 } // namespace
 
+struct Server::EventLoop {
+   explicit EventLoop(Server& owningServer) : server(owningServer), waiter(poller) {
+   }
+
+   struct Connection {
+      SocketHandle socket;
+      std::shared_ptr<ThreadData> data;
+      RequestBuffer requestBuffer;
+
+      std::vector<uint8_t> outputBuffer;
+      size_t outputOffset = 0;
+      bool waitingForWrite = false;
+      std::chrono::steady_clock::time_point writeDeadline; // When to give up on a full socket, if waiting for write
+
+      // The state is only sent once the client has introduced itself (or has taken too long to do so)
+      bool stateSent = false;
+      std::chrono::steady_clock::time_point helloDeadline;
+   };
+
+   bool flush(uint64_t id, Connection& connection) {
+      while (connection.outputOffset < connection.outputBuffer.size()) {
+         server.sendCalls.add();
+         ssize_t result = Sock::send(connection.socket.data, connection.outputBuffer.data() + connection.outputOffset, connection.outputBuffer.size() - connection.outputOffset, Sock::kNoSignal);
+         if (result == Sock::kSocketError) {
+            if (Sock::System::getLastError() == Sock::kWouldBlock) {
+               break;
+            }
+
+            // Connection lost
+            return false;
+         }
+
+         server.bytesSent.add(static_cast<uint64_t>(result));
+         connection.data->bytesSent.fetch_add(static_cast<uint64_t>(result), std::memory_order_relaxed);
+
+         connection.outputOffset += result;
+
+         // Any progress resets the send timeout
+         connection.writeDeadline = std::chrono::steady_clock::now() + server.config.sendTimeout;
+      }
+
+      if (connection.outputOffset == connection.outputBuffer.size()) {
+         connection.outputBuffer.clear();
+         connection.outputOffset = 0;
+      }
+
+      // Only ask to be notified about writability while there is something left to write
+      bool needsWrite = !connection.outputBuffer.empty();
+      if (needsWrite != connection.waitingForWrite) {
+         uint32_t interest = Poller::kReadable;
+         if (needsWrite) {
+            interest |= Poller::kWritable;
+         }
+         if (!poller.modify(connection.socket.data, interest, id)) {
+            return false;
+         }
+
+         connection.waitingForWrite = needsWrite;
+         connection.writeDeadline = std::chrono::steady_clock::now() + server.config.sendTimeout;
+      }
+
+      return true;
+   }
+
+   Server& server;
+   Poller poller;
+   Waiter waiter;
+   std::thread thread;
+
+   std::mutex pendingMutex;
+   std::vector<std::pair<uint64_t, Sock::Socket>> pendingSockets;
+
+   std::map<uint64_t, Connection> connections;
+
+   std::vector<TimedEventPacket> packets;
+   std::vector<EventPacket> requests;
+};
+
 Server::Server()
-   : shuttingDown(false), threadCounter(0), globalKontrollerState{} {
+   : Server(Config{}) {
+}
+
+Server::Server(const Config& serverConfig)
+   : config(serverConfig), shuttingDown(false), threadCounter(0), acceptPoller(nullptr), nextEventLoop(0), eventsPublished(metrics.counter("events.published")), eventsSent(metrics.counter("events.sent")), bytesSent(metrics.counter("bytes.sent")), sendCalls(metrics.counter("send.calls")), eventsConflated(metrics.counter("events.conflated")), eventsFiltered(metrics.counter("events.filtered")), datagramsSent(metrics.counter("datagrams.sent")), resyncs(metrics.counter("policy.resyncs")), eventsDropped(metrics.counter("policy.eventsDropped")), slowConsumerDisconnects(metrics.counter("policy.disconnects")), sendTimeouts(metrics.counter("send.timeouts")), samplesPublished(metrics.counter("publish.samples")), ledRequestsReceived(metrics.counter("leds.requests")), ledsSet(metrics.counter("leds.set")), connections(metrics.gauge("connections")), sendLatency(metrics.histogram("latency.captureToSend.us")), connectionBacklog(metrics.histogram("connection.backlog")) {
 }
 
 Server::~Server() {
@@ -192,8 +409,162 @@ Server::~Server() {
 }
 
 bool Server::run() {
-   Kontroller kontroller;
-   initCallbacks(kontroller);
+   KontrollerEventSource source;
+   return run(source);
+}
+
+bool Server::run(EventSource& source) {
+   return run(std::vector<EventSource*> { &source });
+}
+
+bool Server::run(const std::vector<EventSource*>& sources) {
+   if (sources.empty() || sources.size() > kMaxDevices) {
+      printf("Unable to serve %llu devices (at most %llu are supported)\n", static_cast<unsigned long long>(sources.size()), static_cast<unsigned long long>(kMaxDevices));
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(threadDataMutex);
+
+      devices.clear();
+      for (EventSource* source : sources) {
+         devices.emplace_back(new Device(static_cast<uint16_t>(devices.size()), *source, config.eventBufferSize));
+      }
+   }
+
+   // Start from whatever state each source is already in
+   for (std::unique_ptr<Device>& device : devices) {
+      Snapshot initialSnapshot;
+      initialSnapshot.state = device->source.getState();
+      initialSnapshot.sequence = device->eventRing.head();
+      device->snapshot.store(initialSnapshot);
+   }
+
+#if SOCK_SHARED_MEMORY
+   // Declared before the callback guard, so that they outlive the callbacks publishing into them
+   std::unique_ptr<SharedSegmentMapping> sharedMappings[kMaxDevices];
+   if (config.sharedMemoryName) {
+      for (std::unique_ptr<Device>& device : devices) {
+         std::unique_ptr<SharedSegmentMapping>& sharedMapping = sharedMappings[device->index];
+         sharedMapping.reset(new SharedSegmentMapping);
+         if (!sharedMapping->create(getSharedMemoryName(config.sharedMemoryName, device->index).c_str())) {
+            return false;
+         }
+
+         Snapshot initialSnapshot = device->snapshot.load();
+         SharedSegment* segment = sharedMapping->get();
+         SharedSnapshot sharedSnapshot;
+         sharedSnapshot.state = initialSnapshot.state;
+         sharedSnapshot.sequence = initialSnapshot.sequence;
+         segment->snapshot.store(sharedSnapshot);
+         segment->events.initialize(initialSnapshot.sequence);
+         segment->open.store(1, std::memory_order_release);
+
+         device->sharedSegment = segment;
+      }
+   }
+#else
+   if (config.sharedMemoryName) {
+      printf("Shared memory is not supported on this platform\n");
+   }
+#endif
+
+   // Also declared before the callback guard, for the same reason
+   std::unique_ptr<JournalWriter> journals[kMaxDevices];
+   if (config.journalPath) {
+      for (std::unique_ptr<Device>& device : devices) {
+         std::unique_ptr<JournalWriter>& journal = journals[device->index];
+         journal.reset(new JournalWriter);
+
+         Snapshot initialSnapshot = device->snapshot.load();
+         if (!journal->create(getJournalPath(config.journalPath, device->index).c_str(), initialSnapshot.state, initialSnapshot.sequence)) {
+            return false;
+         }
+
+         device->journal = journal.get();
+      }
+   }
+
+   // Stop listening to the sources once we're done, no matter how we got there (and let shared memory readers know)
+   struct CallbackGuard {
+      Server& server;
+
+      ~CallbackGuard() {
+         for (std::unique_ptr<Device>& device : server.devices) {
+            device->source.setButtonCallback({});
+            device->source.setDialCallback({});
+            device->source.setSliderCallback({});
+            device->source.setEventsCallback({});
+
+            if (device->sharedSegment) {
+               device->sharedSegment->open.store(0, std::memory_order_release);
+               wakeSharedSegment(*device->sharedSegment);
+               device->sharedSegment = nullptr;
+            }
+
+            device->journal = nullptr;
+         }
+      }
+   } callbackGuard { *this };
+
+   // Stop sampling before the callback guard closes the shared segments
+   struct SamplerGuard {
+      Server& server;
+      std::atomic_bool stop;
+      std::vector<std::thread> threads;
+
+      ~SamplerGuard() {
+         {
+            std::lock_guard<std::mutex> lock(server.eventMutex);
+            stop = true;
+         }
+         server.samplerCv.notify_all();
+
+         for (std::thread& thread : threads) {
+            thread.join();
+         }
+      }
+   } samplerGuard { *this, { false }, {} };
+
+   // Also stopped before the callback guard runs, so that the devices get control of their LEDs back
+   struct LEDGuard {
+      Server& server;
+      std::atomic_bool stop;
+      std::thread thread;
+
+      ~LEDGuard() {
+         {
+            std::lock_guard<std::mutex> lock(server.ledMutex);
+            stop = true;
+         }
+         server.ledCv.notify_all();
+
+         if (thread.joinable()) {
+            thread.join();
+         }
+      }
+   } ledGuard { *this, { false }, {} };
+
+   // Each device is published from its own thread (the source's callback thread, or its own sampler)
+   for (std::unique_ptr<Device>& device : devices) {
+      if (config.publishInterval.count() > 0) {
+         Device& sampledDevice = *device;
+         samplerGuard.threads.emplace_back([this, &sampledDevice, &samplerGuard]() { runSampler(sampledDevice, samplerGuard.stop); });
+      } else {
+         initCallbacks(*device);
+      }
+   }
+
+   if (config.ledControl) {
+      {
+         std::lock_guard<std::mutex> lock(ledMutex);
+         for (LEDRequests& requests : ledRequests) {
+            requests = LEDRequests();
+         }
+      }
+
+      ledGuard.thread = std::thread([this, &ledGuard]() { runLEDs(ledGuard.stop); });
+   }
 
    // Initialize the socket system
    int initializeResult = Sock::System::initialize();
@@ -204,42 +575,34 @@ bool Server::run() {
    }
 
    {
-      SocketHandle listenSocket = createListenSocket();
+      SocketHandle listenSocket = createListenSocket(config.port);
       if (!listenSocket) {
          return false;
       }
 
-      while (!shuttingDown) {
-         // Wait until a client attempts to connect, or we are shutting down
-         Sock::Socket clientSocket = Sock::kInvalidSocket;
-         while (!shuttingDown && clientSocket == Sock::kInvalidSocket) {
-            clientSocket = Sock::accept(listenSocket.data, nullptr, nullptr);
-
-            if (clientSocket == Sock::kInvalidSocket) {
-               int error = Sock::System::getLastError();
-               if (error != Sock::kWouldBlock) {
-                  printf("accept failed with error: %d\n", error);
-                  return false;
-               }
-
-               std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            }
+      // Datagrams are sent from their own thread, at a cost that doesn't depend on the number of receivers
+      SocketHandle datagramSocket;
+      std::thread datagramThread;
+      if (config.datagramAddress) {
+         sockaddr_in destination = {};
+         datagramSocket = createDatagramSocket(config.datagramAddress, config.multicastTtl, destination);
+         if (!datagramSocket) {
+            return false;
          }
 
-         // Spin off a new thread to manage the connection to the client
-         if (!shuttingDown) {
-            uint64_t newThreadId = 0;
-            {
-               std::lock_guard<std::mutex> lock(threadDataMutex);
-               newThreadId = threadCounter++;
-
-               assert(threadData.count(newThreadId) == 0);
-               threadData[newThreadId] = nullptr;
-            }
+         Sock::Socket socket = datagramSocket.data;
+         datagramThread = std::thread([this, socket, destination]() { sendDatagrams(socket, destination); });
+      }
 
-            std::thread thread([this](uint64_t id, Sock::Socket socket) { manageConnection(id, socket); }, newThreadId, clientSocket);
-            thread.detach();
-         }
+      bool success = config.mode == Mode::kEventLoop ? runEventLoops(listenSocket.data) : runAcceptLoop(listenSocket.data);
+
+      if (datagramThread.joinable()) {
+         shutDown();
+         datagramThread.join();
+      }
+
+      if (!success) {
+         return false;
       }
    }
 
@@ -248,16 +611,6 @@ bool Server::run() {
    {
       std::unique_lock<std::mutex> lock(threadDataMutex);
 
-      kontroller.setButtonCallback({});
-      kontroller.setDialCallback({});
-      kontroller.setSliderCallback({});
-
-      for (auto& pair : threadData) {
-         if (pair.second) {
-            pair.second->cv.notify_all();
-         }
-      }
-
       while (!threadData.empty()) {
          threadDataCv.wait_for(lock, std::chrono::milliseconds(1), [this]() { return threadData.empty(); });
       }
@@ -266,151 +619,1126 @@ bool Server::run() {
    return true;
 }
 
-void Server::shutDown() {
-   shuttingDown = true;
+Server::Stats Server::getStats() const {
+   Stats stats;
+   stats.eventsSent = eventsSent.get();
+   stats.sendCalls = sendCalls.get();
+   stats.eventsConflated = eventsConflated.get();
+   stats.datagramsSent = datagramsSent.get();
+   stats.resyncs = resyncs.get();
+   stats.eventsDropped = eventsDropped.get();
+   stats.slowConsumerDisconnects = slowConsumerDisconnects.get();
+   stats.sendTimeouts = sendTimeouts.get();
+
+   return stats;
 }
 
-void Server::initCallbacks(Kontroller& kontroller) {
-   kontroller.setButtonCallback([this, &kontroller](Kontroller::Button button, bool pressed) {
-      std::lock_guard<std::mutex> lock(threadDataMutex);
-
-      globalKontrollerState = kontroller.getState();
+std::string Server::dumpMetrics() {
+   std::string text = metrics.dump();
+   char line[256];
 
-      ButtonEvent event;
-      event.button = button;
-      event.pressed = pressed;
-
-      for (auto& pair : threadData) {
-         if (!pair.second) {
-            continue;
-         }
+   std::lock_guard<std::mutex> lock(threadDataMutex);
+   for (const auto& pair : threadData) {
+      const ThreadData* data = pair.second.get();
+      if (!data) {
+         continue;
+      }
 
-         {
-            std::lock_guard<std::mutex> eventLock(pair.second->eventMutex);
-            pair.second->buttonEvents.push_back(event);
+      // Summed over every device the connection receives events for
+      uint64_t backlog = 0;
+      for (const std::unique_ptr<Device>& device : devices) {
+         if (isReceiving(*device, *data) && !(data->datagrams && device->index == 0)) {
+            backlog += device->eventRing.head() - data->deviceStreams[device->index].cursor.load(std::memory_order_relaxed);
          }
-
-         pair.second->cv.notify_all();
       }
-   });
 
-   kontroller.setDialCallback([this, &kontroller](Kontroller::Dial dial, float value) {
-      std::lock_guard<std::mutex> lock(threadDataMutex);
+      snprintf(line, sizeof(line), "connection %llu events.sent=%llu bytes.sent=%llu backlog=%llu\n", static_cast<unsigned long long>(pair.first),
+               static_cast<unsigned long long>(data->eventsSent.load(std::memory_order_relaxed)), static_cast<unsigned long long>(data->bytesSent.load(std::memory_order_relaxed)),
+               static_cast<unsigned long long>(backlog));
+      text += line;
+   }
 
-      globalKontrollerState = kontroller.getState();
+   return text;
+}
 
-      DialEvent event;
-      event.dial = dial;
-      event.value = value;
+void Server::shutDown() {
+   shuttingDown = true;
 
-      for (auto& pair : threadData) {
-         if (!pair.second) {
-            continue;
-         }
+   // Taking the event mutex guarantees that no waiter can miss the wake-up (they check for shutdown after registering)
+   std::lock_guard<std::mutex> lock(eventMutex);
+   if (acceptPoller) {
+      acceptPoller->wake();
+   }
+   for (Waiter* waiter : waiters) {
+      waiter->poller.wake();
+   }
+}
 
-         {
-            std::lock_guard<std::mutex> eventLock(pair.second->eventMutex);
-            pair.second->dialEvents.push_back(event);
-         }
+void Server::initCallbacks(Device& device) {
+   // All of a device's controls are published into the same ring, so clients see its events in the order they happened, no matter their type
+   // Events are timestamped as soon as they arrive, so that clients can measure end-to-end latency
+   // Relayed events keep the time they were first captured, so that latency is still measured from the device no matter
+   // how many relays they have been through.
+   bool relayed = device.source.setEventsCallback([this, &device](const EventPacket* packets, size_t numPackets, uint64_t captureTime) {
+      publish(device, device.source.getState(), packets, numPackets, captureTime != 0 ? captureTime : getTimestamp());
+   });
+   if (relayed) {
+      return;
+   }
 
-         pair.second->cv.notify_all();
-      }
+   device.source.setButtonCallback([this, &device](Kontroller::Button button, bool pressed) {
+      uint64_t captureTime = getTimestamp();
+      EventPacket packet = makeButtonPacket(button, pressed);
+      publish(device, device.source.getState(), &packet, 1, captureTime);
    });
 
-   kontroller.setSliderCallback([this, &kontroller](Kontroller::Slider slider, float value) {
-      std::lock_guard<std::mutex> lock(threadDataMutex);
+   device.source.setDialCallback([this, &device](Kontroller::Dial dial, float value) {
+      uint64_t captureTime = getTimestamp();
+      EventPacket packet = makeDialPacket(dial, value);
+      publish(device, device.source.getState(), &packet, 1, captureTime);
+   });
 
-      globalKontrollerState = kontroller.getState();
+   device.source.setSliderCallback([this, &device](Kontroller::Slider slider, float value) {
+      uint64_t captureTime = getTimestamp();
+      EventPacket packet = makeSliderPacket(slider, value);
+      publish(device, device.source.getState(), &packet, 1, captureTime);
+   });
+}
 
-      SliderEvent event;
-      event.slider = slider;
-      event.value = value;
+void Server::runSampler(Device& device, const std::atomic_bool& stop) {
+   Kontroller::State publishedState = device.snapshot.load().state;
+   std::vector<EventPacket> packets;
+   packets.reserve(kNumButtons + kNumGroups * 2);
 
-      for (auto& pair : threadData) {
-         if (!pair.second) {
-            continue;
+   std::chrono::steady_clock::time_point nextSample = std::chrono::steady_clock::now() + config.publishInterval;
+   while (true) {
+      {
+         std::unique_lock<std::mutex> lock(eventMutex);
+         if (samplerCv.wait_until(lock, nextSample, [&stop]() { return stop.load(); })) {
+            break;
          }
+      }
 
-         {
-            std::lock_guard<std::mutex> eventLock(pair.second->eventMutex);
-            pair.second->sliderEvents.push_back(event);
-         }
+      uint64_t captureTime = getTimestamp();
+      Kontroller::State state = device.source.getState();
+
+      packets.clear();
+      forEachChangedControl(publishedState, state, [&packets](EventPacket::Type type, uint16_t id, bool pressed, float value) {
+         packets.push_back(type == EventPacket::kButton ? makeButtonPacket(static_cast<Kontroller::Button>(id), pressed) : makeFloatPacket(type, id, value));
+      });
 
-         pair.second->cv.notify_all();
+      if (!packets.empty()) {
+         publish(device, state, packets.data(), packets.size(), captureTime);
+         samplesPublished.add();
+         publishedState = state;
       }
-   });
+
+      // Don't try to catch up on missed samples, just keep to the interval from here on
+      nextSample += config.publishInterval;
+      std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+      if (nextSample < now) {
+         nextSample = now + config.publishInterval;
+      }
+   }
 }
 
-void Server::manageConnection(uint64_t id, uint64_t uintSocket) {
-   SocketHandle socket(static_cast<Sock::Socket>(uintSocket));
+void Server::runLEDs(const std::atomic_bool& stop) {
+   // Clients own the LEDs from here on, starting with them all off (unless the LEDs are shared with others, in which
+   // case nothing is known about them until a client sets them)
+   uint32_t litLEDs[kMaxDevices] = {};
+   uint32_t knownLEDs[kMaxDevices] = {};
+   for (std::unique_ptr<Device>& device : devices) {
+      if (!device->source.enableLEDControl(true)) {
+         printf("Unable to control the LEDs of device %u\n", static_cast<unsigned int>(device->index));
+      }
 
-   std::shared_ptr<ThreadData> data = std::make_shared<ThreadData>();
-   Kontroller::State localKontrollerState;
+      if (!device->source.ownsLEDs()) {
+         continue;
+      }
 
-   // Register ourselves
-   {
-      std::lock_guard<std::mutex> lock(threadDataMutex);
+      for (uint32_t led = 0; led < 32; ++led) {
+         if (kAllLEDs & (1u << led)) {
+            device->source.setLED(static_cast<Kontroller::LED>(led), false);
+         }
+      }
+      knownLEDs[device->index] = kAllLEDs;
+   }
 
-      if (shuttingDown) {
-         return;
+   std::unique_lock<std::mutex> lock(ledMutex);
+   while (true) {
+      ledCv.wait(lock, [this, &stop]() {
+         return stop || std::any_of(std::begin(ledRequests), std::end(ledRequests), [](const LEDRequests& requests) { return requests.on != 0 || requests.off != 0; });
+      });
+      if (stop) {
+         break;
       }
 
-      assert(threadData.count(id) == 1 && threadData[id] == nullptr); // Space should be reserved for us, but no data allocated yet
-      threadData[id] = data;
-      localKontrollerState = globalKontrollerState;
+      LEDRequests requests[kMaxDevices];
+      std::copy(std::begin(ledRequests), std::end(ledRequests), std::begin(requests));
+      std::fill(std::begin(ledRequests), std::end(ledRequests), LEDRequests());
+      lock.unlock();
+
+      // Only LEDs that actually change (or that haven't been set yet) are written to the device
+      for (std::unique_ptr<Device>& device : devices) {
+         const LEDRequests& deviceRequests = requests[device->index];
+         uint32_t& lit = litLEDs[device->index];
+         uint32_t& known = knownLEDs[device->index];
+         uint32_t requested = deviceRequests.on | deviceRequests.off;
+         uint32_t changed = (deviceRequests.on & ~lit) | (deviceRequests.off & lit) | (requested & ~known);
+
+         for (uint32_t led = 0; led < 32; ++led) {
+            if (changed & (1u << led)) {
+               device->source.setLED(static_cast<Kontroller::LED>(led), (deviceRequests.on & (1u << led)) != 0);
+               ledsSet.add();
+            }
+         }
+         lit = (lit & ~requested) | deviceRequests.on;
+         known |= requested;
+      }
+
+      // Anything requested before the interval is up is merged into the next batch
+      lock.lock();
+      if (ledCv.wait_for(lock, config.ledUpdateInterval, [&stop]() { return stop.load(); })) {
+         break;
+      }
    }
+   lock.unlock();
 
-   int tcpNoDelay = 1;
-   int optResult = Sock::setsockopt(socket.data, IPPROTO_TCP, TCP_NODELAY, &tcpNoDelay, sizeof(tcpNoDelay));
-   if (optResult == Sock::kSocketError) {
-      printf("Unable to disable the Nagle algorithm, connection may be jittery!\n");
+   for (std::unique_ptr<Device>& device : devices) {
+      device->source.enableLEDControl(false);
    }
+}
 
-   if (sendInitialState(socket.data, localKontrollerState)) {
-      std::vector<ButtonEvent> buttonEvents;
-      std::vector<DialEvent> dialEvents;
-      std::vector<SliderEvent> sliderEvents;
+void Server::publish(Device& device, const Kontroller::State& state, const EventPacket* packets, size_t numPackets, uint64_t captureTime) {
+   // Only ever called from the device's publishing thread (its source's callback thread, or its sampler), so the sequence
+   // number can't change before publishing
+   // Constant cost no matter how many clients are connected - they all read from the same ring
+   for (size_t i = 0; i < numPackets; ++i) {
+      TimedEventPacket timedPacket;
+      timedPacket.header.type = EventPacket::kTimedEvent;
+      timedPacket.header.id = 0;
+      timedPacket.header.value = static_cast<uint32_t>(device.eventRing.head());
+      timedPacket.setCaptureTime(captureTime);
+      timedPacket.event = packets[i];
+
+      device.eventRing.publish(timedPacket);
+
+      if (device.sharedSegment) {
+         // Readers on the same host see the event without going through the network stack
+         device.sharedSegment->events.publish(timedPacket);
+      }
 
-      while (!shuttingDown) {
-         // Wait for events, copy them to local storage
-         {
-            std::unique_lock<std::mutex> lock(data->eventMutex);
-            data->cv.wait(lock, [this, &data]() {
-               return shuttingDown || !data->buttonEvents.empty() || !data->dialEvents.empty() || !data->sliderEvents.empty();
-            });
+      if (device.journal) {
+         device.journal->append(timedPacket);
+      }
+   }
+   eventsPublished.add(numPackets);
 
-            if (shuttingDown) {
-               break;
-            }
+   // The state only has to be stored once for the whole batch
+   Snapshot newSnapshot;
+   newSnapshot.state = state;
+   newSnapshot.sequence = device.eventRing.head();
+   device.snapshot.store(newSnapshot);
 
-            buttonEvents = data->buttonEvents;
-            data->buttonEvents.clear();
+   if (device.sharedSegment) {
+      SharedSnapshot sharedSnapshot;
+      sharedSnapshot.state = state;
+      sharedSnapshot.sequence = newSnapshot.sequence;
+      device.sharedSegment->snapshot.store(sharedSnapshot);
 
-            dialEvents = data->dialEvents;
-            data->dialEvents.clear();
+      wakeSharedSegment(*device.sharedSegment);
+   }
 
-            sliderEvents = data->sliderEvents;
-            data->sliderEvents.clear();
-         }
+   wakeWaiters(device);
+}
 
-         // Send events to client
-         bool success = sendEvents(socket.data, buttonEvents, dialEvents, sliderEvents);
-         buttonEvents.clear();
-         dialEvents.clear();
-         sliderEvents.clear();
+bool Server::collectEvents(const Device& device, ThreadData& data, std::vector<TimedEventPacket>& packets) {
+   ThreadData::DeviceStream& stream = data.deviceStreams[device.index];
+   uint64_t cursor = stream.cursor.load(std::memory_order_relaxed);
+   uint64_t maxBatchSize = std::max<uint64_t>(config.maxBatchSize, 1);
+   uint64_t available = std::min<uint64_t>(std::min<uint64_t>(device.eventRing.head() - cursor, device.eventRing.capacity()), maxBatchSize);
 
-         if (!success) {
-            break;
-         }
-      }
+   bool overrun = false;
+   packets.resize(static_cast<size_t>(available));
+   packets.resize(device.eventRing.read(cursor, packets.data(), packets.size(), overrun));
+
+   if (overrun) {
+      // Events were overwritten before we got to them, the connection has to skip ahead to the latest state
+      stream.overrun = true;
+      packets.clear();
+
+      return false;
    }
 
-   // Unregister ourselves
-   {
-      std::lock_guard<std::mutex> lock(threadDataMutex);
+   stream.cursor.store(cursor, std::memory_order_relaxed);
 
-      assert(threadData.count(id) == 1); // Somehow we're not in the map?
-      threadData.erase(id);
+   // Filtered before conflating, so that unsubscribed controls don't take up any of the conflation slots
+   if (data.filtered) {
+      uint64_t subscriptions[kNumControlTypes];
+      for (size_t type = 0; type < kNumControlTypes; ++type) {
+         subscriptions[type] = data.subscriptions[type].load(std::memory_order_relaxed);
+      }
+      eventsFiltered.add(filterEvents(packets, subscriptions));
+   }
+
+   if (data.conflate) {
+      eventsConflated.add(conflateEvents(packets));
+   }
+
+   return true;
+}
+
+size_t Server::appendState(std::vector<uint8_t>& buffer, const Device& device, ThreadData& data) {
+   ThreadData::DeviceStream& stream = data.deviceStreams[device.index];
+   Snapshot currentSnapshot = device.snapshot.load();
+   stream.cursor.store(currentSnapshot.sequence, std::memory_order_relaxed);
+
+   // Dial / slider changes after the state are encoded relative to it
+   stream.compactEncoder.reset();
+
+   if (data.protocolVersion < kMinSnapshotVersion) {
+      return appendInitialState(buffer, currentSnapshot.state);
+   }
+
+   appendDeviceSwitch(buffer, data.currentDevice, device.index);
+
+   SnapshotPacket packet = encodeSnapshot(currentSnapshot.state);
+   const uint8_t* bytes = reinterpret_cast<const uint8_t*>(&packet);
+   buffer.insert(buffer.end(), bytes, bytes + sizeof(packet));
+
+   if (!data.datagrams || device.index != 0) {
+      return 1;
+   }
+
+   // Lets the client line up the datagrams it has received with the state
+   EventPacket syncPacket;
+   syncPacket.type = EventPacket::kSyncSequence;
+   syncPacket.id = 0;
+   syncPacket.value = static_cast<uint32_t>(currentSnapshot.sequence);
+   appendPacket(buffer, syncPacket);
+
+   return 2;
+}
+
+size_t Server::appendStates(std::vector<uint8_t>& buffer, ThreadData& data) {
+   size_t numPackets = 0;
+
+   for (const std::unique_ptr<Device>& device : devices) {
+      if (isReceiving(*device, data)) {
+         data.deviceStreams[device->index].snapshotRequested = false;
+         numPackets += appendState(buffer, *device, data);
+      }
+   }
+
+   return numPackets;
+}
+
+size_t Server::appendPending(std::vector<uint8_t>& buffer, uint64_t id, ThreadData& data, std::vector<TimedEventPacket>& packets) {
+   size_t numPackets = 0;
+
+   for (const std::unique_ptr<Device>& devicePointer : devices) {
+      const Device& device = *devicePointer;
+      ThreadData::DeviceStream& stream = data.deviceStreams[device.index];
+      if (!isReceiving(device, data)) {
+         continue;
+      }
+
+      if (stream.snapshotRequested.exchange(false)) {
+         numPackets += appendState(buffer, device, data);
+      }
+
+      if (!needsEvents(device, data)) {
+         continue;
+      }
+
+      uint64_t backlog = device.eventRing.head() - stream.cursor;
+      connectionBacklog.record(backlog);
+
+      // Connections that have fallen too far behind are dealt with according to the slow consumer policy
+      bool caughtUp = backlog <= getMaxBacklog(device) || dropOldestEvents(device, data);
+      if (caughtUp && collectEvents(device, data, packets)) {
+         if (packets.empty()) {
+            continue;
+         }
+
+         uint64_t now = getTimestamp();
+         uint64_t captureTime = packets.front().getCaptureTime();
+         sendLatency.record(now > captureTime ? now - captureTime : 0);
+
+         appendDeviceSwitch(buffer, data.currentDevice, device.index);
+         if (data.compact) {
+            appendCompactFrames(buffer, packets.data(), packets.size(), stream.compactEncoder);
+         } else {
+            appendPackets(buffer, packets, data.protocolVersion >= kMinTimedEventVersion);
+         }
+         numPackets += packets.size();
+      } else if (config.slowConsumerPolicy == SlowConsumerPolicy::kDisconnect) {
+         printf("Connection %llu fell behind, disconnecting\n", static_cast<unsigned long long>(id));
+         slowConsumerDisconnects.add();
+         data.disconnect = true;
+         break;
+      } else {
+         printf("Connection %llu fell behind, resending state\n", static_cast<unsigned long long>(id));
+         resyncs.add();
+         numPackets += appendState(buffer, device, data);
+      }
+   }
+
+   return numPackets;
+}
+
+uint64_t Server::getMaxBacklog(const Device& device) const {
+   return config.maxBacklog > 0 ? std::min<uint64_t>(config.maxBacklog, device.eventRing.capacity()) : device.eventRing.capacity();
+}
+
+bool Server::dropOldestEvents(const Device& device, ThreadData& data) {
+   if (config.slowConsumerPolicy != SlowConsumerPolicy::kDropOldest) {
+      return false;
+   }
+
+   // Skip ahead, keeping as many of the latest events as allowed (if they get overwritten before they can be read, the
+   // state is sent instead)
+   ThreadData::DeviceStream& stream = data.deviceStreams[device.index];
+   uint64_t cursor = stream.cursor.load(std::memory_order_relaxed);
+   uint64_t newCursor = device.eventRing.head() - getMaxBacklog(device);
+   stream.cursor.store(newCursor, std::memory_order_relaxed);
+   eventsDropped.add(newCursor - cursor);
+
+   // Only clients that get sequence numbers and ask for the state when they find a gap can make up for the dropped events
+   // themselves. Everyone else gets the state, or a dropped button edge would leave them wrong until the next resync:
+   // clients older than timed events see no sequence numbers, conflating clients ignore gaps on purpose, and filtering
+   // leaves gaps that can't be told apart from dropped events.
+   bool recoversFromGaps = data.protocolVersion >= kMinTimedEventVersion && !data.conflate && !data.filtered;
+   if (!recoversFromGaps) {
+      stream.snapshotRequested = true;
+   }
+
+   return true;
+}
+
+void Server::handleRequest(ThreadData& data, const EventPacket& request) {
+   switch (request.type) {
+   case EventPacket::kHello:
+      data.protocolVersion = request.id;
+      data.conflate = (request.value & kHelloConflate) != 0;
+      data.datagrams = config.datagramAddress && request.id >= kMinTimedDatagramVersion && (request.value & kHelloDatagrams) != 0;
+      data.compact = request.id >= kMinCompactVersion && (request.value & kHelloCompact) != 0;
+      break;
+   case EventPacket::kSnapshotRequest:
+      if (request.id < kMaxDevices) {
+         data.deviceStreams[request.id].snapshotRequested = true;
+      }
+      break;
+   case EventPacket::kSelectDevices: {
+      if (data.protocolVersion < kMinDeviceVersion) {
+         break;
+      }
+
+      // Newly selected devices start off with their state
+      uint32_t previousMask = data.deviceMask.exchange(request.value);
+      uint32_t addedMask = request.value & ~previousMask;
+      for (size_t device = 0; device < kMaxDevices; ++device) {
+         if (addedMask & (1u << device)) {
+            data.deviceStreams[device].snapshotRequested = true;
+         }
+      }
+      break;
+   }
+   case EventPacket::kSetLEDs:
+   case EventPacket::kClearLEDs: {
+      if (data.protocolVersion < kMinLEDVersion || !config.ledControl || request.id >= devices.size()) {
+         break;
+      }
+
+      uint32_t mask = request.value & kAllLEDs;
+      {
+         std::lock_guard<std::mutex> lock(ledMutex);
+         LEDRequests& requests = ledRequests[request.id];
+         if (request.type == EventPacket::kSetLEDs) {
+            requests.on |= mask;
+            requests.off &= ~mask;
+         } else {
+            requests.off |= mask;
+            requests.on &= ~mask;
+         }
+      }
+      ledCv.notify_one();
+      ledRequestsReceived.add();
+      break;
+   }
+   case EventPacket::kSubscribe: {
+      uint16_t type = request.id & 0xFF;
+      uint16_t word = request.id >> 8;
+      if (data.protocolVersion < kMinSubscribeVersion || type < EventPacket::kButton || type > EventPacket::kSlider || word > 1) {
+         break;
+      }
+
+      std::atomic<uint64_t>& subscription = data.subscriptions[type - EventPacket::kButton];
+      uint64_t wordMask = 0xFFFFFFFFull << (word * 32);
+      uint64_t previous = subscription.load(std::memory_order_relaxed);
+      uint64_t updated = (previous & ~wordMask) | (static_cast<uint64_t>(request.value) << (word * 32));
+      subscription.store(updated, std::memory_order_relaxed);
+
+      bool filtered = false;
+      for (const std::atomic<uint64_t>& typeSubscription : data.subscriptions) {
+         filtered = filtered || typeSubscription.load(std::memory_order_relaxed) != kAllControls;
+      }
+      data.filtered = filtered;
+
+      // Controls that were filtered out may have changed in the meantime, so newly subscribed ones start off with the state
+      if ((updated & ~previous) != 0) {
+         uint32_t deviceMask = data.deviceMask.load(std::memory_order_relaxed);
+         for (size_t device = 0; device < kMaxDevices; ++device) {
+            if (deviceMask & (1u << device)) {
+               data.deviceStreams[device].snapshotRequested = true;
+            }
+         }
+      }
+      break;
+   }
+   default:
+      printf("Ignoring unknown request type: %u\n", static_cast<unsigned int>(request.type));
+      break;
+   }
+}
+
+bool Server::isReceiving(const Device& device, const ThreadData& data) const {
+   return (data.deviceMask.load(std::memory_order_relaxed) & (1u << device.index)) != 0;
+}
+
+bool Server::needsEvents(const Device& device, const ThreadData& data) const {
+   // Clients receiving datagrams only get device 0's state over TCP
+   if (data.datagrams && device.index == 0) {
+      return false;
+   }
+
+   return isReceiving(device, data) && device.eventRing.head() != data.deviceStreams[device.index].cursor;
+}
+
+bool Server::needsEvents(const ThreadData& data) const {
+   for (const std::unique_ptr<Device>& device : devices) {
+      if (needsEvents(*device, data)) {
+         return true;
+      }
+   }
+
+   return false;
+}
+
+void Server::manageConnection(uint64_t id, uint64_t uintSocket) {
+   SocketHandle socket(static_cast<Sock::Socket>(uintSocket));
+
+   std::shared_ptr<ThreadData> data = std::make_shared<ThreadData>();
+
+   // Register ourselves
+   {
+      std::lock_guard<std::mutex> lock(threadDataMutex);
+
+      if (shuttingDown) {
+         return;
+      }
+
+      assert(threadData.count(id) == 1 && threadData[id] == nullptr); // Space should be reserved for us, but no data allocated yet
+      threadData[id] = data;
+      connections.add(1);
+   }
+
+   // Sends are made non-blocking, so that a client that stops reading can be timed out
+   unsigned long nonBlocking = 1;
+   int ioctlResult = Sock::ioctl(socket.data, FIONBIO, &nonBlocking);
+   if (ioctlResult == Sock::kSocketError) {
+      printf("ioctl failed with error: %d\n", Sock::System::getLastError());
+   }
+
+   int tcpNoDelay = 1;
+   int optResult = Sock::setsockopt(socket.data, IPPROTO_TCP, TCP_NODELAY, &tcpNoDelay, sizeof(tcpNoDelay));
+   if (optResult == Sock::kSocketError) {
+      printf("Unable to disable the Nagle algorithm, connection may be jittery!\n");
+   }
+
+   RequestBuffer requestBuffer;
+   std::vector<EventPacket> requests;
+   bool connected = ioctlResult != Sock::kSocketError;
+
+   // Give the client a moment to introduce itself, so that the state can be sent in a format it understands
+   std::chrono::steady_clock::time_point helloDeadline = std::chrono::steady_clock::now() + config.helloTimeout;
+   while (connected && data->protocolVersion == 0 && !shuttingDown) {
+      auto remaining = std::chrono::duration_cast<std::chrono::microseconds>(helloDeadline - std::chrono::steady_clock::now());
+      if (remaining.count() <= 0 || !hasPendingInput(socket.data, remaining)) {
+         break;
+      }
+
+      connected = receiveRequests(socket.data, requestBuffer, requests);
+      for (const EventPacket& request : requests) {
+         handleRequest(*data, request);
+      }
+      requests.clear();
+   }
+
+   // Events and requests from the client are waited for together, so that requests are handled as soon as they arrive
+   Poller poller;
+   Waiter waiter(poller);
+   if (connected && (!poller || !poller.add(socket.data, Poller::kReadable, id))) {
+      printf("Unable to watch connection socket, error: %d\n", Sock::System::getLastError());
+      connected = false;
+   }
+
+   // Everything drained in one wake-up is serialized into this buffer, and written with a single send()
+   std::vector<uint8_t> outputBuffer;
+   if (connected && sendBuffer(socket.data, outputBuffer, appendStates(outputBuffer, *data), *data)) {
+      std::vector<TimedEventPacket> packets;
+      std::vector<Poller::Event> events;
+      addWaiter(waiter);
+      setWaiterDevices(waiter, data->deviceMask);
+
+      while (!shuttingDown) {
+         // Only block if there is nothing left to send
+         if (!poller.wait(events, needsEvents(*data) ? 0 : -1)) {
+            printf("Connection wait failed with error: %d\n", Sock::System::getLastError());
+            break;
+         }
+
+         if (shuttingDown) {
+            break;
+         }
+
+         if (!events.empty()) {
+            if (!receiveRequests(socket.data, requestBuffer, requests)) {
+               break;
+            }
+
+            for (const EventPacket& request : requests) {
+               handleRequest(*data, request);
+            }
+            requests.clear();
+
+            // Follow the client's selection, before looking for events from newly selected devices
+            if (waiter.deviceMask != data->deviceMask) {
+               setWaiterDevices(waiter, data->deviceMask);
+            }
+         }
+
+         // Cleared before looking for events, so that any event published from here on results in another wake-up
+         waiter.wakePending = false;
+
+         // Send events to client (or the whole state, if requested or we fell too far behind)
+         size_t numPackets = appendPending(outputBuffer, id, *data, packets);
+         if (data->disconnect) {
+            break;
+         }
+         if (numPackets > 0 && !sendBuffer(socket.data, outputBuffer, numPackets, *data)) {
+            break;
+         }
+      }
+
+      removeWaiter(waiter);
+   }
+
+   // Unregister ourselves
+   {
+      std::lock_guard<std::mutex> lock(threadDataMutex);
+
+      assert(threadData.count(id) == 1); // Somehow we're not in the map?
+      threadData.erase(id);
+      connections.add(-1);
+   }
+}
+
+void Server::sendDatagrams(uint64_t uintSocket, const sockaddr_in& destination) {
+   Sock::Socket socket = static_cast<Sock::Socket>(uintSocket);
+
+   static const size_t kMaxDatagramEvents = (kMaxDatagramSize - sizeof(TimedDatagramHeader)) / sizeof(EventPacket);
+   std::vector<TimedEventPacket> packets;
+   std::vector<uint8_t> buffer;
+
+   Poller poller;
+   if (!poller) {
+      printf("Unable to create datagram poller\n");
+      return;
+   }
+   Waiter waiter(poller);
+   std::vector<Poller::Event> events;
+   addWaiter(waiter);
+   setWaiterDevices(waiter, 1);
+
+   // Only device 0 is sent, datagrams don't say which device they're for
+   const BroadcastRing<TimedEventPacket>& eventRing = devices[0]->eventRing;
+   uint64_t cursor = eventRing.head();
+
+   while (!shuttingDown) {
+      // Wait for events, sending a heartbeat if there haven't been any for a while (so that receivers can tell if they
+      // missed the last few)
+      if (eventRing.head() == cursor && !poller.wait(events, static_cast<int>(kHeartbeatInterval.count()))) {
+         printf("Datagram wait failed with error: %d\n", Sock::System::getLastError());
+         break;
+      }
+      waiter.wakePending = false;
+
+      if (shuttingDown) {
+         break;
+      }
+
+      do {
+         bool overrun = false;
+         packets.resize(kMaxDatagramEvents);
+         packets.resize(eventRing.read(cursor, packets.data(), packets.size(), overrun));
+
+         if (overrun) {
+            // Receivers will notice the gap and ask for the state over TCP
+            printf("Datagram sender fell behind, skipping ahead\n");
+            cursor = eventRing.head();
+            continue;
+         }
+
+         // Every event in the datagram goes with the capture time of the first one (heartbeats have none)
+         TimedDatagramHeader header;
+         header.header.type = EventPacket::kTimedDatagram;
+         header.header.id = static_cast<uint16_t>(packets.size());
+         header.header.value = static_cast<uint32_t>(cursor - packets.size());
+         header.setCaptureTime(packets.empty() ? 0 : packets.front().getCaptureTime());
+         TimedDatagramHeader networkHeader = hostToNetwork(header);
+         const uint8_t* headerBytes = reinterpret_cast<const uint8_t*>(&networkHeader);
+         buffer.insert(buffer.end(), headerBytes, headerBytes + sizeof(networkHeader));
+         appendPackets(buffer, packets, false);
+
+         ssize_t result = Sock::sendto(socket, buffer.data(), buffer.size(), 0, reinterpret_cast<const sockaddr*>(&destination), sizeof(destination));
+         if (result == Sock::kSocketError) {
+            printf("sendto failed with error: %d\n", Sock::System::getLastError());
+         } else {
+            datagramsSent.add();
+            bytesSent.add(static_cast<uint64_t>(result));
+         }
+         buffer.clear();
+      } while (eventRing.head() != cursor && !shuttingDown);
+   }
+
+   removeWaiter(waiter);
+}
+
+bool Server::runAcceptLoop(uint64_t uintListenSocket) {
+   Sock::Socket listenSocket = static_cast<Sock::Socket>(uintListenSocket);
+
+   // Wait for connections with the poller rather than polling accept(), shutDown() wakes it up
+   std::unique_ptr<Poller> poller(new Poller);
+   if (!*poller || !poller->add(listenSocket, Poller::kReadable, kListenToken)) {
+      printf("Unable to watch listen socket, error: %d\n", Sock::System::getLastError());
+      return false;
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(eventMutex);
+      acceptPoller = poller.get();
+   }
+
+   bool success = true;
+   std::vector<Poller::Event> events;
+   while (success && !shuttingDown) {
+      if (!poller->wait(events, -1)) {
+         printf("Accept loop wait failed with error: %d\n", Sock::System::getLastError());
+         success = false;
+         break;
+      }
+
+      // Drain the whole accept backlog
+      while (!shuttingDown) {
+         Sock::Socket clientSocket = Sock::accept(listenSocket, nullptr, nullptr);
+         if (clientSocket == Sock::kInvalidSocket) {
+            int error = Sock::System::getLastError();
+            if (error != Sock::kWouldBlock) {
+               printf("accept failed with error: %d\n", error);
+               success = false;
+            }
+
+            break;
+         }
+
+         // Spin off a new thread to manage the connection to the client
+         uint64_t newThreadId = 0;
+         {
+            std::lock_guard<std::mutex> lock(threadDataMutex);
+            newThreadId = threadCounter++;
+
+            assert(threadData.count(newThreadId) == 0);
+            threadData[newThreadId] = nullptr;
+         }
+
+         std::thread thread([this](uint64_t id, Sock::Socket socket) { manageConnection(id, socket); }, newThreadId, clientSocket);
+         thread.detach();
+      }
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(eventMutex);
+      acceptPoller = nullptr;
+   }
+
+   return success;
+}
+
+bool Server::sendBuffer(uint64_t uintSocket, std::vector<uint8_t>& buffer, size_t numEvents, ThreadData& data) {
+   uint64_t numSendCalls = 0;
+   uint64_t numBytes = buffer.size();
+   bool timedOut = false;
+   bool success = sendData(static_cast<Sock::Socket>(uintSocket), buffer.data(), buffer.size(), config.sendTimeout, numSendCalls, timedOut);
+   buffer.clear();
+
+   if (timedOut) {
+      printf("Send timed out, disconnecting\n");
+      sendTimeouts.add();
+   }
+
+   bytesSent.add(numBytes);
+   eventsSent.add(numEvents);
+   sendCalls.add(numSendCalls);
+   data.eventsSent.fetch_add(numEvents, std::memory_order_relaxed);
+   data.bytesSent.fetch_add(numBytes, std::memory_order_relaxed);
+
+   return success;
+}
+
+bool Server::runEventLoops(uint64_t listenSocket) {
+   {
+      std::lock_guard<std::mutex> lock(eventMutex);
+
+      int numEventLoops = std::max(config.numEventLoops, 1);
+      for (int i = 0; i < numEventLoops; ++i) {
+         std::unique_ptr<EventLoop> loop(new EventLoop(*this));
+         if (!loop->poller) {
+            printf("Unable to create event loop poller\n");
+            eventLoops.clear();
+            return false;
+         }
+
+         waiters.push_back(&loop->waiter);
+         eventLoops.push_back(std::move(loop));
+      }
+   }
+
+   // The calling thread runs the first loop (which also accepts new connections), the rest get their own threads
+   for (size_t i = 1; i < eventLoops.size(); ++i) {
+      EventLoop& loop = *eventLoops[i];
+      loop.thread = std::thread([this, &loop]() { runEventLoop(loop, Sock::kInvalidSocket); });
+   }
+
+   bool success = runEventLoop(*eventLoops[0], listenSocket);
+
+   shutDown();
+   for (size_t i = 1; i < eventLoops.size(); ++i) {
+      eventLoops[i]->thread.join();
+   }
+
+   {
+      std::lock_guard<std::mutex> lock(eventMutex);
+      for (std::unique_ptr<EventLoop>& loop : eventLoops) {
+         waiters.erase(std::find(waiters.begin(), waiters.end(), &loop->waiter));
+      }
+      eventLoops.clear();
+   }
+
+   return success;
+}
+
+bool Server::runEventLoop(EventLoop& loop, uint64_t uintListenSocket) {
+   Sock::Socket listenSocket = static_cast<Sock::Socket>(uintListenSocket);
+   if (listenSocket != Sock::kInvalidSocket && !loop.poller.add(listenSocket, Poller::kReadable, kListenToken)) {
+      printf("Unable to watch listen socket, error: %d\n", Sock::System::getLastError());
+      return false;
+   }
+
+   bool success = true;
+   std::vector<Poller::Event> events;
+   std::vector<std::pair<uint64_t, Sock::Socket>> newSockets;
+   int timeout = -1;
+
+   while (!shuttingDown) {
+      if (!loop.poller.wait(events, timeout)) {
+         printf("Event loop wait failed with error: %d\n", Sock::System::getLastError());
+         success = false;
+         break;
+      }
+
+      // Take ownership of connections accepted by another loop
+      {
+         std::lock_guard<std::mutex> lock(loop.pendingMutex);
+         newSockets.swap(loop.pendingSockets);
+      }
+      for (const auto& pair : newSockets) {
+         addConnection(loop, pair.first, pair.second);
+      }
+      newSockets.clear();
+
+      for (const Poller::Event& event : events) {
+         if (event.token == kListenToken) {
+            if (!acceptConnections(loop, listenSocket)) {
+               success = false;
+               shuttingDown = true;
+            }
+            continue;
+         }
+
+         auto location = loop.connections.find(event.token);
+         if (location == loop.connections.end()) {
+            continue;
+         }
+
+         bool connected = true;
+         if (event.events & Poller::kReadable) {
+            connected = receiveRequests(location->second.socket.data, location->second.requestBuffer, loop.requests);
+            for (const EventPacket& request : loop.requests) {
+               handleRequest(*location->second.data, request);
+            }
+            loop.requests.clear();
+         }
+         if (connected && (event.events & Poller::kWritable)) {
+            connected = loop.flush(event.token, location->second);
+         }
+
+         if (!connected) {
+            removeConnection(loop, event.token);
+         }
+      }
+
+      // Clear the flag before pumping, so that any event published from here on results in another wake-up
+      loop.waiter.wakePending = false;
+      timeout = pumpConnections(loop);
+   }
+
+   while (!loop.connections.empty()) {
+      removeConnection(loop, loop.connections.begin()->first);
+   }
+   setWaiterDevices(loop.waiter, 0);
+
+   {
+      std::lock_guard<std::mutex> lock(loop.pendingMutex);
+      for (const auto& pair : loop.pendingSockets) {
+         SocketHandle socket(pair.second);
+      }
+      loop.pendingSockets.clear();
+   }
+
+   if (listenSocket != Sock::kInvalidSocket) {
+      loop.poller.remove(listenSocket);
+   }
+
+   return success;
+}
+
+bool Server::acceptConnections(EventLoop& loop, uint64_t uintListenSocket) {
+   Sock::Socket listenSocket = static_cast<Sock::Socket>(uintListenSocket);
+
+   // Drain the whole accept backlog
+   while (!shuttingDown) {
+      Sock::Socket clientSocket = Sock::accept(listenSocket, nullptr, nullptr);
+      if (clientSocket == Sock::kInvalidSocket) {
+         int error = Sock::System::getLastError();
+         if (error != Sock::kWouldBlock) {
+            printf("accept failed with error: %d\n", error);
+            return false;
+         }
+
+         break;
+      }
+
+      uint64_t newConnectionId = 0;
+      {
+         std::lock_guard<std::mutex> lock(threadDataMutex);
+         newConnectionId = threadCounter++;
+      }
+
+      // Distribute connections between the loops in a round-robin fashion
+      EventLoop& targetLoop = *eventLoops[nextEventLoop];
+      nextEventLoop = (nextEventLoop + 1) % eventLoops.size();
+
+      if (&targetLoop == &loop) {
+         addConnection(loop, newConnectionId, clientSocket);
+      } else {
+         {
+            std::lock_guard<std::mutex> lock(targetLoop.pendingMutex);
+            targetLoop.pendingSockets.emplace_back(newConnectionId, clientSocket);
+         }
+
+         targetLoop.poller.wake();
+      }
+   }
+
+   return true;
+}
+
+void Server::addConnection(EventLoop& loop, uint64_t id, uint64_t uintSocket) {
+   SocketHandle socket(static_cast<Sock::Socket>(uintSocket));
+
+   // Accepted sockets don't inherit the non-blocking flag on every platform
+   unsigned long nonBlocking = 1;
+   int ioctlResult = Sock::ioctl(socket.data, FIONBIO, &nonBlocking);
+   if (ioctlResult == Sock::kSocketError) {
+      printf("ioctl failed with error: %d\n", Sock::System::getLastError());
+      return;
+   }
+
+   int tcpNoDelay = 1;
+   int optResult = Sock::setsockopt(socket.data, IPPROTO_TCP, TCP_NODELAY, &tcpNoDelay, sizeof(tcpNoDelay));
+   if (optResult == Sock::kSocketError) {
+      printf("Unable to disable the Nagle algorithm, connection may be jittery!\n");
+   }
+
+   if (!loop.poller.add(socket.data, Poller::kReadable, id)) {
+      printf("Unable to watch client socket, error: %d\n", Sock::System::getLastError());
+      return;
+   }
+
+   EventLoop::Connection connection;
+   connection.socket = std::move(socket);
+   connection.data = std::make_shared<ThreadData>();
+
+   // Register the connection
+   {
+      std::lock_guard<std::mutex> lock(threadDataMutex);
+
+      assert(threadData.count(id) == 0);
+      threadData[id] = connection.data;
+      connections.add(1);
+   }
+
+   // The state is sent by pumpConnections(), once the client has introduced itself
+   connection.helloDeadline = std::chrono::steady_clock::now() + config.helloTimeout;
+   loop.connections.emplace(id, std::move(connection));
+}
+
+void Server::removeConnection(EventLoop& loop, uint64_t id) {
+   auto location = loop.connections.find(id);
+   if (location == loop.connections.end()) {
+      return;
+   }
+
+   loop.poller.remove(location->second.socket.data);
+   loop.connections.erase(location);
+
+   // Unregister the connection
+   {
+      std::lock_guard<std::mutex> lock(threadDataMutex);
+
+      assert(threadData.count(id) == 1);
+      threadData.erase(id);
+      connections.add(-1);
+   }
+}
+
+int Server::pumpConnections(EventLoop& loop) {
+   int timeout = -1;
+   std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+   // The loop is woken up for every device that any of its connections has selected
+   uint32_t deviceMask = 0;
+
+   for (auto itr = loop.connections.begin(); itr != loop.connections.end();) {
+      uint64_t id = itr->first;
+      EventLoop::Connection& connection = itr->second;
+      ++itr;
+
+      deviceMask |= connection.data->deviceMask.load(std::memory_order_relaxed);
+
+      if (connection.waitingForWrite) {
+         // Give up on clients that have stopped reading
+         if (now >= connection.writeDeadline) {
+            printf("Connection %llu send timed out, disconnecting\n", static_cast<unsigned long long>(id));
+            sendTimeouts.add();
+            removeConnection(loop, id);
+            continue;
+         }
+
+         int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(connection.writeDeadline - now).count()) + 1;
+         timeout = timeout < 0 ? remaining : std::min(timeout, remaining);
+      }
+
+      size_t numPackets = 0;
+      if (!connection.stateSent) {
+         // Wait for the client's hello (up to a point) before sending the state
+         if (connection.data->protocolVersion == 0 && now < connection.helloDeadline) {
+            int remaining = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(connection.helloDeadline - now).count()) + 1;
+            timeout = timeout < 0 ? remaining : std::min(timeout, remaining);
+            continue;
+         }
+
+         numPackets = appendStates(connection.outputBuffer, *connection.data);
+         connection.stateSent = true;
+      } else if (!connection.waitingForWrite) {
+         numPackets = appendPending(connection.outputBuffer, id, *connection.data, loop.packets);
+
+         if (connection.data->disconnect) {
+            removeConnection(loop, id);
+            continue;
+         }
+      }
+
+      // If the socket is already known to be full, events are left in the ring until the poller reports it as writable
+      if (numPackets == 0) {
+         continue;
+      }
+      eventsSent.add(numPackets);
+      connection.data->eventsSent.fetch_add(numPackets, std::memory_order_relaxed);
+
+      if (!loop.flush(id, connection)) {
+         removeConnection(loop, id);
+      } else if (!connection.waitingForWrite && needsEvents(*connection.data)) {
+         // Don't block if events were left behind because of the batch size limit
+         timeout = 0;
+      }
+   }
+
+   if (deviceMask != loop.waiter.deviceMask) {
+      // Events published by newly added devices before registering didn't wake us up, so go around again
+      if (deviceMask & ~loop.waiter.deviceMask) {
+         timeout = 0;
+      }
+      setWaiterDevices(loop.waiter, deviceMask);
+   }
+
+   return timeout;
+}
+
+void Server::addWaiter(Waiter& waiter) {
+   std::lock_guard<std::mutex> lock(eventMutex);
+   waiters.push_back(&waiter);
+
+   // Shutting down may have started before the waiter was there to be woken up
+   if (shuttingDown) {
+      waiter.poller.wake();
+   }
+}
+
+void Server::removeWaiter(Waiter& waiter) {
+   setWaiterDevices(waiter, 0);
+
+   std::lock_guard<std::mutex> lock(eventMutex);
+   waiters.erase(std::find(waiters.begin(), waiters.end(), &waiter));
+}
+
+void Server::setWaiterDevices(Waiter& waiter, uint32_t deviceMask) {
+   uint32_t changedMask = waiter.deviceMask ^ deviceMask;
+   for (std::unique_ptr<Device>& device : devices) {
+      uint32_t deviceBit = 1u << device->index;
+      if (!(changedMask & deviceBit)) {
+         continue;
+      }
+
+      std::lock_guard<std::mutex> lock(device->waiterMutex);
+      if (deviceMask & deviceBit) {
+         device->waiters.push_back(&waiter);
+      } else {
+         device->waiters.erase(std::find(device->waiters.begin(), device->waiters.end(), &waiter));
+      }
+   }
+
+   waiter.deviceMask = deviceMask;
+}
+
+void Server::wakeWaiters(Device& device) {
+   // Only wake waiters that don't already have a wake-up pending, so a burst of events costs a single wake-up per waiter
+   std::lock_guard<std::mutex> lock(device.waiterMutex);
+   for (Waiter* waiter : device.waiters) {
+      if (!waiter->wakePending.exchange(true)) {
+         waiter->poller.wake();
+      }
    }
 }
 
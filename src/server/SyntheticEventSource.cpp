@@ -0,0 +1,186 @@
+#include "KontrollerSock/SyntheticEventSource.h"
+#include "KontrollerSock/Controls.h"
+
+#include <chrono>
+
+namespace KontrollerSock {
+
+namespace {
+
+// Moves back and forth between 0 and 1 in 256 steps each way
+float sweepValue(uint64_t step) {
+   uint64_t position = step % 512;
+   return (position < 256 ? position : 511 - position) / 255.0f;
+}
+
+} // namespace
+
+SyntheticEventSource::SyntheticEventSource() : SyntheticEventSource(Config{}) {
+}
+
+SyntheticEventSource::SyntheticEventSource(const Config& sourceConfig) : config(sourceConfig), running(false), random(sourceConfig.seed), state{}, eventsGenerated(0), litLEDs(0) {
+}
+
+SyntheticEventSource::~SyntheticEventSource() {
+   stop();
+}
+
+void SyntheticEventSource::start() {
+   if (!running.exchange(true)) {
+      thread = std::thread([this]() { run(); });
+   }
+}
+
+void SyntheticEventSource::stop() {
+   running = false;
+   if (thread.joinable()) {
+      thread.join();
+   }
+}
+
+Kontroller::State SyntheticEventSource::getState() {
+   std::lock_guard<std::mutex> lock(stateMutex);
+   return state;
+}
+
+void SyntheticEventSource::setButtonCallback(ButtonCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   buttonCallback = std::move(callback);
+}
+
+void SyntheticEventSource::setDialCallback(DialCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   dialCallback = std::move(callback);
+}
+
+void SyntheticEventSource::setSliderCallback(SliderCallback callback) {
+   std::lock_guard<std::mutex> lock(callbackMutex);
+   sliderCallback = std::move(callback);
+}
+
+bool SyntheticEventSource::enableLEDControl(bool /*enable*/) {
+   return true;
+}
+
+void SyntheticEventSource::setLED(Kontroller::LED led, bool on) {
+   if (on) {
+      litLEDs.fetch_or(getLEDMask(led), std::memory_order_relaxed);
+   } else {
+      litLEDs.fetch_and(~getLEDMask(led), std::memory_order_relaxed);
+   }
+}
+
+void SyntheticEventSource::run() {
+   std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+   uint64_t numGenerated = 0;
+
+   while (running) {
+      // Work out how many events should have been generated by now, and catch up
+      uint64_t target = numGenerated + 1024;
+      if (config.eventsPerSecond > 0.0) {
+         double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+         target = static_cast<uint64_t>(elapsed * config.eventsPerSecond);
+
+         // Bursts are only released once all of their events are due
+         if (config.pattern == Pattern::kBursts && config.burstSize > 1) {
+            target -= target % config.burstSize;
+         }
+      }
+
+      while (numGenerated < target && running) {
+         generate(numGenerated++);
+         eventsGenerated.store(numGenerated, std::memory_order_relaxed);
+      }
+
+      if (config.eventsPerSecond > 0.0) {
+         std::this_thread::sleep_for(std::chrono::microseconds(500));
+      }
+   }
+}
+
+void SyntheticEventSource::generate(uint64_t index) {
+   std::lock_guard<std::mutex> callbackLock(callbackMutex);
+
+   switch (config.pattern) {
+   case Pattern::kSliderSweep: {
+      int group = static_cast<int>(index % kNumGroups);
+      float value = sweepValue(index / kNumGroups);
+      {
+         std::lock_guard<std::mutex> lock(stateMutex);
+         getControlValue<float>(state, kSliderControls[group]) = value;
+      }
+
+      if (sliderCallback) {
+         sliderCallback(static_cast<Kontroller::Slider>(kSliderControls[group].id), value);
+      }
+      break;
+   }
+   case Pattern::kButtonMash: {
+      int buttonIndex = static_cast<int>(random() % kNumButtons);
+      bool pressed = false;
+      {
+         std::lock_guard<std::mutex> lock(stateMutex);
+         bool& value = getControlValue<bool>(state, kButtonControls[buttonIndex]);
+         value = !value;
+         pressed = value;
+      }
+
+      if (buttonCallback) {
+         buttonCallback(static_cast<Kontroller::Button>(kButtonControls[buttonIndex].id), pressed);
+      }
+      break;
+   }
+   case Pattern::kBursts: {
+      int group = static_cast<int>(random() % kNumGroups);
+      bool dial = (random() & 1) != 0;
+      float value = (random() % 1024) / 1023.0f;
+      {
+         std::lock_guard<std::mutex> lock(stateMutex);
+         if (dial) {
+            getControlValue<float>(state, kDialControls[group]) = value;
+         } else {
+            getControlValue<float>(state, kSliderControls[group]) = value;
+         }
+      }
+
+      if (dial && dialCallback) {
+         dialCallback(static_cast<Kontroller::Dial>(kDialControls[group].id), value);
+      } else if (!dial && sliderCallback) {
+         sliderCallback(static_cast<Kontroller::Slider>(kSliderControls[group].id), value);
+      }
+      break;
+   }
+   case Pattern::kInterleaved: {
+      // The order is fixed, so that clients can tell if any events were delivered out of order
+      uint64_t step = index / 2;
+      if (index % 2 == 0) {
+         int group = static_cast<int>(step % kNumGroups);
+         float value = sweepValue(step / kNumGroups);
+         {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            getControlValue<float>(state, kSliderControls[group]) = value;
+         }
+
+         if (sliderCallback) {
+            sliderCallback(static_cast<Kontroller::Slider>(kSliderControls[group].id), value);
+         }
+      } else {
+         int buttonIndex = static_cast<int>(step % kNumButtons);
+         bool pressed = false;
+         {
+            std::lock_guard<std::mutex> lock(stateMutex);
+            bool& value = getControlValue<bool>(state, kButtonControls[buttonIndex]);
+            value = !value;
+            pressed = value;
+         }
+
+         if (buttonCallback) {
+            buttonCallback(static_cast<Kontroller::Button>(kButtonControls[buttonIndex].id), pressed);
+         }
+      }
+      break;
+   }
+   }
+}
+
+} // namespace KontrollerSock